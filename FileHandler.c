@@ -5,6 +5,7 @@
  ******************************************************************************/
 
 #include "FileHandler.h"
+#include "camera/trace.h"
 
  /******************************************************************************
  *
@@ -14,11 +15,14 @@
  *                  id - the ID of the spawned process
  *                  error - place to store error information 
  *  Outputs:       	TRUE on success, FALSE if error is set.
- *  Routines Called: g_spawn_sync
+ *  Routines Called: traceBegin, g_spawn_sync, traceEnd
  *
  *****************************************************************************/
 gboolean printImage(char * toPrint, GError *error)
 {
+	gboolean result;
+	gint64 start;
+
 	/* Setup the argument strings. */
 	char cmd[4] = "lpr";
 	char o[3] = "-o";
@@ -33,7 +37,11 @@ gboolean printImage(char * toPrint, GError *error)
 	args[4] = '\0';
 
     /* Spawn a new process, to be run asynchronously. */
-	return g_spawn_sync (NULL, args, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL, NULL, NULL, NULL, &error);	
+	start = traceBegin ();
+	result = g_spawn_sync (NULL, args, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL, NULL, NULL, NULL, &error);
+	traceEnd ("printImage", start);
+
+	return result;
 }
 
  /******************************************************************************
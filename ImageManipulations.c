@@ -4,135 +4,1603 @@
  * 	 @authors -	David M. Winiarski - dmw1407@rit.edu
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <linux/videodev2.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include "camera/frame.h"
+#include "camera/resize.h"
+#include "camera/cam.h"
+#include "camera/trace.h"
 #include "ImageManipulations.h"
 
-char cnvCmd[8] = "convert";
+#if defined(__x86_64__) || defined(__i386__)
+#define IMAGE_X86
+#include <tmmintrin.h>
+#endif
+
+/* JPEG quality of the effect images */
+#define EFFECT_JPEG_QUALITY 85
+
+/* Radius of the oil paint window, like convert -paint 3 */
+#define OIL_PAINT_RADIUS 3
+
+/* Number of intensity levels counted by the oil paint histogram */
+#define OIL_PAINT_LEVELS 32
+
+/* Maximum number of threads sharing the tiles of an image */
+#define MAX_TILE_THREADS 16
+
+/* Number of rows in a tile */
+#define TILE_ROWS 16
+
+/* Radius of the Gaussian blur of the charcoal edges */
+#define CHARCOAL_RADIUS 3
+
+/* Fraction of the pixels clipped to black and to white when the charcoal
+ * levels are normalized, as convert -normalize does */
+#define CHARCOAL_BLACK_POINT 0.02
+#define CHARCOAL_WHITE_POINT 0.01
+
+/* Sizes of the effect thumbnails shown by the effects screen */
+#define EFFECT_SMALL_DIM "160x120"
+#define EFFECT_LARGE_DIM "640x480"
+
+/* An effect computed from a decoded photo, returns a new RGB24 frame, or
+ * NULL once cancelled is set */
+typedef VidFrame *(*EffectFunc) (VidFrame *source, gpointer effectData,
+	const volatile gint *cancelled);
+
+/* Progress of an image job */
+typedef enum {
+	IMAGE_JOB_QUEUED,
+	IMAGE_JOB_RUNNING,
+	IMAGE_JOB_FINISHED
+} ImageJobState;
+
+/* An effect, from its submission until it is reported */
+typedef struct _ImageJob {
+	guint id;
+	gint priority;
+	ImageJobState state;
+	volatile gint cancelled;
+	gchar *inImage;
+	gchar *outImage;
+	gchar *outSmall;
+	gchar *outLarge;
+	EffectFunc effect;
+	gpointer effectData;
+	const char *name;
+	ImageJobDoneFunc done;
+	gpointer data;
+	ImageJobStatus status;
+	VidFrame *small;
+	VidFrame *large;
+	struct _ImageJob *next;
+} ImageJob;
+
+/* Processes the rows [first, last) of an image */
+typedef void (*TileFunc) (gpointer context, int first, int last);
+
+/* Tiles of an image shared by a group of threads */
+typedef struct {
+	TileFunc func;
+	gpointer context;
+	int rows;
+	int next;
+	const volatile gint *cancelled;
+} TileScheduler;
+
+/* Oil paint of an image */
+typedef struct {
+	VidFrame *source;
+	VidFrame *result;
+	unsigned char *levels;
+} OilPaint;
+
+/* Charcoal drawing of an image, one plane per step of the pipeline */
+typedef struct {
+	VidFrame *source;
+	VidFrame *result;
+	int width;
+	int height;
+	unsigned char *gray;
+	unsigned char *edges;
+	unsigned char *blurred;
+	int histogram[256];
+	unsigned char levels[256];
+} Charcoal;
+
+/* Hard light blend of a texture over a photo */
+typedef struct {
+	VidFrame *source;
+	VidFrame *texture;
+	VidFrame *result;
+} TextureBlend;
+
+/* Converts a row of RGB24 pixels to gray, picked for the processor */
+static void (*gray_row) (const unsigned char *s, unsigned char *d,
+	int width) = NULL;
+
+/* Blends a row of texture over a row of photo, picked for the processor */
+static void (*hard_light_row) (const unsigned char *s,
+	const unsigned char *t, unsigned char *d, int n) = NULL;
+
+/* The texture as decoded, and tiled over a photo */
+static VidFrame *texture_tile = NULL;
+static VidFrame *texture_cache = NULL;
+
+/* The jobs not reported yet, in submission order, and their worker */
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static ImageJob *job_list = NULL;
+static guint job_last_id = 0;
+static gboolean job_worker_started = FALSE;
+
+/* Set by image_job_shutdown, the worker exits and signals job_exit_cond */
+static gboolean job_stopping = FALSE;
+static pthread_cond_t job_exit_cond = PTHREAD_COND_INITIALIZER;
+
+/* Gaussian of sigma 1, in 256ths */
+static const int charcoal_kernel[2 * CHARCOAL_RADIUS + 1] =
+	{ 1, 14, 62, 102, 62, 14, 1 };
+
+/******************************************************************************
+ *
+ *  Function:       image_dim_parse
+ *  Description:    This function reads image dimensions like "640x480".
+ *  Inputs:         imageDim - the image dimensions
+ *                  size - receives the dimensions
+ *  Outputs:        0 on success, non-zero on error.
+ *  Routines Called: sscanf
+ *
+ *****************************************************************************/
+static int image_dim_parse(char * imageDim, VidSize *size)
+{
+	if (sscanf (imageDim, "%dx%d", &size->width, &size->height) != 2 ||
+		size->width <= 0 || size->height <= 0)
+	{
+		return -1;
+	}
+
+	return 0;
+}
+
+/******************************************************************************
+ *
+ *  Function:       write_resized_jpg
+ *  Description:    This function writes a smaller copy of a frame, which
+ *					fits in a box and keeps the aspect ratio of the frame,
+ *					like convert -resize does.
+ *  Inputs:         source - the RGB24 frame to resize
+ *                  outImage - the resized image
+ *                  imageDim - the image dimensions, e.g. "640x480"
+ *                  quality - the JPEG quality of outImage
+ *                  image - receives the resized frame if not NULL
+ *  Outputs:        0 on success, non-zero on error.
+ *  Routines Called: image_dim_parse, vidFrameResize, write_jpg,
+ *                  vidFrameRelease
+ *
+ *****************************************************************************/
+static int write_resized_jpg(VidFrame *source, char * outImage,
+	char * imageDim, int quality, VidFrame **image)
+{
+	VidFrame *resized;
+	VidSize size;
+	VidSize box;
+	int maxWidth, maxHeight;
+	int failed;
+
+	/* Read the requested bounding box. */
+	if (image_dim_parse (imageDim, &box))
+	{
+		return -1;
+	}
+	maxWidth = box.width;
+	maxHeight = box.height;
+
+	/* Fit the image in the box, keeping its aspect ratio. */
+	size.width = maxWidth;
+	size.height = (source->size.height * maxWidth + source->size.width / 2)
+		/ source->size.width;
+	if (size.height > maxHeight)
+	{
+		size.height = maxHeight;
+		size.width = (source->size.width * maxHeight + source->size.height / 2)
+			/ source->size.height;
+	}
+	if (size.width < 1) size.width = 1;
+	if (size.height < 1) size.height = 1;
+
+	/* Resize and write the image. */
+	resized = vidFrameCreate ();
+	failed = vidFrameResize (source, resized, &size, VID_RESIZE_BOX) ||
+		write_jpg (resized, outImage, quality);
+
+	/* Keep the frame for display rather than decoding the file again. */
+	if (image != NULL && !failed)
+		*image = resized;
+	else
+		vidFrameRelease (&resized);
+
+	return failed;
+}
 
 /******************************************************************************
  *
- *  Function:       resizeImages
- *  Description:    This function will create a two smaller copies of the
- *					original photo.
- *  Inputs:         inImage - the image to resize
- *                  outImage - the resized image
- *                  imageDim - the image dimensions 
- *                  error - place to store error information
- *  Outputs:        TRUE on success, FALSE if error is set.
- *  Routines Called: g_spawn_sync
- *
- *****************************************************************************/
-gboolean image_resize(char * inImage, char * outImage, char * imageDim, GError *error)
-{
-	/* Setup argument strings. */
-	char resize[8] = "-resize";	
-	/* Setup the arguments for the commands. */
-	char * args[6];
-	args[0] = cnvCmd;
-	args[1] = inImage;
-	args[2] = resize;
-	args[3] = imageDim;
-	args[4] = outImage;
-	args[5] = '\0';
-
-    return g_spawn_sync (NULL, args, NULL, G_SPAWN_SEARCH_PATH, NULL, NULL, NULL, NULL, NULL, &error);
-}
+ *  Function:       tile_thread_count
+ *  Description:    This function returns the number of threads used to
+ *					process the tiles of an image.
+ *  Inputs:         
+ *  Outputs:        the number of online processors, at least 1.
+ *  Routines Called: sysconf
+ *
+ *****************************************************************************/
+static int tile_thread_count(void)
+{
+	long count = sysconf (_SC_NPROCESSORS_ONLN);
+
+	if (count < 1) count = 1;
+	if (count > MAX_TILE_THREADS) count = MAX_TILE_THREADS;
+
+	return (int)count;
+}
+
+/******************************************************************************
+ *
+ *  Function:       tile_thread
+ *  Description:    This function processes tiles until none is left, or
+ *					the job is cancelled. Each thread claims the next tile
+ *					for itself, so a thread which gets cheap tiles simply
+ *					takes more of them.
+ *  Inputs:         arg - the TileScheduler
+ *  Outputs:        
+ *  Routines Called: __sync_fetch_and_add
+ *
+ *****************************************************************************/
+static void *tile_thread(void *arg)
+{
+	TileScheduler *scheduler = arg;
+	int first;
+
+	while (!*scheduler->cancelled &&
+		(first = __sync_fetch_and_add (&scheduler->next, TILE_ROWS))
+		< scheduler->rows)
+	{
+		scheduler->func (scheduler->context, first,
+			MIN (first + TILE_ROWS, scheduler->rows));
+	}
+
+	return NULL;
+}
+
+/******************************************************************************
+ *
+ *  Function:       run_tiles
+ *  Description:    This function splits the rows of an image in tiles of
+ *					TILE_ROWS rows and processes them on all the processors.
+ *					It returns once every tile is done.
+ *  Inputs:         func - the function processing one tile
+ *                  context - passed to func
+ *                  rows - the number of rows of the image
+ *                  cancelled - stops the tiles not started yet once set
+ *  Outputs:        
+ *  Routines Called: tile_thread_count, pthread_create, tile_thread,
+ *                  pthread_join
+ *
+ *****************************************************************************/
+static void run_tiles(TileFunc func, gpointer context, int rows,
+	const volatile gint *cancelled)
+{
+	pthread_t threads[MAX_TILE_THREADS];
+	TileScheduler scheduler;
+	int tiles = (rows + TILE_ROWS - 1) / TILE_ROWS;
+	int count = tile_thread_count ();
+	int started = 0;
+	int i;
+
+	scheduler.func = func;
+	scheduler.context = context;
+	scheduler.rows = rows;
+	scheduler.next = 0;
+	scheduler.cancelled = cancelled;
+
+	if (count > tiles) count = tiles;
+
+	/* Helper threads, this one works too. */
+	for (i = 1; i < count; i++)
+	{
+		if (pthread_create (&threads[started], NULL, tile_thread,
+			&scheduler) == 0)
+		{
+			started++;
+		}
+	}
+
+	tile_thread (&scheduler);
+
+	for (i = 0; i < started; i++)
+		pthread_join (threads[i], NULL);
+}
+
+/******************************************************************************
+ *
+ *  Function:       create_rgb_frame
+ *  Description:    This function creates an RGB24 frame of the given size.
+ *  Inputs:         width - the width of the frame
+ *                  height - the height of the frame
+ *  Outputs:        the new frame.
+ *  Routines Called: vidFrameCreate, vidFrameResizeBuffer
+ *
+ *****************************************************************************/
+static VidFrame *create_rgb_frame(int width, int height)
+{
+	VidFrame *frame = vidFrameCreate ();
+
+	vidFrameResizeBuffer (frame, width * height * 3);
+	frame->format = V4L2_PIX_FMT_RGB24;
+	frame->size.width = width;
+	frame->size.height = height;
+	frame->bytesperline = width * 3;
+	frame->imagesize = width * height * 3;
+
+	return frame;
+}
+
+/******************************************************************************
+ *
+ *  Function:       image_job_complete_idle
+ *  Description:    Callback function which reports a finished job to the
+ *					caller, from the main loop. A job cancelled before this
+ *					runs is reported as cancelled, even if it completed.
+ *  Inputs:         arg - the ImageJob
+ *  Outputs:        FALSE to run only once.
+ *  Routines Called: pthread_mutex_lock, pthread_mutex_unlock,
+ *                  vidFrameRelease, g_free
+ *
+ *****************************************************************************/
+static gboolean image_job_complete_idle(gpointer arg)
+{
+	ImageJob *job = arg;
+	ImageJob **link;
+
+	/* Forget the job, its id is not valid anymore. */
+	pthread_mutex_lock (&job_lock);
+	for (link = &job_list; *link != job; link = &(*link)->next);
+	*link = job->next;
+	pthread_mutex_unlock (&job_lock);
+
+	if (job->cancelled)
+		job->status = IMAGE_JOB_CANCELLED;
+	if (job->status != IMAGE_JOB_DONE)
+	{
+		/* Only hand out the images of a complete job. */
+		if (job->small != NULL)
+			vidFrameRelease (&job->small);
+		if (job->large != NULL)
+			vidFrameRelease (&job->large);
+	}
+	job->done (job->id, job->status, job->small, job->large, job->data);
+
+	/* The done function owns the images now. */
+
+	g_free (job->inImage);
+	g_free (job->outImage);
+	g_free (job->outSmall);
+	g_free (job->outLarge);
+	g_free (job);
+
+	return FALSE;
+}
+
+/******************************************************************************
+ *
+ *  Function:       image_job_run
+ *  Description:    This function decodes the photo, applies the effect and
+ *					writes the result and its smaller copies, which are kept
+ *					for display. The job stops between steps once it is
+ *					cancelled.
+ *  Inputs:         job - the ImageJob
+ *  Outputs:        the status of the job.
+ *  Routines Called: read_jpg, write_jpg, write_resized_jpg,
+ *                  vidFrameRelease
+ *
+ *****************************************************************************/
+static ImageJobStatus image_job_run(ImageJob *job)
+{
+	VidFrame *source;
+	VidFrame *result;
+	int failed;
+
+	source = read_jpg (job->inImage);
+	if (source == NULL)
+	{
+		return IMAGE_JOB_FAILED;
+	}
+
+	result = job->effect (source, job->effectData, &job->cancelled);
+	vidFrameRelease (&source);
+
+	if (result == NULL)
+	{
+		return job->cancelled ? IMAGE_JOB_CANCELLED : IMAGE_JOB_FAILED;
+	}
+
+	/* Every image is shrunk from the same frame. */
+	failed = (job->outImage != NULL && !job->cancelled &&
+			write_jpg (result, job->outImage, EFFECT_JPEG_QUALITY)) ||
+		(job->outSmall != NULL && !job->cancelled &&
+			write_resized_jpg (result, job->outSmall, EFFECT_SMALL_DIM,
+				EFFECT_JPEG_QUALITY, &job->small)) ||
+		(job->outLarge != NULL && !job->cancelled &&
+			write_resized_jpg (result, job->outLarge, EFFECT_LARGE_DIM,
+				EFFECT_JPEG_QUALITY, &job->large));
+
+	vidFrameRelease (&result);
+
+	if (job->cancelled)
+		return IMAGE_JOB_CANCELLED;
+	return failed ? IMAGE_JOB_FAILED : IMAGE_JOB_DONE;
+}
+
+/******************************************************************************
+ *
+ *  Function:       image_job_worker
+ *  Description:    This function runs the queued jobs one at a time, the
+ *					highest priority first, until image_job_shutdown.
+ *					A job already uses every processor for its tiles.
+ *  Inputs:         arg - unused
+ *  Outputs:        
+ *  Routines Called: pthread_mutex_lock, pthread_cond_wait,
+ *                  pthread_cond_broadcast, pthread_mutex_unlock, traceBegin,
+ *                  image_job_run, traceEnd, g_idle_add
+ *
+ *****************************************************************************/
+static void *image_job_worker(void *arg)
+{
+	ImageJob *job;
+	ImageJob *best;
+	int64_t start;
+
+	pthread_mutex_lock (&job_lock);
+	while (!job_stopping)
+	{
+		/* Take the oldest of the jobs with the highest priority. */
+		best = NULL;
+		for (job = job_list; job != NULL; job = job->next)
+		{
+			if (job->state == IMAGE_JOB_QUEUED &&
+				(best == NULL || job->priority > best->priority))
+			{
+				best = job;
+			}
+		}
+
+		if (best == NULL)
+		{
+			pthread_cond_wait (&job_cond, &job_lock);
+			continue;
+		}
+
+		best->state = IMAGE_JOB_RUNNING;
+		pthread_mutex_unlock (&job_lock);
+
+		start = traceBegin ();
+		best->status = image_job_run (best);
+		traceEnd (best->name, start);
+
+		pthread_mutex_lock (&job_lock);
+		best->state = IMAGE_JOB_FINISHED;
+
+		/* Report back on the main loop. */
+		g_idle_add (image_job_complete_idle, best);
+	}
+
+	/* Nothing the jobs use may be freed before this. */
+	job_worker_started = FALSE;
+	pthread_cond_broadcast (&job_exit_cond);
+	pthread_mutex_unlock (&job_lock);
+
+	return NULL;
+}
+
+/******************************************************************************
+ *
+ *  Function:       image_job_submit
+ *  Description:    This function queues a job for the worker thread, which
+ *					is started with the first job.
+ *  Inputs:         inImage - the image to process
+ *                  outImage - the processed image, or NULL
+ *                  outSmall - the 160x120 copy of outImage, or NULL
+ *                  outLarge - the 640x480 copy of outImage, or NULL
+ *                  effect - the effect function
+ *                  effectData - passed to the effect function
+ *                  name - the name of the job in the trace
+ *                  priority - jobs with a higher priority run first
+ *                  done - called on the main loop once the job is over
+ *                  data - passed to done
+ *  Outputs:        the id of the job, 0 if it could not be queued.
+ *  Routines Called: g_new0, g_strdup, pthread_mutex_lock, pthread_create,
+ *                  pthread_cond_signal, pthread_mutex_unlock, g_free
+ *
+ *****************************************************************************/
+static guint image_job_submit(char * inImage, char * outImage,
+	char * outSmall, char * outLarge, EffectFunc effect, gpointer effectData,
+	const char * name, gint priority, ImageJobDoneFunc done, gpointer data)
+{
+	ImageJob *job = g_new0 (ImageJob, 1);
+	ImageJob **link;
+	pthread_attr_t attr;
+	pthread_t thread;
+	guint id = 0;
+
+	job->inImage = g_strdup (inImage);
+	job->outImage = g_strdup (outImage);
+	job->outSmall = g_strdup (outSmall);
+	job->outLarge = g_strdup (outLarge);
+	job->effect = effect;
+	job->effectData = effectData;
+	job->name = name;
+	job->priority = priority;
+	job->done = done;
+	job->data = data;
+	job->state = IMAGE_JOB_QUEUED;
+
+	pthread_mutex_lock (&job_lock);
+
+	/* Nobody waits for the worker, it reports through the main loop. */
+	if (!job_worker_started && !job_stopping)
+	{
+		pthread_attr_init (&attr);
+		pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+		job_worker_started =
+			pthread_create (&thread, &attr, image_job_worker, NULL) == 0;
+		pthread_attr_destroy (&attr);
+	}
+
+	if (job_worker_started)
+	{
+		/* Ids are never 0, like the ids of the main loop sources. */
+		if (++job_last_id == 0)
+			++job_last_id;
+		id = job->id = job_last_id;
+
+		for (link = &job_list; *link != NULL; link = &(*link)->next);
+		*link = job;
+		pthread_cond_signal (&job_cond);
+	}
+
+	pthread_mutex_unlock (&job_lock);
+
+	if (id == 0)
+	{
+		g_free (job->inImage);
+		g_free (job->outImage);
+		g_free (job->outSmall);
+		g_free (job->outLarge);
+		g_free (job);
+	}
+
+	return id;
+}
+
+/******************************************************************************
+ *
+ *  Function:       image_job_find
+ *  Description:    This function finds a job which was not reported yet.
+ *					The job lock must be held.
+ *  Inputs:         id - the id of the job
+ *  Outputs:        the job, NULL if there is none with this id.
+ *  Routines Called: 
+ *
+ *****************************************************************************/
+static ImageJob *image_job_find(guint id)
+{
+	ImageJob *job;
+
+	for (job = job_list; job != NULL && job->id != id; job = job->next);
+
+	return job;
+}
+
+/******************************************************************************
+ *
+ *  Function:       image_job_cancel
+ *  Description:    This function cancels a job. A queued job never runs,
+ *					a running job stops at its next step, and either way
+ *					its done function gets IMAGE_JOB_CANCELLED. Must be
+ *					called from the main loop.
+ *  Inputs:         id - the id of the job
+ *  Outputs:        TRUE if the job was not reported yet, FALSE otherwise.
+ *  Routines Called: pthread_mutex_lock, image_job_find, g_idle_add,
+ *                  pthread_mutex_unlock
+ *
+ *****************************************************************************/
+gboolean image_job_cancel(guint id)
+{
+	ImageJob *job;
+
+	pthread_mutex_lock (&job_lock);
+
+	job = image_job_find (id);
+	if (job != NULL && !job->cancelled)
+	{
+		job->cancelled = 1;
+
+		/* The worker will not see it, report it now. */
+		if (job->state == IMAGE_JOB_QUEUED)
+		{
+			job->state = IMAGE_JOB_FINISHED;
+			g_idle_add (image_job_complete_idle, job);
+		}
+	}
+
+	pthread_mutex_unlock (&job_lock);
+
+	return job != NULL;
+}
+
+/******************************************************************************
+ *
+ *  Function:       image_job_set_priority
+ *  Description:    This function changes the priority of a queued job.
+ *  Inputs:         id - the id of the job
+ *                  priority - jobs with a higher priority run first
+ *  Outputs:        TRUE if the job is still queued, FALSE otherwise.
+ *  Routines Called: pthread_mutex_lock, image_job_find,
+ *                  pthread_mutex_unlock
+ *
+ *****************************************************************************/
+gboolean image_job_set_priority(guint id, gint priority)
+{
+	ImageJob *job;
+	gboolean queued;
+
+	pthread_mutex_lock (&job_lock);
+
+	job = image_job_find (id);
+	queued = job != NULL && job->state == IMAGE_JOB_QUEUED;
+	if (queued)
+		job->priority = priority;
+
+	pthread_mutex_unlock (&job_lock);
+
+	return queued;
+}
+
+/******************************************************************************
+ *
+ *  Function:       image_job_shutdown
+ *  Description:    This function cancels every job and waits for the
+ *					worker to stop, so that what the jobs use, like the
+ *					texture, can be freed. No job runs afterwards, and the
+ *					cancelled jobs are not reported. Called once the main
+ *					loop is over.
+ *  Inputs:         
+ *  Outputs:        
+ *  Routines Called: pthread_mutex_lock, pthread_cond_signal,
+ *                  pthread_cond_wait, pthread_mutex_unlock
+ *
+ *****************************************************************************/
+void image_job_shutdown(void)
+{
+	ImageJob *job;
+
+	pthread_mutex_lock (&job_lock);
+
+	/* A running job stops at its next step. */
+	for (job = job_list; job != NULL; job = job->next)
+		job->cancelled = 1;
+
+	job_stopping = TRUE;
+	pthread_cond_signal (&job_cond);
+	while (job_worker_started)
+		pthread_cond_wait (&job_exit_cond, &job_lock);
+
+	pthread_mutex_unlock (&job_lock);
+}
+
+/******************************************************************************
+ *
+ *  Function:       oil_paint_column
+ *  Description:    This function adds or removes one column of the window
+ *					to the oil paint histogram.
+ *  Inputs:         paint - the oil paint
+ *                  x - the column
+ *                  top, bottom - the first and last rows of the window
+ *                  sign - 1 to add the column, -1 to remove it
+ *                  count - pixels per intensity level
+ *                  sum - color sums per intensity level
+ *  Outputs:        
+ *  Routines Called: 
+ *
+ *****************************************************************************/
+static void oil_paint_column(OilPaint *paint, int x, int top, int bottom,
+	int sign, int count[], int sum[][3])
+{
+	int width = paint->source->size.width;
+	int stride = paint->source->bytesperline;
+	unsigned char *s;
+	int y, level;
+
+	for (y = top; y <= bottom; y++)
+	{
+		s = paint->source->data + y * stride + x * 3;
+		level = paint->levels[y * width + x];
+		count[level] += sign;
+		sum[level][0] += sign * s[0];
+		sum[level][1] += sign * s[1];
+		sum[level][2] += sign * s[2];
+	}
+}
+
+/******************************************************************************
+ *
+ *  Function:       oil_paint_tile
+ *  Description:    This function paints a tile of rows. Every pixel takes
+ *					the average color of the most frequent intensity level
+ *					in the window around it. The histogram slides along
+ *					the row, one column in and one column out per pixel.
+ *  Inputs:         context - the OilPaint
+ *                  first, last - the rows [first, last) to paint
+ *  Outputs:        
+ *  Routines Called: oil_paint_column, memset
+ *
+ *****************************************************************************/
+static void oil_paint_tile(gpointer context, int first, int last)
+{
+	OilPaint *paint = context;
+	int width = paint->source->size.width;
+	int height = paint->source->size.height;
+	int count[OIL_PAINT_LEVELS];
+	int sum[OIL_PAINT_LEVELS][3];
+	int x, y, level, best, top, bottom;
+	unsigned char *d;
+
+	for (y = first; y < last; y++)
+	{
+		top = MAX (y - OIL_PAINT_RADIUS, 0);
+		bottom = MIN (y + OIL_PAINT_RADIUS, height - 1);
+
+		/* Fill the window of the first pixel. */
+		memset (count, 0, sizeof (count));
+		memset (sum, 0, sizeof (sum));
+		for (x = 0; x <= OIL_PAINT_RADIUS && x < width; x++)
+			oil_paint_column (paint, x, top, bottom, 1, count, sum);
+
+		d = paint->result->data + y * paint->result->bytesperline;
+		for (x = 0; x < width; x++)
+		{
+			/* Find the most frequent level. */
+			best = 0;
+			for (level = 1; level < OIL_PAINT_LEVELS; level++)
+			{
+				if (count[level] > count[best])
+					best = level;
+			}
+
+			d[0] = sum[best][0] / count[best];
+			d[1] = sum[best][1] / count[best];
+			d[2] = sum[best][2] / count[best];
+			d += 3;
+
+			/* Slide the window one pixel to the right. */
+			if (x - OIL_PAINT_RADIUS >= 0)
+				oil_paint_column (paint, x - OIL_PAINT_RADIUS, top, bottom, -1,
+					count, sum);
+			if (x + OIL_PAINT_RADIUS + 1 < width)
+				oil_paint_column (paint, x + OIL_PAINT_RADIUS + 1, top, bottom,
+					1, count, sum);
+		}
+	}
+}
+
+/******************************************************************************
+ *
+ *  Function:       oil_paint
+ *  Description:    This function creates an oil painted copy of a frame.
+ *  Inputs:         source - the RGB24 frame to paint
+ *                  effectData - unused
+ *                  cancelled - stops the painting once set
+ *  Outputs:        the new frame, NULL if cancelled.
+ *  Routines Called: create_rgb_frame, run_tiles, oil_paint_tile,
+ *                  vidFrameRelease
+ *
+ *****************************************************************************/
+static VidFrame *oil_paint(VidFrame *source, gpointer effectData,
+	const volatile gint *cancelled)
+{
+	int width = source->size.width;
+	int height = source->size.height;
+	OilPaint paint;
+	unsigned char *s;
+	int x, y;
+
+	paint.source = source;
+	paint.result = create_rgb_frame (width, height);
+	paint.levels = malloc (width * height);
+
+	/* Intensity level of every pixel, shared by all the tiles. */
+	for (y = 0; y < height; y++)
+	{
+		s = source->data + y * source->bytesperline;
+		for (x = 0; x < width; x++, s += 3)
+		{
+			paint.levels[y * width + x] =
+				((s[0] * 77 + s[1] * 150 + s[2] * 29) >> 8) *
+				OIL_PAINT_LEVELS >> 8;
+		}
+	}
+
+	run_tiles (oil_paint_tile, &paint, height, cancelled);
+
+	free (paint.levels);
+
+	if (*cancelled)
+		vidFrameRelease (&paint.result);
+
+	return paint.result;
+}
   /******************************************************************************
  *
  *  Function:       create_oil_blob_image
- *  Description:    This function will create an oil blob version of the provided
- *					image.
- *  Inputs:         inImage - the image to paint, 
- *                  outImage - the oil painted image
- *                  id - the ID of the spawned process
- *                  error - place to store error information
- *  Outputs:        TRUE on success, FALSE if error is set.
- *  Routines Called: g_spawn_async
+ *  Description:    This function will create an oil blob version of the provided
+ *					image, with the small and large copies shown by the
+ *					effects screen. The image is painted in the background,
+ *					one tile of rows at a time on every processor.
+ *  Inputs:         inImage - the image to paint, 
+ *                  outImage - the oil painted image
+ *                  outSmall - the 160x120 copy of outImage
+ *                  outLarge - the 640x480 copy of outImage
+ *                  priority - jobs with a higher priority run first
+ *                  done - called from the main loop once the images are
+ *					written, or the job is cancelled
+ *                  data - passed to done
+ *  Outputs:        the id of the job, 0 if it could not be queued.
+ *  Routines Called: image_job_submit
+ *
+ *****************************************************************************/
+guint create_oil_blob_image(char * inImage, char * outImage,
+	char * outSmall, char * outLarge, gint priority, ImageJobDoneFunc done,
+	gpointer data)
+{
+	/* Paint on the worker thread, report on the main loop. */
+	return image_job_submit (inImage, outImage, outSmall, outLarge,
+		oil_paint, NULL, "create_oil_blob_image", priority, done, data);
+}
+
+/******************************************************************************
+ *
+ *  Function:       gray_row_c
+ *  Description:    This function converts a row of RGB24 pixels to gray.
+ *  Inputs:         s - the RGB24 pixels
+ *                  d - the gray pixels
+ *                  width - the number of pixels
+ *  Outputs:        
+ *  Routines Called: 
+ *
+ *****************************************************************************/
+static void gray_row_c(const unsigned char *s, unsigned char *d, int width)
+{
+	int x;
+
+	for (x = 0; x < width; x++, s += 3)
+		d[x] = (s[0] * 77 + s[1] * 150 + s[2] * 29 + 128) >> 8;
+}
+
+#ifdef IMAGE_X86
+
+/******************************************************************************
+ *
+ *  Function:       gray_row_ssse3
+ *  Description:    This function converts a row of RGB24 pixels to gray,
+ *					16 pixels at a time. Three loads hold 16 pixels, pshufb
+ *					gathers each channel of them in a register of its own,
+ *					then the channels are weighted on 16 bits.
+ *  Inputs:         s - the RGB24 pixels
+ *                  d - the gray pixels
+ *                  width - the number of pixels
+ *  Outputs:        
+ *  Routines Called: gray_row_c
+ *
+ *****************************************************************************/
+__attribute__((target("ssse3")))
+static void gray_row_ssse3(const unsigned char *s, unsigned char *d,
+	int width)
+{
+	const __m128i r0 = _mm_setr_epi8 (0, 3, 6, 9, 12, 15,
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+	const __m128i r1 = _mm_setr_epi8 (-1, -1, -1, -1, -1, -1,
+		2, 5, 8, 11, 14, -1, -1, -1, -1, -1);
+	const __m128i r2 = _mm_setr_epi8 (-1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		-1, 1, 4, 7, 10, 13);
+	const __m128i g0 = _mm_setr_epi8 (1, 4, 7, 10, 13,
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+	const __m128i g1 = _mm_setr_epi8 (-1, -1, -1, -1, -1,
+		0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1);
+	const __m128i g2 = _mm_setr_epi8 (-1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		-1, 2, 5, 8, 11, 14);
+	const __m128i b0 = _mm_setr_epi8 (2, 5, 8, 11, 14,
+		-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+	const __m128i b1 = _mm_setr_epi8 (-1, -1, -1, -1, -1,
+		1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1);
+	const __m128i b2 = _mm_setr_epi8 (-1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+		0, 3, 6, 9, 12, 15);
+	const __m128i zero = _mm_setzero_si128 ();
+	const __m128i wr = _mm_set1_epi16 (77);
+	const __m128i wg = _mm_set1_epi16 (150);
+	const __m128i wb = _mm_set1_epi16 (29);
+	const __m128i round = _mm_set1_epi16 (128);
+	__m128i a, b, c, r, g, bl, lo, hi;
+	int x;
+
+	for (x = 0; x + 16 <= width; x += 16, s += 48)
+	{
+		a = _mm_loadu_si128 ((const __m128i*)s);
+		b = _mm_loadu_si128 ((const __m128i*)(s + 16));
+		c = _mm_loadu_si128 ((const __m128i*)(s + 32));
+
+		r = _mm_or_si128 (_mm_or_si128 (_mm_shuffle_epi8 (a, r0),
+			_mm_shuffle_epi8 (b, r1)), _mm_shuffle_epi8 (c, r2));
+		g = _mm_or_si128 (_mm_or_si128 (_mm_shuffle_epi8 (a, g0),
+			_mm_shuffle_epi8 (b, g1)), _mm_shuffle_epi8 (c, g2));
+		bl = _mm_or_si128 (_mm_or_si128 (_mm_shuffle_epi8 (a, b0),
+			_mm_shuffle_epi8 (b, b1)), _mm_shuffle_epi8 (c, b2));
+
+		/* The weights sum up to 256, so the sum fits in 16 bits. */
+		lo = _mm_add_epi16 (_mm_add_epi16 (
+			_mm_mullo_epi16 (_mm_unpacklo_epi8 (r, zero), wr),
+			_mm_mullo_epi16 (_mm_unpacklo_epi8 (g, zero), wg)),
+			_mm_add_epi16 (_mm_mullo_epi16 (_mm_unpacklo_epi8 (bl, zero), wb),
+			round));
+		hi = _mm_add_epi16 (_mm_add_epi16 (
+			_mm_mullo_epi16 (_mm_unpackhi_epi8 (r, zero), wr),
+			_mm_mullo_epi16 (_mm_unpackhi_epi8 (g, zero), wg)),
+			_mm_add_epi16 (_mm_mullo_epi16 (_mm_unpackhi_epi8 (bl, zero), wb),
+			round));
+
+		_mm_storeu_si128 ((__m128i*)(d + x), _mm_packus_epi16 (
+			_mm_srli_epi16 (lo, 8), _mm_srli_epi16 (hi, 8)));
+	}
+
+	gray_row_c (s, d + x, width - x);
+}
+
+#endif /* IMAGE_X86 */
+
+/******************************************************************************
+ *
+ *  Function:       charcoal_gray_tile
+ *  Description:    This function converts a tile of the photo to gray.
+ *  Inputs:         context - the Charcoal
+ *                  first, last - the rows [first, last) to convert
+ *  Outputs:        
+ *  Routines Called: gray_row
+ *
+ *****************************************************************************/
+static void charcoal_gray_tile(gpointer context, int first, int last)
+{
+	Charcoal *charcoal = context;
+	VidFrame *source = charcoal->source;
+	int y;
+
+	for (y = first; y < last; y++)
+	{
+		gray_row (source->data + y * source->bytesperline,
+			charcoal->gray + y * charcoal->width, charcoal->width);
+	}
+}
+
+/******************************************************************************
+ *
+ *  Function:       charcoal_edge_tile
+ *  Description:    This function finds the edges of a tile of the gray
+ *					image, with a Sobel operator, and blurs them along the
+ *					rows.
+ *  Inputs:         context - the Charcoal
+ *                  first, last - the rows [first, last) to process
+ *  Outputs:        
+ *  Routines Called: malloc, abs, free
+ *
+ *****************************************************************************/
+static void charcoal_edge_tile(gpointer context, int first, int last)
+{
+	Charcoal *charcoal = context;
+	int width = charcoal->width;
+	int height = charcoal->height;
+	unsigned char *sobel = malloc (width);
+	unsigned char *up, *mid, *down, *d;
+	int x, y, k, left, right, gx, gy, sum;
+
+	for (y = first; y < last; y++)
+	{
+		/* Rows outside the image repeat the border. */
+		up = charcoal->gray + MAX (y - 1, 0) * width;
+		mid = charcoal->gray + y * width;
+		down = charcoal->gray + MIN (y + 1, height - 1) * width;
+
+		for (x = 0; x < width; x++)
+		{
+			left = MAX (x - 1, 0);
+			right = MIN (x + 1, width - 1);
+			gx = up[right] + 2 * mid[right] + down[right] -
+				up[left] - 2 * mid[left] - down[left];
+			gy = down[left] + 2 * down[x] + down[right] -
+				up[left] - 2 * up[x] - up[right];
+			sobel[x] = MIN (abs (gx) + abs (gy), 255);
+		}
+
+		d = charcoal->edges + y * width;
+		for (x = 0; x < width; x++)
+		{
+			sum = 128;
+			for (k = -CHARCOAL_RADIUS; k <= CHARCOAL_RADIUS; k++)
+			{
+				sum += charcoal_kernel[k + CHARCOAL_RADIUS] *
+					sobel[CLAMP (x + k, 0, width - 1)];
+			}
+			d[x] = sum >> 8;
+		}
+	}
+
+	free (sobel);
+}
+
+/******************************************************************************
+ *
+ *  Function:       charcoal_blur_tile
+ *  Description:    This function blurs the edges of a tile along the
+ *					columns, and counts the levels of the result.
+ *  Inputs:         context - the Charcoal
+ *                  first, last - the rows [first, last) to blur
+ *  Outputs:        
+ *  Routines Called: memset, __sync_fetch_and_add
+ *
+ *****************************************************************************/
+static void charcoal_blur_tile(gpointer context, int first, int last)
+{
+	Charcoal *charcoal = context;
+	int width = charcoal->width;
+	int height = charcoal->height;
+	const unsigned char *rows[2 * CHARCOAL_RADIUS + 1];
+	int histogram[256];
+	unsigned char *d;
+	int x, y, k, sum;
+
+	memset (histogram, 0, sizeof (histogram));
+
+	for (y = first; y < last; y++)
+	{
+		for (k = -CHARCOAL_RADIUS; k <= CHARCOAL_RADIUS; k++)
+		{
+			rows[k + CHARCOAL_RADIUS] = charcoal->edges +
+				CLAMP (y + k, 0, height - 1) * width;
+		}
+
+		d = charcoal->blurred + y * width;
+		for (x = 0; x < width; x++)
+		{
+			sum = 128;
+			for (k = 0; k < 2 * CHARCOAL_RADIUS + 1; k++)
+				sum += charcoal_kernel[k] * rows[k][x];
+			d[x] = sum >> 8;
+			histogram[d[x]]++;
+		}
+	}
+
+	/* Merge the counts of this tile with the others. */
+	for (k = 0; k < 256; k++)
+	{
+		if (histogram[k])
+			__sync_fetch_and_add (&charcoal->histogram[k], histogram[k]);
+	}
+}
+
+/******************************************************************************
+ *
+ *  Function:       charcoal_levels
+ *  Description:    This function builds the table which stretches the
+ *					blurred edges over the full range, and negates them,
+ *					so the edges are drawn dark on white.
+ *  Inputs:         charcoal - the Charcoal, with its histogram counted
+ *  Outputs:        
+ *  Routines Called: 
+ *
+ *****************************************************************************/
+static void charcoal_levels(Charcoal *charcoal)
+{
+	int total = charcoal->width * charcoal->height;
+	int low, high, count, v;
+
+	/* Clip a few pixels at both ends, like convert -normalize. */
+	count = 0;
+	for (low = 0; low < 255; low++)
+	{
+		count += charcoal->histogram[low];
+		if (count > total * CHARCOAL_BLACK_POINT)
+			break;
+	}
+	count = 0;
+	for (high = 255; high > 0; high--)
+	{
+		count += charcoal->histogram[high];
+		if (count > total * CHARCOAL_WHITE_POINT)
+			break;
+	}
+
+	for (v = 0; v < 256; v++)
+	{
+		if (high <= low)
+			charcoal->levels[v] = 255 - v;
+		else
+			charcoal->levels[v] = 255 -
+				CLAMP ((v - low) * 255 / (high - low), 0, 255);
+	}
+}
+
+/******************************************************************************
+ *
+ *  Function:       charcoal_draw_tile
+ *  Description:    This function draws a tile of the charcoal image, in
+ *					gray RGB24.
+ *  Inputs:         context - the Charcoal
+ *                  first, last - the rows [first, last) to draw
+ *  Outputs:        
+ *  Routines Called: 
+ *
+ *****************************************************************************/
+static void charcoal_draw_tile(gpointer context, int first, int last)
+{
+	Charcoal *charcoal = context;
+	int width = charcoal->width;
+	unsigned char *s, *d;
+	int x, y;
+
+	for (y = first; y < last; y++)
+	{
+		s = charcoal->blurred + y * width;
+		d = charcoal->result->data + y * charcoal->result->bytesperline;
+		for (x = 0; x < width; x++, d += 3)
+			d[0] = d[1] = d[2] = charcoal->levels[s[x]];
+	}
+}
+
+/******************************************************************************
+ *
+ *  Function:       charcoal_draw
+ *  Description:    This function creates a charcoal drawing of a frame. The
+ *					frame goes through gray conversion, edge detection,
+ *					blurring, normalization and negation, like
+ *					convert -charcoal, each step over all the tiles.
+ *  Inputs:         source - the RGB24 frame to draw
+ *                  effectData - unused
+ *                  cancelled - stops the drawing once set
+ *  Outputs:        the new frame, NULL if cancelled.
+ *  Routines Called: create_rgb_frame, malloc, run_tiles, charcoal_levels,
+ *                  free, vidFrameRelease, __builtin_cpu_supports
  *
  *****************************************************************************/
-gboolean create_oil_blob_image(char * inImage, char * outImage, GPid * id, GError *error)
+static VidFrame *charcoal_draw(VidFrame *source, gpointer effectData,
+	const volatile gint *cancelled)
 {
-	/* Setup argument strings. */
-	char paint[7] = "-paint";
-	char oilAmt[2] = "3";	
+	Charcoal charcoal;
+	int size;
 
-	/* Setup the arguments for the commands. */	
-	char * args[6];
-	args[0] = cnvCmd;
-	args[1] = inImage;
-	args[2] = paint;
-	args[3] = oilAmt;
-	args[4] = outImage;
-	args[5] = '\0';
+	/* Pick the gray conversion for this processor. */
+	if (gray_row == NULL)
+	{
+		gray_row = gray_row_c;
+#ifdef IMAGE_X86
+		__builtin_cpu_init ();
+		if (__builtin_cpu_supports ("ssse3"))
+			gray_row = gray_row_ssse3;
+#endif
+	}
 
-    /* Spawn a new process, to be run asynchronously. */
-	return g_spawn_async ( NULL, args, NULL, G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_SEARCH_PATH, NULL, NULL, id, &error);
+	charcoal.source = source;
+	charcoal.width = source->size.width;
+	charcoal.height = source->size.height;
+	charcoal.result = create_rgb_frame (charcoal.width, charcoal.height);
+	memset (charcoal.histogram, 0, sizeof (charcoal.histogram));
+
+	size = charcoal.width * charcoal.height;
+	charcoal.gray = malloc (size);
+	charcoal.edges = malloc (size);
+	charcoal.blurred = malloc (size);
+
+	/* Each step needs the rows around a tile from the step before. */
+	run_tiles (charcoal_gray_tile, &charcoal, charcoal.height, cancelled);
+	run_tiles (charcoal_edge_tile, &charcoal, charcoal.height, cancelled);
+	run_tiles (charcoal_blur_tile, &charcoal, charcoal.height, cancelled);
+	charcoal_levels (&charcoal);
+	run_tiles (charcoal_draw_tile, &charcoal, charcoal.height, cancelled);
+
+	free (charcoal.gray);
+	free (charcoal.edges);
+	free (charcoal.blurred);
+
+	if (*cancelled)
+		vidFrameRelease (&charcoal.result);
+
+	return charcoal.result;
 }
 
 /******************************************************************************
  *
  *  Function:       create_charcoal_image
- *  Description:    This function will create a charcoal version of the provided
- *					image.
- *  Inputs:         inImage - the image to paint, 
- *                  outImage - the oil painted image
- *                  id - the ID of the spawned process
+ *  Description:    This function will create a charcoal version of the provided
+ *					image, with the small and large copies shown by the
+ *					effects screen. The image is drawn in the background,
+ *					one tile of rows at a time on every processor.
+ *  Inputs:         inImage - the image to draw
+ *                  outImage - the charcoal image
+ *                  outSmall - the 160x120 copy of outImage
+ *                  outLarge - the 640x480 copy of outImage
+ *                  priority - jobs with a higher priority run first
+ *                  done - called from the main loop once the images are
+ *					written, or the job is cancelled
+ *                  data - passed to done
+ *  Outputs:        the id of the job, 0 if it could not be queued.
+ *  Routines Called: image_job_submit
+ *
+ *****************************************************************************/
+guint create_charcoal_image(char * inImage, char * outImage,
+	char * outSmall, char * outLarge, gint priority, ImageJobDoneFunc done,
+	gpointer data)
+{
+	/* Draw on the worker thread, report on the main loop. */
+	return image_job_submit (inImage, outImage, outSmall, outLarge,
+		charcoal_draw, NULL, "create_charcoal_image", priority, done,
+		data);
+}
+
+/******************************************************************************
+ *
+ *  Function:       div255
+ *  Description:    This function divides by 255, rounding to the nearest.
+ *  Inputs:         x - the value to divide, up to 65025
+ *  Outputs:        x / 255.
+ *  Routines Called: 
+ *
+ *****************************************************************************/
+static int div255(int x)
+{
+	x += 128;
+	return (x + (x >> 8)) >> 8;
+}
+
+/******************************************************************************
+ *
+ *  Function:       hard_light_row_c
+ *  Description:    This function lays a row of the texture over a row of
+ *					the photo, in hard light mode: the texture darkens the
+ *					photo where it is dark and lightens it where it is
+ *					light.
+ *  Inputs:         s - the photo samples
+ *                  t - the texture samples
+ *                  d - the blended samples
+ *                  n - the number of samples
+ *  Outputs:        
+ *  Routines Called: div255
+ *
+ *****************************************************************************/
+static void hard_light_row_c(const unsigned char *s, const unsigned char *t,
+	unsigned char *d, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		if (t[i] < 128)
+			d[i] = div255 (2 * t[i] * s[i]);
+		else
+			d[i] = 255 - div255 (2 * (255 - t[i]) * (255 - s[i]));
+	}
+}
+
+#ifdef IMAGE_X86
+
+/******************************************************************************
+ *
+ *  Function:       multiply_sse2
+ *  Description:    This function computes div255 (2 * a * b) for 16 pairs of
+ *					samples. Pairs whose product does not fit in 16 bits
+ *					give garbage, the callers mask them out.
+ *  Inputs:         a, b - the samples
+ *  Outputs:        the 16 products.
+ *  Routines Called: 
+ *
+ *****************************************************************************/
+__attribute__((target("sse2")))
+static __m128i multiply_sse2(__m128i a, __m128i b)
+{
+	const __m128i zero = _mm_setzero_si128 ();
+	const __m128i round = _mm_set1_epi16 (128);
+	__m128i lo, hi;
+
+	lo = _mm_mullo_epi16 (_mm_unpacklo_epi8 (a, zero),
+		_mm_unpacklo_epi8 (b, zero));
+	hi = _mm_mullo_epi16 (_mm_unpackhi_epi8 (a, zero),
+		_mm_unpackhi_epi8 (b, zero));
+	lo = _mm_add_epi16 (_mm_add_epi16 (lo, lo), round);
+	hi = _mm_add_epi16 (_mm_add_epi16 (hi, hi), round);
+	lo = _mm_srli_epi16 (_mm_add_epi16 (lo, _mm_srli_epi16 (lo, 8)), 8);
+	hi = _mm_srli_epi16 (_mm_add_epi16 (hi, _mm_srli_epi16 (hi, 8)), 8);
+
+	return _mm_packus_epi16 (lo, hi);
+}
+
+/******************************************************************************
+ *
+ *  Function:       hard_light_row_sse2
+ *  Description:    This function blends rows like hard_light_row_c, 16
+ *					samples at a time. Both sides of the blend are
+ *					computed, the sign bit of the texture picks one.
+ *  Inputs:         s - the photo samples
+ *                  t - the texture samples
+ *                  d - the blended samples
+ *                  n - the number of samples
+ *  Outputs:        
+ *  Routines Called: multiply_sse2, hard_light_row_c
+ *
+ *****************************************************************************/
+__attribute__((target("sse2")))
+static void hard_light_row_sse2(const unsigned char *s,
+	const unsigned char *t, unsigned char *d, int n)
+{
+	const __m128i zero = _mm_setzero_si128 ();
+	const __m128i ones = _mm_set1_epi8 (-1);
+	__m128i a, b, dark, light, mask;
+	int i;
+
+	for (i = 0; i + 16 <= n; i += 16)
+	{
+		a = _mm_loadu_si128 ((const __m128i*)(s + i));
+		b = _mm_loadu_si128 ((const __m128i*)(t + i));
+
+		/* 255 - x is x ^ 255 on bytes. */
+		dark = multiply_sse2 (a, b);
+		light = _mm_xor_si128 (multiply_sse2 (_mm_xor_si128 (a, ones),
+			_mm_xor_si128 (b, ones)), ones);
+
+		mask = _mm_cmplt_epi8 (b, zero);
+		_mm_storeu_si128 ((__m128i*)(d + i), _mm_or_si128 (
+			_mm_and_si128 (mask, light), _mm_andnot_si128 (mask, dark)));
+	}
+
+	hard_light_row_c (s + i, t + i, d + i, n - i);
+}
+
+#endif /* IMAGE_X86 */
+
+/******************************************************************************
+ *
+ *  Function:       tile_texture
+ *  Description:    This function repeats the texture over a frame of the
+ *					given size, from the top left corner, like
+ *					composite -tile.
+ *  Inputs:         tile - the RGB24 texture
+ *                  width - the width of the frame
+ *                  height - the height of the frame
+ *  Outputs:        the new frame.
+ *  Routines Called: create_rgb_frame, memcpy
+ *
+ *****************************************************************************/
+static VidFrame *tile_texture(VidFrame *tile, int width, int height)
+{
+	VidFrame *frame = create_rgb_frame (width, height);
+	unsigned char *s, *d;
+	int x, y, n;
+
+	for (y = 0; y < height; y++)
+	{
+		s = tile->data + (y % tile->size.height) * tile->bytesperline;
+		d = frame->data + y * frame->bytesperline;
+		for (x = 0; x < width; x += n)
+		{
+			n = MIN (tile->size.width, width - x);
+			memcpy (d + x * 3, s, n * 3);
+		}
+	}
+
+	return frame;
+}
+
+/******************************************************************************
+ *
+ *  Function:       texture_cache_init
+ *  Description:    This function decodes the texture and keeps it tiled
+ *					over a frame of the photo size, so texturing a photo
+ *					is a single pass over the photo. Transparent parts of
+ *					the texture become mid gray, which hard light leaves
+ *					unchanged.
+ *  Inputs:         texImage - the texture file
+ *                  width - the width of the photos
+ *                  height - the height of the photos
  *                  error - place to store error information
  *  Outputs:        TRUE on success, FALSE if error is set.
- *  Routines Called: g_spawn_async
+ *  Routines Called: traceBegin, gdk_pixbuf_new_from_file, traceEnd,
+ *                  create_rgb_frame, g_object_unref, texture_cache_free,
+ *                  tile_texture
+ *
+ *****************************************************************************/
+gboolean texture_cache_init(char * texImage, int width, int height,
+	GError **error)
+{
+	GdkPixbuf *pixbuf;
+	VidFrame *tile;
+	const guchar *s;
+	unsigned char *d;
+	int channels, alpha, x, y, c;
+	int64_t start;
+
+	start = traceBegin ();
+	pixbuf = gdk_pixbuf_new_from_file (texImage, error);
+	traceEnd ("gdk_pixbuf_new_from_file", start);
+	if (pixbuf == NULL)
+	{
+		return FALSE;
+	}
+
+	/* Copy the pixels in RGB24, whatever the layout of the pixbuf. */
+	tile = create_rgb_frame (gdk_pixbuf_get_width (pixbuf),
+		gdk_pixbuf_get_height (pixbuf));
+	channels = gdk_pixbuf_get_n_channels (pixbuf);
+	alpha = gdk_pixbuf_get_has_alpha (pixbuf);
+	for (y = 0; y < tile->size.height; y++)
+	{
+		s = gdk_pixbuf_get_pixels (pixbuf) +
+			y * gdk_pixbuf_get_rowstride (pixbuf);
+		d = tile->data + y * tile->bytesperline;
+		for (x = 0; x < tile->size.width; x++, s += channels, d += 3)
+		{
+			for (c = 0; c < 3; c++)
+			{
+				d[c] = alpha ?
+					div255 (s[c] * s[3] + 128 * (255 - s[3])) : s[c];
+			}
+		}
+	}
+	g_object_unref (pixbuf);
+
+	texture_cache_free ();
+	texture_cache = tile_texture (tile, width, height);
+	texture_tile = tile;
+
+	return TRUE;
+}
+
+/******************************************************************************
+ *
+ *  Function:       texture_cache_free
+ *  Description:    This function releases the texture.
+ *  Inputs:         
+ *  Outputs:        
+ *  Routines Called: vidFrameRelease
+ *
+ *****************************************************************************/
+void texture_cache_free(void)
+{
+	if (texture_cache != NULL)
+		vidFrameRelease (&texture_cache);
+	if (texture_tile != NULL)
+		vidFrameRelease (&texture_tile);
+}
+
+/******************************************************************************
+ *
+ *  Function:       texture_blend_tile
+ *  Description:    This function textures a tile of the photo.
+ *  Inputs:         context - the TextureBlend
+ *                  first, last - the rows [first, last) to texture
+ *  Outputs:        
+ *  Routines Called: hard_light_row
+ *
+ *****************************************************************************/
+static void texture_blend_tile(gpointer context, int first, int last)
+{
+	TextureBlend *blend = context;
+	int y;
+
+	for (y = first; y < last; y++)
+	{
+		hard_light_row (blend->source->data + y * blend->source->bytesperline,
+			blend->texture->data + y * blend->texture->bytesperline,
+			blend->result->data + y * blend->result->bytesperline,
+			blend->source->size.width * 3);
+	}
+}
+
+/******************************************************************************
+ *
+ *  Function:       texture_draw
+ *  Description:    This function creates a textured copy of a frame.
+ *  Inputs:         source - the RGB24 frame to texture
+ *                  effectData - the tiled texture
+ *                  cancelled - stops the texturing once set
+ *  Outputs:        the new frame, NULL if cancelled.
+ *  Routines Called: tile_texture, create_rgb_frame, run_tiles,
+ *                  vidFrameRelease, __builtin_cpu_supports
  *
- *****************************************************************************/
-gboolean create_charcoal_image(char * inImage, char * outImage, GPid * id, GError *error)
+ *****************************************************************************/
+static VidFrame *texture_draw(VidFrame *source, gpointer effectData,
+	const volatile gint *cancelled)
 {
-	/* Setup local vars. */
-	char charcoal[10] = "-charcoal";
-	char cclAmt[2] = "4";
-	
-	/* Setup the arguments for the commands. */	
-	char * args[6];
-	args[0] = cnvCmd;
-	args[1] = inImage;
-	args[2] = charcoal;
-	args[3] = cclAmt;
-	args[4] = outImage;
-	args[5] = '\0';
+	TextureBlend blend;
+	VidFrame *tiled = NULL;
+
+	/* Pick the blend for this processor. */
+	if (hard_light_row == NULL)
+	{
+		hard_light_row = hard_light_row_c;
+#ifdef IMAGE_X86
+		__builtin_cpu_init ();
+		if (__builtin_cpu_supports ("sse2"))
+			hard_light_row = hard_light_row_sse2;
+#endif
+	}
+
+	blend.source = source;
+	blend.texture = effectData;
+	blend.result = create_rgb_frame (source->size.width, source->size.height);
+
+	/* Photos larger than the cache get a texture of their own. */
+	if (source->size.width > blend.texture->size.width ||
+		source->size.height > blend.texture->size.height)
+	{
+		tiled = tile_texture (texture_tile, source->size.width,
+			source->size.height);
+		blend.texture = tiled;
+	}
+
+	run_tiles (texture_blend_tile, &blend, source->size.height, cancelled);
+
+	if (tiled != NULL)
+		vidFrameRelease (&tiled);
 
-    /* Spawn a new process, to be run asynchronously. */
-	return g_spawn_async ( NULL, args, NULL, G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_SEARCH_PATH, NULL, NULL, id, &error);
+	if (*cancelled)
+		vidFrameRelease (&blend.result);
+
+	return blend.result;
 }
 
 /******************************************************************************
  *
  *  Function:       create_textured_image
- *  Description:    This function will create a texturized version of the provided
- *					image.
- *  Inputs:         inImage - the image to paint, 
- *                  outImage - the oil painted image
- *                  texImage - the texture to apply to the image
- *                  id - the ID of the spawned process
- *                  error - place to store error information  
- *  Outputs:        TRUE on success, FALSE if error is set.
- *  Routines Called: g_spawn_async
- *
- *****************************************************************************/
-gboolean create_textured_image(char * inImage, char * texImage, char * outImage, GPid * id, GError *error)
-{	/* Setup local vars. */
-	char cmpCmd[10] = "composite";
-	char tile[6] = "-tile";
-	char compose[9] = "-compose";
-	char hardlight[10] = "Hardlight";
-	
-	/* Setup the arguments for the commands. */	
-	char * args[8];	args[0] = cmpCmd;
-	args[1] = texImage;
-	args[2] = inImage;
-	args[3] = tile;
-	args[4] = compose;
-	args[5] = hardlight;
-	args[6] = outImage;
-	args[7] = '\0';
-
-    /* Spawn a new process, to be run asynchronously. */
-	return g_spawn_async ( NULL, args, NULL, G_SPAWN_DO_NOT_REAP_CHILD | G_SPAWN_SEARCH_PATH, NULL, NULL, id, &error);	
+ *  Description:    This function will create a texturized version of the provided
+ *					image, with the small and large copies shown by the
+ *					effects screen. The texture of texture_cache_init is
+ *					laid over the image in hard light mode, in the
+ *					background.
+ *  Inputs:         inImage - the image to texture
+ *                  outImage - the textured image
+ *                  outSmall - the 160x120 copy of outImage
+ *                  outLarge - the 640x480 copy of outImage
+ *                  priority - jobs with a higher priority run first
+ *                  done - called from the main loop once the images are
+ *					written, or the job is cancelled
+ *                  data - passed to done
+ *  Outputs:        the id of the job, 0 if it could not be queued, or if
+ *					no texture was loaded.
+ *  Routines Called: image_job_submit
+ *
+ *****************************************************************************/
+guint create_textured_image(char * inImage, char * outImage,
+	char * outSmall, char * outLarge, gint priority, ImageJobDoneFunc done,
+	gpointer data)
+{
+	/* No texture was loaded. */
+	if (texture_cache == NULL)
+	{
+		return 0;
+	}
+
+	/* Texture on the worker thread, report on the main loop. */
+	return image_job_submit (inImage, outImage, outSmall, outLarge,
+		texture_draw, texture_cache, "create_textured_image", priority,
+		done, data);
 }
 
 
@@ -4,67 +4,168 @@
  * 	 @authors -	David M. Winiarski - dmw1407@rit.edu
  */
 
+#ifndef IMAGEMANIPULATIONS_H_
+#define IMAGEMANIPULATIONS_H_
+
 #include <unistd.h>
 #include <glib.h>
+#include "camera/frame.h"
+
+/* How an image job ended */
+typedef enum {
+	IMAGE_JOB_DONE,
+	IMAGE_JOB_FAILED,
+	IMAGE_JOB_CANCELLED
+} ImageJobStatus;
+
+/* Called from the main loop when an image job ends. The small and large
+ * copies are only given for a job which is done, and belong to the callee,
+ * which releases them. */
+typedef void (*ImageJobDoneFunc) (guint id, ImageJobStatus status,
+	VidFrame *small, VidFrame *large, gpointer data);
  
 
 /******************************************************************************
  *
- *  Function:       resizeImages
- *  Description:    This function will create a two smaller copies of the
- *					original photo.
- *  Inputs:         inImage - the image to resize
- *                  outImage - the resized image
- *                  imageDim - the image dimensions 
- *                  error - place to store error information
- *  Outputs:        TRUE on success, FALSE if error is set.
- *  Routines Called: g_spawn_sync
+ *  Function:       image_job_cancel
+ *  Description:    This function cancels a job. A queued job never runs,
+ *					a running job stops at its next step, and either way
+ *					its done function gets IMAGE_JOB_CANCELLED. Must be
+ *					called from the main loop.
+ *  Inputs:         id - the id of the job
+ *  Outputs:        TRUE if the job was not reported yet, FALSE otherwise.
+ *  Routines Called: pthread_mutex_lock, image_job_find, g_idle_add,
+ *                  pthread_mutex_unlock
+ *
+ *****************************************************************************/
+gboolean image_job_cancel(guint id);
+
+/******************************************************************************
+ *
+ *  Function:       image_job_set_priority
+ *  Description:    This function changes the priority of a queued job.
+ *  Inputs:         id - the id of the job
+ *                  priority - jobs with a higher priority run first
+ *  Outputs:        TRUE if the job is still queued, FALSE otherwise.
+ *  Routines Called: pthread_mutex_lock, image_job_find,
+ *                  pthread_mutex_unlock
+ *
+ *****************************************************************************/
+gboolean image_job_set_priority(guint id, gint priority);
+
+/******************************************************************************
+ *
+ *  Function:       image_job_shutdown
+ *  Description:    This function cancels every job and waits for the
+ *					worker to stop, so that what the jobs use, like the
+ *					texture, can be freed. No job runs afterwards, and the
+ *					cancelled jobs are not reported. Called once the main
+ *					loop is over.
+ *  Inputs:         
+ *  Outputs:        
+ *  Routines Called: pthread_mutex_lock, pthread_cond_signal,
+ *                  pthread_cond_wait, pthread_mutex_unlock
  *
  *****************************************************************************/
-gboolean image_resize(char * inImage, char * outImage, char * imageDim, GError *error);
+void image_job_shutdown(void);
 
 /******************************************************************************
  *
  *  Function:       create_oil_blob_image
- *  Description:    This function will create an oil blob version of the provided
- *					image.
- *  Inputs:         inImage - the image to paint, 
- *                  outImage - the oil painted image
- *                  id - the ID of the spawned process
- *                  error - place to store error information
- *  Outputs:        TRUE on success, FALSE if error is set.
- *  Routines Called: g_spawn_async
+ *  Description:    This function will create an oil blob version of the provided
+ *					image, with the small and large copies shown by the
+ *					effects screen. The image is painted in the background,
+ *					one tile of rows at a time on every processor.
+ *  Inputs:         inImage - the image to paint, 
+ *                  outImage - the oil painted image
+ *                  outSmall - the 160x120 copy of outImage
+ *                  outLarge - the 640x480 copy of outImage
+ *                  priority - jobs with a higher priority run first
+ *                  done - called from the main loop once the images are
+ *					written, or the job is cancelled
+ *                  data - passed to done
+ *  Outputs:        the id of the job, 0 if it could not be queued.
+ *  Routines Called: image_job_submit
  *
  *****************************************************************************/
-gboolean create_oil_blob_image(char * inImage, char * outImage, GPid * id, GError *error);
+guint create_oil_blob_image(char * inImage, char * outImage,
+	char * outSmall, char * outLarge, gint priority, ImageJobDoneFunc done,
+	gpointer data);
 
 /******************************************************************************
  *
  *  Function:       create_charcoal_image
- *  Description:    This function will create a charcoal version of the provided
- *					image.
- *  Inputs:         inImage - the image to paint, 
- *                  outImage - the oil painted image
- *                  id - the ID of the spawned process
+ *  Description:    This function will create a charcoal version of the provided
+ *					image, with the small and large copies shown by the
+ *					effects screen. The image is drawn in the background,
+ *					one tile of rows at a time on every processor.
+ *  Inputs:         inImage - the image to draw
+ *                  outImage - the charcoal image
+ *                  outSmall - the 160x120 copy of outImage
+ *                  outLarge - the 640x480 copy of outImage
+ *                  priority - jobs with a higher priority run first
+ *                  done - called from the main loop once the images are
+ *					written, or the job is cancelled
+ *                  data - passed to done
+ *  Outputs:        the id of the job, 0 if it could not be queued.
+ *  Routines Called: image_job_submit
+ *
+ *****************************************************************************/
+guint create_charcoal_image(char * inImage, char * outImage,
+	char * outSmall, char * outLarge, gint priority, ImageJobDoneFunc done,
+	gpointer data);
+
+/******************************************************************************
+ *
+ *  Function:       texture_cache_init
+ *  Description:    This function decodes the texture and keeps it tiled
+ *					over a frame of the photo size, for create_textured_image.
+ *  Inputs:         texImage - the texture file
+ *                  width - the width of the photos
+ *                  height - the height of the photos
  *                  error - place to store error information
  *  Outputs:        TRUE on success, FALSE if error is set.
- *  Routines Called: g_spawn_async
+ *  Routines Called: gdk_pixbuf_new_from_file, create_rgb_frame,
+ *                  g_object_unref, texture_cache_free, tile_texture
  *
- *****************************************************************************/
-gboolean create_charcoal_image(char * inImage, char * outImage, GPid * id, GError *error);
+ *****************************************************************************/
+gboolean texture_cache_init(char * texImage, int width, int height,
+	GError **error);
+
+/******************************************************************************
+ *
+ *  Function:       texture_cache_free
+ *  Description:    This function releases the texture.
+ *  Inputs:         
+ *  Outputs:        
+ *  Routines Called: vidFrameRelease
+ *
+ *****************************************************************************/
+void texture_cache_free(void);
 
 /******************************************************************************
  *
  *  Function:       create_textured_image
- *  Description:    This function will create a texturized version of the provided
- *					image.
- *  Inputs:         inImage - the image to paint, 
- *                  outImage - the oil painted image
- *                  texImage - the texture to apply to the image
- *                  id - the ID of the spawned process
- *                  error - place to store error information  
- *  Outputs:        TRUE on success, FALSE if error is set.
- *  Routines Called: g_spawn_async
+ *  Description:    This function will create a texturized version of the provided
+ *					image, with the small and large copies shown by the
+ *					effects screen. The texture of texture_cache_init is
+ *					laid over the image in hard light mode, in the
+ *					background.
+ *  Inputs:         inImage - the image to texture
+ *                  outImage - the textured image
+ *                  outSmall - the 160x120 copy of outImage
+ *                  outLarge - the 640x480 copy of outImage
+ *                  priority - jobs with a higher priority run first
+ *                  done - called from the main loop once the images are
+ *					written, or the job is cancelled
+ *                  data - passed to done
+ *  Outputs:        the id of the job, 0 if it could not be queued, or if
+ *					no texture was loaded.
+ *  Routines Called: image_job_submit
  *
- *****************************************************************************/
-gboolean create_textured_image(char * inImage, char * texImage, char * outImage, GPid * id, GError *error);
+ *****************************************************************************/
+guint create_textured_image(char * inImage, char * outImage,
+	char * outSmall, char * outLarge, gint priority, ImageJobDoneFunc done,
+	gpointer data);
+
+#endif
@@ -0,0 +1,622 @@
+/*
+ * bench.c
+ *
+ * Runs the kernels of the booth on recorded frames and reports, for each,
+ * the median and 99th percentile time of a run, the throughput in
+ * megapixels of camera frame per second, and the number and bytes of the
+ * allocations made by a run.
+ * The JSON report is meant to be diffed between builds, to catch
+ * regressions before a kiosk image is pushed.
+ *
+ * The photo is encoded with each named JPEG profile, and the size of the
+ * file written is reported too, to choose the profile of a deployment
+ * (see PHOTOBOOTH_JPEG_PROFILE).
+ *
+ * Usage: photobooth-bench [-n runs] [-k kernel] [-j report.json]
+ *                         [-t texture] recording...
+ * A recording is made by cam-record or PHOTOBOOTH_CAMERA_RECORD. A JPEG
+ * photo (".jpg") is accepted too. -k only runs the kernels whose name
+ * contains the given string.
+ *
+ * The allocations are counted by replacing malloc() and every other
+ * allocator of the C library, which relies on the glibc __libc_* entry
+ * points. With another C library they are not counted, and reported as
+ * "-".
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <glib.h>
+#include <linux/videodev2.h>
+#include "camera/frame.h"
+#include "camera/cam.h"
+#include "camera/drv-file.h"
+#include "camera/resize.h"
+#include "camera/mjpeg.h"
+#include "ImageManipulations.h"
+#include "usb-drive.h"
+
+/* The frames of a recording cycled through by the runs */
+#define BENCH_FRAMES 8
+
+/* The named JPEG profiles benchmarked */
+#define BENCH_PROFILES 8
+
+/* Counting allocations */
+
+static size_t allocated = 0;
+static size_t allocations = 0;
+
+#ifdef __GLIBC__
+
+#define BENCH_COUNTS_ALLOCATIONS 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+extern void *__libc_valloc(size_t size);
+extern void *__libc_pvalloc(size_t size);
+
+static void count_allocation(size_t size){
+  __atomic_add_fetch(&allocated, size, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size){
+  count_allocation(size);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size){
+  count_allocation(n * size);
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size){
+  count_allocation(size);
+  return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t align, size_t size){
+  count_allocation(size);
+  return __libc_memalign(align, size);
+}
+
+void *aligned_alloc(size_t align, size_t size){
+  count_allocation(size);
+  return __libc_memalign(align, size);
+}
+
+int posix_memalign(void **ptr, size_t align, size_t size){
+  count_allocation(size);
+  *ptr = __libc_memalign(align, size);
+  return *ptr ? 0 : ENOMEM;
+}
+
+void *valloc(size_t size){
+  count_allocation(size);
+  return __libc_valloc(size);
+}
+
+void *pvalloc(size_t size){
+  count_allocation(size);
+  return __libc_pvalloc(size);
+}
+
+/* glibc's own reallocarray() doesn't go through realloc() */
+void *reallocarray(void *ptr, size_t n, size_t size){
+  if( size && n > (size_t)-1 / size ){
+    errno = ENOMEM;
+    return NULL;
+  }
+  count_allocation(n * size);
+  return __libc_realloc(ptr, n * size);
+}
+
+#else
+
+#define BENCH_COUNTS_ALLOCATIONS 0
+
+#endif
+
+/* Kernels */
+
+typedef struct {
+  const char *name;
+  /* the camera frames, and the same converted to RGB24 */
+  VidFrame *frames[BENCH_FRAMES];
+  VidFrame *rgb[BENCH_FRAMES];
+  int nFrames;
+  VidSize size;
+  /* the first frame as a JPEG photo, the input of the effects */
+  char photo[256];
+  char dir[64];
+} BenchInput;
+
+typedef struct {
+  const char *name;
+  /* runs the kernel on frame i of the input, returns non-zero on error */
+  int (*run)(BenchInput *in, int i, void *arg);
+  void *arg;
+  /* undoes what a run left behind, untimed */
+  void (*reset)(BenchInput *in);
+  /* the file a run writes in the directory of the input, whose size is
+   * reported, or NULL */
+  const char *output;
+} Kernel;
+
+static int run_convert(BenchInput *in, int i, void *arg){
+  VidFrame *frame = in->frames[i];
+  VidConv *converter = vidConvFind(vidFrameGetFormat(frame),
+                                   V4L2_PIX_FMT_RGB24);
+  VidFrame *rgb;
+  int res;
+
+  if( !converter ){
+    return -1;
+  }
+  /* as getFrame does */
+  rgb = vidFramePoolGet(V4L2_PIX_FMT_RGB24, vidFrameGetWidth(frame),
+                        vidFrameGetHeight(frame));
+  res = vidConvProcess(converter, frame, rgb);
+  vidFrameRelease(&rgb);
+
+  return res;
+}
+
+static int run_preview(BenchInput *in, int i, void *arg){
+  VidFrame *frame = in->frames[i];
+  VidConv *converter = vidConvFindScaler(vidFrameGetFormat(frame),
+                                         V4L2_PIX_FMT_RGB24);
+  VidSize size = { LR_WIDTH, LR_HEIGHT };
+  VidFrame *rgb;
+  int res;
+
+  if( !converter ){
+    return -1;
+  }
+  /* as getPreviewFrame does */
+  rgb = vidFramePoolGet(V4L2_PIX_FMT_RGB24, size.width, size.height);
+  res = vidConvProcessScaled(converter, frame, rgb, &size);
+  vidFrameRelease(&rgb);
+
+  return res;
+}
+
+static int run_resize(BenchInput *in, int i, void *arg){
+  VidSize size = { LR_WIDTH, LR_HEIGHT };
+  VidFrame *small;
+  int res;
+
+  small = vidFramePoolGet(V4L2_PIX_FMT_RGB24, size.width, size.height);
+  res = vidFrameResize(in->rgb[i], small, &size, VID_RESIZE_BOX);
+  vidFrameRelease(&small);
+
+  return res;
+}
+
+static int run_jpeg(BenchInput *in, int i, void *arg){
+  char outName[96];
+  VidFrame *frame = in->frames[i];
+
+  snprintf(outName, sizeof(outName), "%s/encode.jpg", in->dir);
+
+  /* a YUYV photo is encoded from its own samples, others from RGB */
+  if( vidFrameGetFormat(frame) != V4L2_PIX_FMT_YUYV ){
+    frame = in->rgb[i];
+  }
+  return write_jpg_profile(frame, outName, (JpegProfile *)arg);
+}
+
+static int run_mjpeg_passthrough(BenchInput *in, int i, void *arg){
+  char outName[96];
+
+  snprintf(outName, sizeof(outName), "%s/passthrough.jpg", in->dir);
+  return mjpeg_write_file(in->frames[i], outName);
+}
+
+static GMainLoop *effect_loop = NULL;
+static ImageJobStatus effect_status;
+
+static void effect_done(guint id, ImageJobStatus status, VidFrame *small,
+                        VidFrame *large, gpointer data){
+  if( small ){
+    vidFrameRelease(&small);
+  }
+  if( large ){
+    vidFrameRelease(&large);
+  }
+  effect_status = status;
+  g_main_loop_quit(effect_loop);
+}
+
+typedef guint (*EffectStart)(char *inImage, char *outImage, char *outSmall,
+                             char *outLarge, gint priority,
+                             ImageJobDoneFunc done, gpointer data);
+
+/* The effects work on the photo file, as in the booth: decode, apply,
+ * write the result and its display copies */
+static int run_effect(BenchInput *in, int i, void *arg){
+  char out[96], outSmall[96], outLarge[96];
+
+  snprintf(out, sizeof(out), "%s/effect.jpg", in->dir);
+  snprintf(outSmall, sizeof(outSmall), "%s/effect_sm.jpg", in->dir);
+  snprintf(outLarge, sizeof(outLarge), "%s/effect_lg.jpg", in->dir);
+
+  if( ((EffectStart)arg)(in->photo, out, outSmall, outLarge, 0,
+                         effect_done, NULL) == 0 ){
+    return -1;
+  }
+  g_main_loop_run(effect_loop);
+
+  return effect_status != IMAGE_JOB_DONE;
+}
+
+static int run_usb_copy(BenchInput *in, int i, void *arg){
+  return writeFileToDrive(in->photo, in->dir);
+}
+
+/* Remove the files of a directory */
+static void remove_files(const char *dirName){
+  char path[320];
+  struct dirent *ep;
+  DIR *dir;
+
+  if( (dir = opendir(dirName)) == NULL ){
+    return;
+  }
+  while( (ep = readdir(dir)) ){
+    if( ep->d_name[0] != '.' ){
+      snprintf(path, sizeof(path), "%s/%s", dirName, ep->d_name);
+      unlink(path);
+    }
+  }
+  closedir(dir);
+}
+
+/* Remove the copies, so that every run looks for a free name the same way */
+static void reset_usb_copy(BenchInput *in){
+  char path[128];
+
+  snprintf(path, sizeof(path), "%s/DigitalPhotoBooth", in->dir);
+  remove_files(path);
+}
+
+/* Running and reporting */
+
+/* Write a string as a JSON string, a file name may hold anything */
+static void json_string(FILE *json, const char *str){
+  const unsigned char *c;
+
+  fputc('"', json);
+  for( c = (const unsigned char *)str; *c; c++ ){
+    if( *c == '"' || *c == '\\' ){
+      fprintf(json, "\\%c", *c);
+    } else if( *c < 0x20 ){
+      fprintf(json, "\\u%04x", *c);
+    } else {
+      fputc(*c, json);
+    }
+  }
+  fputc('"', json);
+}
+
+static double now_ms(void){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int compare_double(const void *a, const void *b){
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+/* Time a kernel over the frames of an input, print the results and add
+ * them to the JSON report */
+static void bench_kernel(BenchInput *in, Kernel *kernel, int runs,
+                         FILE *json, int *nResults){
+  double *times = malloc(sizeof(double) * runs);
+  double median, p99, mps;
+  size_t before, bytes, beforeCount, count;
+  char outName[96];
+  struct stat st;
+  long outBytes = -1;
+  int k, failed = 0;
+
+  /* a first run warms the caches and fills the frame pools */
+  failed = kernel->run(in, 0, kernel->arg);
+  if( kernel->reset ){
+    kernel->reset(in);
+  }
+
+  before = __atomic_load_n(&allocated, __ATOMIC_RELAXED);
+  beforeCount = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+  for( k = 0; k < runs && !failed; k++ ){
+    times[k] = now_ms();
+    failed = kernel->run(in, k % in->nFrames, kernel->arg);
+    times[k] = now_ms() - times[k];
+    if( kernel->reset ){
+      /* untimed, but its allocations are not the kernel's */
+      bytes = __atomic_load_n(&allocated, __ATOMIC_RELAXED);
+      count = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+      kernel->reset(in);
+      before += __atomic_load_n(&allocated, __ATOMIC_RELAXED) - bytes;
+      beforeCount += __atomic_load_n(&allocations, __ATOMIC_RELAXED) - count;
+    }
+  }
+  bytes = (__atomic_load_n(&allocated, __ATOMIC_RELAXED) - before) / runs;
+  count = (__atomic_load_n(&allocations, __ATOMIC_RELAXED) - beforeCount) /
+    runs;
+
+  if( failed ){
+    printf("%-24s %-20s failed\n", in->name, kernel->name);
+    free(times);
+    return;
+  }
+
+  qsort(times, runs, sizeof(double), compare_double);
+  median = times[runs / 2];
+  p99 = times[(runs * 99 + 99) / 100 - 1];
+  mps = in->size.width * in->size.height / 1e6 / (median / 1e3);
+
+  if( kernel->output ){
+    snprintf(outName, sizeof(outName), "%s/%s", in->dir, kernel->output);
+    if( stat(outName, &st) == 0 ){
+      outBytes = st.st_size;
+    }
+    unlink(outName);
+  }
+
+  printf("%-24s %-20s %10.3f %10.3f %10.1f", in->name, kernel->name,
+         median, p99, mps);
+  if( BENCH_COUNTS_ALLOCATIONS ){
+    printf(" %10lu %12lu", (unsigned long)count, (unsigned long)bytes);
+  } else {
+    printf(" %10s %12s", "-", "-");
+  }
+  if( outBytes >= 0 ){
+    printf(" %12ld", outBytes);
+  }
+  printf("\n");
+
+  if( json ){
+    fprintf(json, "%s\n    {\"input\": ", *nResults ? "," : "");
+    json_string(json, in->name);
+    fprintf(json, ", \"kernel\": ");
+    json_string(json, kernel->name);
+    fprintf(json, ", \"width\": %d, \"height\": %d, \"median_ms\": %.3f, "
+            "\"p99_ms\": %.3f, \"mpix_per_s\": %.2f", in->size.width,
+            in->size.height, median, p99, mps);
+    if( BENCH_COUNTS_ALLOCATIONS ){
+      fprintf(json, ", \"allocs_per_run\": %lu, \"bytes_per_run\": %lu",
+              (unsigned long)count, (unsigned long)bytes);
+    }
+    if( outBytes >= 0 ){
+      fprintf(json, ", \"output_bytes\": %ld", outBytes);
+    }
+    fprintf(json, "}");
+  }
+  (*nResults)++;
+
+  free(times);
+}
+
+/* Load the first frames of a recording, or a photo */
+static int bench_load(BenchInput *in, const char *fileName){
+  V4L2Capture *capture;
+  VidFrame *frame;
+  VidConv *converter;
+  JpegProfile profile;
+  char location[256];
+  int len = strlen(fileName);
+
+  in->name = fileName;
+  in->nFrames = 0;
+  memset(in->rgb, 0, sizeof(in->rgb));
+
+  if( len > 4 && strcmp(fileName + len - 4, ".jpg") == 0 ){
+    if( (frame = read_jpg((char *)fileName)) != NULL ){
+      in->frames[in->nFrames++] = frame;
+    }
+  } else {
+    /* replayed as fast as possible, the frames stay valid until released */
+    snprintf(location, sizeof(location), "%s@0", fileName);
+    if( (capture = fileCaptureOpen(location)) == NULL ){
+      return -1;
+    }
+    v4l2CaptureStartStreaming(capture, 1, 4);
+    while( in->nFrames < BENCH_FRAMES &&
+           (frame = v4l2CaptureQueryFrame(capture)) != NULL ){
+      in->frames[in->nFrames++] = frame;
+      /* a short recording loops */
+      if( in->nFrames > 1 && frame->data == in->frames[0]->data ){
+        vidFrameUnref(&in->frames[--in->nFrames]);
+        break;
+      }
+    }
+    v4l2CaptureRelease(&capture);
+  }
+  if( !in->nFrames ){
+    fprintf(stderr, "No frames in %s. \n", fileName);
+    return -1;
+  }
+
+  in->size = in->frames[0]->size;
+  for( len = 0; len < in->nFrames; len++ ){
+    frame = in->frames[len];
+    /* a photo is decoded to RGB24 already */
+    if( vidFrameGetFormat(frame) == V4L2_PIX_FMT_RGB24 ){
+      vidFrameRef(frame);
+      in->rgb[len] = frame;
+      continue;
+    }
+    converter = vidConvFind(vidFrameGetFormat(frame), V4L2_PIX_FMT_RGB24);
+    in->rgb[len] = vidFramePoolGet(V4L2_PIX_FMT_RGB24, in->size.width,
+                                   in->size.height);
+    if( !converter || vidConvProcess(converter, frame, in->rgb[len]) ){
+      fprintf(stderr, "Can't convert the frames of %s. \n", fileName);
+      return -1;
+    }
+  }
+
+  /* the photo, as the booth saves it */
+  snprintf(in->photo, sizeof(in->photo), "%s/photo.jpg", in->dir);
+  jpeg_profile_lookup("default", &profile);
+  if( vidFrameGetFormat(in->frames[0]) == V4L2_PIX_FMT_MJPEG ){
+    return mjpeg_write_file(in->frames[0], in->photo);
+  }
+  return write_jpg_profile(in->rgb[0], in->photo, &profile);
+}
+
+static void bench_unload(BenchInput *in){
+  int i;
+
+  for( i = 0; i < in->nFrames; i++ ){
+    vidFrameUnref(&in->frames[i]);
+    vidFrameUnref(&in->rgb[i]);
+  }
+  in->nFrames = 0;
+}
+
+int main(int argc, char *argv[]){
+  const char *only = NULL;
+  const char *jsonName = NULL;
+  const char *texture = "texture_fabric.gif";
+  Kernel kernels[16 + BENCH_PROFILES];
+  JpegProfile profiles[BENCH_PROFILES];
+  char names[BENCH_PROFILES][32];
+  const char *profile;
+  BenchInput in;
+  FILE *json = NULL;
+  int runs = 20;
+  int nKernels, nResults = 0;
+  int i, j, opt, textured;
+  GError *err = NULL;
+
+  while( (opt = getopt(argc, argv, "n:k:j:t:")) != -1 ){
+    switch( opt ){
+    case 'n':
+      runs = atoi(optarg);
+      break;
+    case 'k':
+      only = optarg;
+      break;
+    case 'j':
+      jsonName = optarg;
+      break;
+    case 't':
+      texture = optarg;
+      break;
+    default:
+      optind = argc;
+      break;
+    }
+  }
+  if( optind >= argc || runs < 1 ){
+    fprintf(stderr, "Usage: photobooth-bench [-n runs] [-k kernel] "
+            "[-j report.json] [-t texture] recording...\n");
+    return 1;
+  }
+
+  memset(&in, 0, sizeof(in));
+  strcpy(in.dir, "/tmp/photobooth-bench-XXXXXX");
+  if( mkdtemp(in.dir) == NULL ){
+    perror("mkdtemp");
+    return 1;
+  }
+
+  if( jsonName && (json = fopen(jsonName, "w")) == NULL ){
+    perror(jsonName);
+    return 1;
+  }
+  if( json ){
+    fprintf(json, "{\n  \"runs\": %d,\n  \"results\": [", runs);
+  }
+
+  effect_loop = g_main_loop_new(NULL, FALSE);
+
+  printf("%-24s %-20s %10s %10s %10s %10s %12s %12s\n", "input", "kernel",
+         "median ms", "p99 ms", "MP/s", "allocs/run", "bytes/run",
+         "file bytes");
+
+  for( i = optind; i < argc; i++ ){
+    if( bench_load(&in, argv[i]) ){
+      bench_unload(&in);
+      continue;
+    }
+    /* the texture is tiled to the size of the photo */
+    textured = texture_cache_init((char *)texture, in.size.width,
+                                  in.size.height, &err);
+    if( !textured ){
+      fprintf(stderr, "No texture effect: %s\n", err ? err->message : "");
+      g_clear_error(&err);
+    }
+
+    nKernels = 0;
+    /* a photo has no camera format to convert from */
+    if( vidFrameGetFormat(in.frames[0]) != V4L2_PIX_FMT_RGB24 ){
+      kernels[nKernels++] = (Kernel){ "convert-rgb24", run_convert, NULL,
+                                      NULL };
+      kernels[nKernels++] = (Kernel){ "preview-scale", run_preview, NULL,
+                                      NULL };
+    }
+    kernels[nKernels++] = (Kernel){ "resize-box", run_resize, NULL, NULL };
+    for( j = 0; j < BENCH_PROFILES &&
+           (profile = jpeg_profile_name(j)) != NULL; j++ ){
+      jpeg_profile_lookup(profile, &profiles[j]);
+      snprintf(names[j], sizeof(names[j]), "jpeg-%s", profile);
+      kernels[nKernels++] = (Kernel){ names[j], run_jpeg, &profiles[j], NULL,
+                                      "encode.jpg" };
+    }
+    if( vidFrameGetFormat(in.frames[0]) == V4L2_PIX_FMT_MJPEG ){
+      kernels[nKernels++] = (Kernel){ "mjpeg-passthrough",
+                                      run_mjpeg_passthrough, NULL, NULL };
+    }
+    kernels[nKernels++] = (Kernel){ "effect-oil", run_effect,
+                                    (void *)create_oil_blob_image, NULL };
+    kernels[nKernels++] = (Kernel){ "effect-charcoal", run_effect,
+                                    (void *)create_charcoal_image, NULL };
+    if( textured ){
+      kernels[nKernels++] = (Kernel){ "effect-texture", run_effect,
+                                      (void *)create_textured_image, NULL };
+    }
+    kernels[nKernels++] = (Kernel){ "usb-copy", run_usb_copy, NULL,
+                                    reset_usb_copy };
+
+    for( j = 0; j < nKernels; j++ ){
+      if( !only || strstr(kernels[j].name, only) ){
+        bench_kernel(&in, &kernels[j], runs, json, &nResults);
+      }
+    }
+
+    if( textured ){
+      texture_cache_free();
+    }
+    bench_unload(&in);
+  }
+
+  if( json ){
+    fprintf(json, "\n  ]\n}\n");
+    fclose(json);
+  }
+
+  /* leave nothing behind in /tmp */
+  reset_usb_copy(&in);
+  snprintf(in.photo, sizeof(in.photo), "%s/DigitalPhotoBooth", in.dir);
+  rmdir(in.photo);
+  remove_files(in.dir);
+  rmdir(in.dir);
+  g_main_loop_unref(effect_loop);
+
+  return 0;
+}
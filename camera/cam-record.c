@@ -0,0 +1,75 @@
+/*
+ * cam-record.c
+ *
+ * Records what the camera delivers, as it delivers it, so that the
+ * session can be replayed without a camera (PHOTOBOOTH_CAMERA=replay:file)
+ * to benchmark the conversions, the encoder and the effects on a
+ * reproducible load.
+ *
+ * Usage: cam-record [-d device] [-f yuyv|mjpeg] [-n frames] file
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "frame.h"
+#include "drv-v4l2.h"
+#include "cam.h"
+
+int main(int argc, char *argv[]){
+  const char *device = CAMERA_LOCATION;
+  fourcc_t format = YUYV;
+  V4L2Capture *capture;
+  VidFrame *frame;
+  int frames = 100;
+  int i, opt;
+
+  while( (opt = getopt(argc, argv, "d:f:n:")) != -1 ){
+    switch( opt ){
+    case 'd':
+      device = optarg;
+      break;
+    case 'f':
+      format = strcmp(optarg, "mjpeg") == 0 ? MJPEG : YUYV;
+      break;
+    case 'n':
+      frames = atoi(optarg);
+      break;
+    default:
+      optind = argc;
+      break;
+    }
+  }
+  if( optind != argc - 1 || frames < 1 ){
+    fprintf(stderr,
+            "Usage: cam-record [-d device] [-f yuyv|mjpeg] [-n frames] file\n");
+    return 1;
+  }
+
+  if( (capture = open_camera_at(device, format)) == NULL ){
+    fprintf(stderr, "Can't open %s. \n", device);
+    return 1;
+  }
+
+  v4l2CaptureStartStreaming(capture, 1, 4);
+  if( v4l2CaptureStartRecording(capture, argv[optind]) ){
+    close_camera(capture);
+    return 1;
+  }
+
+  for( i = 0; i < frames; i++ ){
+    if( (frame = v4l2CaptureQueryFrame(capture)) == NULL ){
+      break;
+    }
+    vidFrameUnref(&frame);
+  }
+
+  printf("%d frames of %dx%d %s recorded to %s\n", i,
+         capture->resolution.width, capture->resolution.height,
+         vidFourccToString(capture->format), argv[optind]);
+
+  close_camera(capture);
+
+  return 0;
+}
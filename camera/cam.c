@@ -6,10 +6,16 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <pthread.h>
 #include <linux/videodev.h>
 #include <stdio.h>
 #include "frame.h"
 #include "drv-v4l2.h"
+#include "resize.h"
+#include "mjpeg.h"
+#include "trace.h"
 #include "cam.h"
 #include "jpeglib.h"
 
@@ -17,8 +23,39 @@
 /* Initializes the camera and returns a V4L2Capture pointer
  */
 V4L2Capture *open_camera(){
-  V4L2Capture *capture = v4l2CaptureOpen("/dev/video0");
+  return open_camera_format((fourcc_t)YUYV);
+}
+
+/* Initializes the camera in the given format and returns a V4L2Capture
+ * pointer
+ */
+V4L2Capture *open_camera_format(fourcc_t format){
+  return open_camera_at(CAMERA_LOCATION, format);
+}
+
+/* Initializes the camera at a location, or a recording, in the given
+ * format and returns a V4L2Capture pointer
+ */
+V4L2Capture *open_camera_at(const char *location, fourcc_t format){
+  V4L2Capture *capture = v4l2CaptureOpen(location);
   VidSize _resolution;
+
+  if( !capture ){
+    return NULL;
+  }
+
+  if( format == (fourcc_t)MJPEG ){
+    _resolution.width = MJPEG_WIDTH;
+    _resolution.height = MJPEG_HEIGHT;
+    /* the driver may substitute another format it prefers */
+    if( v4l2CaptureSetImageFormat(capture, (fourcc_t)MJPEG, &_resolution) == 0
+        && v4l2CaptureGetImageFormat(capture) == MJPEG ){
+      v4l2CaptureSetFPS(capture, MJPEG_FPS);
+      return capture;
+    }
+    fprintf(stderr, "The camera can't send MJPEG, using YUYV.\n");
+  }
+
   _resolution.width = HR_WIDTH;
   _resolution.height = HR_HEIGHT;
   v4l2CaptureSetImageFormat(capture, (fourcc_t)YUYV, &_resolution);
@@ -33,6 +70,9 @@ V4L2Capture *open_camera(){
 void close_camera(V4L2Capture *capture){
   v4l2CaptureStopStreaming(capture);
   v4l2CaptureRelease(&capture);
+
+  /* the preview frames are not needed until the camera is opened again */
+  vidFramePoolTrim();
 }
 
 /* Capture a single frame from the video stream. This frame is in RGB24 format.
@@ -40,6 +80,8 @@ void close_camera(V4L2Capture *capture){
  *  @return a VidFrame object with data in RGB24 format
  */
 VidFrame *getFrame(V4L2Capture *capture){
+  int64_t traceStart = traceBegin();
+
   /* capture frame */
   VidFrame *myFrame = v4l2CaptureQueryFrame(capture);
   
@@ -53,23 +95,129 @@ VidFrame *getFrame(V4L2Capture *capture){
   /* converter object */
   VidConv *converter = vidConvFind(inputFormat, outputFormat);
   
-  /* new rgb frame */
-  VidFrame *rgbFrame = vidFrameCreate();
+  /* new rgb frame, recycled from the frame pool */
+  VidFrame *rgbFrame = vidFramePoolGet(outputFormat, vidFrameGetWidth(myFrame),
+                                       vidFrameGetHeight(myFrame));
   
-  /* do conversion */
+  /* do conversion, its time goes to the statistics of the capture */
   if( !converter ){
     fprintf(stderr, "Couldn't find a valid converter.\n");
     exit(1);
   } else {
+    int64_t convStart = traceNow();
     if( vidConvProcess(converter, myFrame, rgbFrame) ){
       fprintf(stderr, "Error while converting frame format.\n");
       exit(1);
     }
+    v4l2CaptureAddConvertTime(capture, (traceNow() - convStart) / 1000);
+  }
+
+  /* give the camera buffer back to the driver */
+  vidFrameUnref(&myFrame);
+
+  traceEnd("getFrame", traceStart);
+
+  return rgbFrame;
+}
+
+/* Get the newest frame from the video stream, converted to RGB24 and
+ * scaled down to the requested size in a single pass. The full size RGB
+ * image is never created. This function does not block.
+ *  capture - A pointer to the Video4Linux capture object
+ *  size - The size of the returned frame, e.g. LR_WIDTH x LR_HEIGHT
+ *  @return a VidFrame object with data in RGB24 format, or NULL if no new
+ *          frame arrived since the last call or the frame is damaged
+ */
+VidFrame *getPreviewFrame(V4L2Capture *capture, VidSize size){
+  int64_t traceStart = traceBegin();
+
+  /* pick up the newest frame, without waiting for the camera */
+  VidFrame *myFrame = v4l2CaptureLatestFrame(capture);
+
+  if( !myFrame ){
+    return NULL;
+  }
+
+  /* converter object which resamples while converting */
+  VidConv *converter = vidConvFindScaler(vidFrameGetFormat(myFrame),
+                                         V4L2_PIX_FMT_RGB24);
+
+  /* new rgb frame, recycled from the frame pool at the preview rate */
+  VidFrame *rgbFrame = vidFramePoolGet(V4L2_PIX_FMT_RGB24, size.width,
+                                       size.height);
+
+  /* do conversion, its time goes to the statistics of the capture */
+  if( !converter ){
+    fprintf(stderr, "Couldn't find a valid scaling converter.\n");
+    exit(1);
+  } else {
+    int64_t convStart = traceNow();
+    /* a damaged MJPEG frame is skipped, the next one will do */
+    if( vidConvProcessScaled(converter, myFrame, rgbFrame, &size) ){
+      fprintf(stderr, "Error while converting frame format.\n");
+      vidFrameRelease(&rgbFrame);
+    }
+    v4l2CaptureAddConvertTime(capture, (traceNow() - convStart) / 1000);
   }
 
+  /* give the camera buffer back to the driver */
+  vidFrameUnref(&myFrame);
+
+  traceEnd("getPreviewFrame", traceStart);
+
   return rgbFrame;
 }
 
+/* The named JPEG profiles */
+static const struct {
+  const char *name;
+  JpegProfile profile;
+} jpegProfiles[] = {
+  /* libjpeg defaults, at the quality of the photos */
+  { "default", { 85, JPEG_DCT_ISLOW, 0, 0, JPEG_SUBSAMPLE_420 } },
+  /* lowest encoding latency */
+  { "fast", { 85, JPEG_DCT_IFAST, 0, 0, JPEG_SUBSAMPLE_420 } },
+  /* smallest files, for the USB drive */
+  { "small", { 80, JPEG_DCT_ISLOW, 1, 1, JPEG_SUBSAMPLE_420 } },
+  /* best prints */
+  { "print", { 95, JPEG_DCT_ISLOW, 1, 0, JPEG_SUBSAMPLE_444 } }
+};
+
+#define N_JPEG_PROFILES (int)(sizeof(jpegProfiles) / sizeof(jpegProfiles[0]))
+
+/* Set the libjpeg defaults in a JPEG profile.
+ */
+void jpeg_profile_init(JpegProfile *profile, int quality){
+  profile->quality = quality;
+  profile->dctMethod = JPEG_DCT_ISLOW;
+  profile->optimize = 0;
+  profile->progressive = 0;
+  profile->subsampling = JPEG_SUBSAMPLE_420;
+}
+
+/* Get one of the named JPEG profiles.
+ *  @return 0 if the profile exists, nonzero otherwise
+ */
+int jpeg_profile_lookup(const char *name, JpegProfile *profile){
+  int i;
+
+  for( i = 0; i < N_JPEG_PROFILES; i++ ){
+    if( strcmp(name, jpegProfiles[i].name) == 0 ){
+      *profile = jpegProfiles[i].profile;
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/* Get the name of the i-th named JPEG profile.
+ *  @return the name, or NULL past the last profile
+ */
+const char *jpeg_profile_name(int i){
+  return (i >= 0 && i < N_JPEG_PROFILES) ? jpegProfiles[i].name : NULL;
+}
+
 /* Write a Video4Linux2 frame to a JPEG image.
  *  frame - A pointer to the Video4Linux2 frame struct
  *  filename - C string specifying filename to save to
@@ -77,6 +225,113 @@ VidFrame *getFrame(V4L2Capture *capture){
  *  @return 0 if the process was successful, nonzero if unsuccessful
  */
 int write_jpg(VidFrame *frame, char *filename, int quality){
+  JpegProfile profile;
+
+  jpeg_profile_init(&profile, quality);
+
+  return write_jpg_profile(frame, filename, &profile);
+}
+
+/* Feed a YUYV frame to the encoder as raw YCbCr planes
+ *
+ * YUYV already is 4:2:2 YCbCr, on the full range used by JPEG (see
+ * yuv2rgb.c), so the planes are only deinterleaved. The chroma is averaged
+ * over row pairs for 4:2:0 and repeated for 4:4:4. The encoder takes one
+ * iMCU row at a time, padded to whole blocks by repeating the last column
+ * and the last row.
+ */
+static void write_raw_yuyv(struct jpeg_compress_struct *cinfo,
+                           VidFrame *frame){
+  jpeg_component_info *comp = cinfo->comp_info;
+  int width = vidFrameGetWidth(frame);
+  int height = vidFrameGetHeight(frame);
+  int stride = vidFrameGetRowStride(frame);
+  int hsub = comp[0].h_samp_factor / comp[1].h_samp_factor;
+  int vsub = comp[0].v_samp_factor / comp[1].v_samp_factor;
+  int lines = cinfo->max_v_samp_factor * DCTSIZE;
+  int c, i, x, y, sy0, sy1, cw;
+  int bufWidth[3], nRows[3];
+  const unsigned char *s0, *s1, *data;
+  JSAMPROW *rows[3];
+  JSAMPARRAY planes[3];
+  JSAMPLE *d;
+
+  if( stride <= 0 ){
+    stride = width * 2;
+  }
+  data = vidFrameGetImageData(frame);
+
+  for( c = 0; c < 3; c++ ){
+    bufWidth[c] = comp[c].width_in_blocks * DCTSIZE;
+    nRows[c] = comp[c].v_samp_factor * DCTSIZE;
+    rows[c] = malloc(sizeof(JSAMPROW) * nRows[c]);
+    rows[c][0] = malloc(bufWidth[c] * nRows[c]);
+    for( i = 1; i < nRows[c]; i++ ){
+      rows[c][i] = rows[c][0] + i * bufWidth[c];
+    }
+    planes[c] = rows[c];
+  }
+
+  for( y = 0; y < height; y += lines ){
+    /* brightness */
+    for( i = 0; i < nRows[0]; i++ ){
+      sy0 = y + i < height ? y + i : height - 1;
+      s0 = data + sy0 * stride;
+      d = rows[0][i];
+      for( x = 0; x < width; x++ ){
+        d[x] = s0[2 * x];
+      }
+      for( ; x < bufWidth[0]; x++ ){
+        d[x] = d[width - 1];
+      }
+    }
+
+    /* color, U at byte 1 and V at byte 3 of each pixel pair */
+    cw = (width * comp[1].h_samp_factor + comp[0].h_samp_factor - 1) /
+      comp[0].h_samp_factor;
+    for( c = 1; c < 3; c++ ){
+      for( i = 0; i < nRows[c]; i++ ){
+        sy0 = y + i * vsub;
+        sy1 = sy0 + vsub - 1;
+        sy0 = sy0 < height ? sy0 : height - 1;
+        sy1 = sy1 < height ? sy1 : height - 1;
+        s0 = data + sy0 * stride + 2 * c - 1;
+        s1 = data + sy1 * stride + 2 * c - 1;
+        d = rows[c][i];
+        if( hsub == 2 ){
+          for( x = 0; x < cw; x++ ){
+            d[x] = (s0[4 * x] + s1[4 * x] + 1) >> 1;
+          }
+        } else {
+          for( x = 0; x < cw; x += 2 ){
+            d[x] = d[x + 1] = (s0[2 * x] + s1[2 * x] + 1) >> 1;
+          }
+        }
+        for( ; x < bufWidth[c]; x++ ){
+          d[x] = d[cw - 1];
+        }
+      }
+    }
+
+    jpeg_write_raw_data(cinfo, planes, lines);
+  }
+
+  for( c = 0; c < 3; c++ ){
+    free(rows[c][0]);
+    free(rows[c]);
+  }
+}
+
+/* Write a Video4Linux2 frame to a JPEG image with the given encoder
+ * settings.
+ *  @return 0 if the process was successful, nonzero if unsuccessful
+ *
+ * A YUYV frame is encoded from its own YCbCr samples, without converting
+ * it to RGB and back.
+ */
+int write_jpg_profile(VidFrame *frame, char *filename,
+                      const JpegProfile *profile){
+  int64_t traceStart = traceBegin();
   struct jpeg_compress_struct cinfo;
   struct jpeg_error_mgr jerr;
 
@@ -93,11 +348,15 @@ int write_jpg(VidFrame *frame, char *filename, int quality){
   VidConv *converter;
   VidFrame *rgbFrame;
   
-  if( inputFormat != outputFormat ){
+  if( inputFormat == V4L2_PIX_FMT_YUYV ){
+    /* the encoder takes the samples as they are */
+    rgbFrame = frame;
+  } else if( inputFormat != outputFormat ){
     /* converter object */
     converter = vidConvFind(inputFormat, outputFormat);
     /* new rgb frame */
-    rgbFrame = vidFrameCreate();
+    rgbFrame = vidFramePoolGet(outputFormat, vidFrameGetWidth(frame),
+                               vidFrameGetHeight(frame));
     /* do conversion */
     if( !converter ){
       fprintf(stderr, "Couldn't find a valid converter.\n");
@@ -120,6 +379,11 @@ int write_jpg(VidFrame *frame, char *filename, int quality){
 
   if( (outFile = fopen(filename, "wb")) == NULL ){
     fprintf(stderr, "Can't create file %s. \n", filename);
+    jpeg_destroy_compress(&cinfo);
+    if( rgbFrame != frame ){
+      vidFrameRelease(&rgbFrame);
+    }
+    traceEnd("write_jpg", traceStart);
     return(1);
   }
   jpeg_stdio_dest(&cinfo, outFile);
@@ -127,42 +391,574 @@ int write_jpg(VidFrame *frame, char *filename, int quality){
   cinfo.image_width = rgbFrame->size.width;
   cinfo.image_height = rgbFrame->size.height;
   cinfo.input_components = 3;
-  cinfo.in_color_space = JCS_RGB;
+  cinfo.in_color_space = inputFormat == V4L2_PIX_FMT_YUYV ? JCS_YCbCr :
+    JCS_RGB;
 
   jpeg_set_defaults(&cinfo);
-  jpeg_set_quality(&cinfo, 90, TRUE);
-  jpeg_start_compress(&cinfo, TRUE);
+  jpeg_set_quality(&cinfo, profile->quality, TRUE);
 
-  rowStride = vidFrameGetRowStride(rgbFrame);
-  while(cinfo.next_scanline < cinfo.image_height){
-    row_pointer[0] = &imageData[cinfo.next_scanline * rowStride];
-    (void) jpeg_write_scanlines(&cinfo, row_pointer, 1);
+  switch( profile->dctMethod ){
+  case JPEG_DCT_IFAST:
+    cinfo.dct_method = JDCT_IFAST;
+    break;
+  case JPEG_DCT_FLOAT:
+    cinfo.dct_method = JDCT_FLOAT;
+    break;
+  default:
+    cinfo.dct_method = JDCT_ISLOW;
+    break;
+  }
+
+  cinfo.optimize_coding = profile->optimize ? TRUE : FALSE;
+  if( profile->progressive ){
+    jpeg_simple_progression(&cinfo);
+  }
+
+  /* the sampling factors of the brightness, the color channels are 1x1 */
+  switch( profile->subsampling ){
+  case JPEG_SUBSAMPLE_444:
+    cinfo.comp_info[0].h_samp_factor = 1;
+    cinfo.comp_info[0].v_samp_factor = 1;
+    break;
+  case JPEG_SUBSAMPLE_422:
+    cinfo.comp_info[0].h_samp_factor = 2;
+    cinfo.comp_info[0].v_samp_factor = 1;
+    break;
+  default:
+    cinfo.comp_info[0].h_samp_factor = 2;
+    cinfo.comp_info[0].v_samp_factor = 2;
+    break;
+  }
+
+  if( inputFormat == V4L2_PIX_FMT_YUYV ){
+    cinfo.raw_data_in = TRUE;
+    jpeg_start_compress(&cinfo, TRUE);
+    write_raw_yuyv(&cinfo, frame);
+  } else {
+    jpeg_start_compress(&cinfo, TRUE);
+
+    rowStride = vidFrameGetRowStride(rgbFrame);
+    while(cinfo.next_scanline < cinfo.image_height){
+      row_pointer[0] = &imageData[cinfo.next_scanline * rowStride];
+      (void) jpeg_write_scanlines(&cinfo, row_pointer, 1);
+    }
   }
 
   jpeg_finish_compress(&cinfo);
   fclose(outFile);
   jpeg_destroy_compress(&cinfo);
 
+  /* free the converted copy */
+  if( rgbFrame != frame ){
+    vidFrameRelease(&rgbFrame);
+  }
+
+  traceEnd("write_jpg", traceStart);
+
   return 0;
 
 }
 
 
+/* libjpeg error handler which returns to read_jpg instead of exiting */
+struct jpg_error_mgr {
+  struct jpeg_error_mgr pub;
+  jmp_buf setjmp_buffer;
+};
+
+static void jpg_error_exit(j_common_ptr cinfo){
+  struct jpg_error_mgr *err = (struct jpg_error_mgr *) cinfo->err;
+
+  (*cinfo->err->output_message)(cinfo);
+  longjmp(err->setjmp_buffer, 1);
+}
+
+/* Read a JPEG image into a RGB24 frame.
+ *  filename - C string specifying the file to read
+ *  @return a new VidFrame object with data in RGB24 format, or NULL if the
+ *          file can't be read
+ */
+VidFrame *read_jpg(char *fileName){
+  return read_jpg_scaled(fileName, NULL);
+}
+
+/* Read a JPEG image into a RGB24 frame, shrunk by the decoder.
+ *  @return a new VidFrame object with data in RGB24 format, or NULL if the
+ *          file can't be read
+ *
+ * libjpeg can scale by 1/2, 1/4 or 1/8 while decoding, by computing smaller
+ * inverse DCTs, which is much cheaper than decoding the whole image. The
+ * largest of these factors is used for which the image still reaches the
+ * width or the height of box, so that fitting it in box only shrinks it.
+ */
+VidFrame *read_jpg_scaled(char *fileName, const VidSize *box){
+  struct jpeg_decompress_struct cinfo;
+  struct jpg_error_mgr jerr;
+  FILE *inFile;
+  JSAMPROW row_pointer[1];
+  VidFrame *volatile rgbFrame = NULL;
+  int rowStride;
+
+  if( (inFile = fopen(fileName, "rb")) == NULL ){
+    fprintf(stderr, "Can't open file %s. \n", fileName);
+    return NULL;
+  }
+
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = jpg_error_exit;
+  if( setjmp(jerr.setjmp_buffer) ){
+    jpeg_destroy_decompress(&cinfo);
+    fclose(inFile);
+    if( rgbFrame ){
+      VidFrame *frame = rgbFrame;
+      vidFrameRelease(&frame);
+    }
+    return NULL;
+  }
+
+  jpeg_create_decompress(&cinfo);
+  jpeg_stdio_src(&cinfo, inFile);
+  jpeg_read_header(&cinfo, TRUE);
+
+  /* always decode to RGB, grayscale images included */
+  cinfo.out_color_space = JCS_RGB;
+
+  if( box ){
+    cinfo.scale_num = 1;
+    for( cinfo.scale_denom = 8; cinfo.scale_denom > 1;
+         cinfo.scale_denom /= 2 ){
+      jpeg_calc_output_dimensions(&cinfo);
+      if( (int)cinfo.output_width >= box->width ||
+          (int)cinfo.output_height >= box->height ){
+        break;
+      }
+    }
+  }
+
+  jpeg_start_decompress(&cinfo);
+
+  rgbFrame = vidFrameCreate();
+  rowStride = cinfo.output_width * 3;
+  vidFrameResizeBuffer(rgbFrame, rowStride * cinfo.output_height);
+  rgbFrame->format = V4L2_PIX_FMT_RGB24;
+  rgbFrame->size.width = cinfo.output_width;
+  rgbFrame->size.height = cinfo.output_height;
+  rgbFrame->bytesperline = rowStride;
+  rgbFrame->imagesize = rowStride * cinfo.output_height;
+
+  while( cinfo.output_scanline < cinfo.output_height ){
+    row_pointer[0] = vidFrameGetImageData(rgbFrame) +
+      cinfo.output_scanline * rowStride;
+    (void) jpeg_read_scanlines(&cinfo, row_pointer, 1);
+  }
+
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  fclose(inFile);
+
+  return rgbFrame;
+}
+
 /* Using a Video4Linux2 capture object, write a high-resolution JPEG image.
  * Image size is defined in cam.h, HR_WIDTH and HR_HEIGHT
  *  capture - A pointer to the Video4Linux capture object. This object should
  *            not currently be in a streaming state.
  *  filename - C string specifying filename to save to
- *  quality - integer in the range [0, 100] specifying JPEG quality parameter
+ *  profile - the encoder settings, NULL for the "default" profile
+ *  when - The moment the photo should show, or NULL for the next frame
  *  @return 0 if the process was successful, nonzero otherwise
  */
-int capture_hr_jpg(V4L2Capture *capture, char *fileName, int quality){
+int capture_hr_jpg(V4L2Capture *capture, char *fileName,
+                   const JpegProfile *profile, const struct timeval *when){
   int retVal = 0, counter = 0;
-  
-  VidFrame *highFrame = v4l2CaptureQueryFrame(capture);
+  VidFrame *highFrame = NULL;
+  JpegProfile defaultProfile;
+
+  if( !profile ){
+    jpeg_profile_lookup("default", &defaultProfile);
+    profile = &defaultProfile;
+  }
 
-  /* Using jpeglib */
-  retVal = write_jpg(highFrame, fileName, 85);
+  /* pick the kept frame closest to the requested moment, only that one
+   * is copied out of the capture thread's history. If the newest one is
+   * more than half a frame before it, the next frame is closer. */
+  if( when ){
+    highFrame = v4l2CaptureFrameAt(capture, when);
+  }
+
+  if( !highFrame ){
+    highFrame = v4l2CaptureQueryFrame(capture);
+  }
+
+  if( vidFrameGetFormat(highFrame) == V4L2_PIX_FMT_MJPEG ){
+    /* the camera already compressed it */
+    retVal = mjpeg_write_file(highFrame, fileName);
+  } else {
+    /* Using jpeglib */
+    retVal = write_jpg_profile(highFrame, fileName, profile);
+  }
+
+  vidFrameUnref(&highFrame);
 
   return retVal;
 }
+
+/* Get a high-resolution frame, for encoding later.
+ *  capture - A pointer to the Video4Linux capture object
+ *  when - The moment the photo should show, or NULL for the next frame
+ *  @return a VidFrame object owned by the caller. In burst mode it is the
+ *          camera buffer itself, which goes back to the driver once the
+ *          frame is released.
+ */
+VidFrame *capture_hr_frame(V4L2Capture *capture, const struct timeval *when){
+  int64_t traceStart = traceBegin();
+  VidFrame *frame = NULL;
+
+  if( when ){
+    frame = v4l2CaptureFrameAt(capture, when);
+  }
+
+  /* a stream frame is only copied if the capture object reuses it */
+  if( !frame ){
+    frame = v4l2CaptureKeepFrame(capture, v4l2CaptureQueryFrame(capture));
+  }
+
+  traceEnd("capture_hr_frame", traceStart);
+
+  return frame;
+}
+
+
+/* Background JPEG encoding
+ *
+ * Jobs are kept in a FIFO protected by a mutex. Worker threads sleep on a
+ * condition variable until a job is queued, encode every output of the job
+ * from the same frame and then call the job's completion function.
+ */
+
+typedef struct EncodeJob {
+  VidFrame *frame;
+  JpegProfile profile;
+  EncodeOutput *outputs;
+  int nOutputs;
+  EncodeDoneFunc done;
+  void *data;
+  struct EncodeJob *next;
+} EncodeJob;
+
+struct EncodeQueue {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  EncodeJob *head;
+  EncodeJob *tail;
+  int stop;
+  int nThreads;
+  pthread_t *threads;
+};
+
+/* Write one output from an RGB frame, resampling it if needed
+ *  written - receives the frame which was written, source itself or a new
+ *            frame owned by the caller, NULL if resampling failed
+ */
+static int encode_output(VidFrame *source, const EncodeOutput *output,
+                         const JpegProfile *profile, VidFrame **written){
+  VidFrame *scaled;
+
+  if( output->size.width == vidFrameGetWidth(source) &&
+      output->size.height == vidFrameGetHeight(source) ){
+    *written = source;
+    return write_jpg_profile(source, output->fileName, profile);
+  }
+
+  /* area average, from the smallest image made so far which is large
+   * enough */
+  scaled = vidFramePoolGet(V4L2_PIX_FMT_RGB24, output->size.width,
+                           output->size.height);
+  if( vidFrameResize(source, scaled, (VidSize *)&output->size,
+                     VID_RESIZE_BOX) ){
+    fprintf(stderr, "Error while resizing frame.\n");
+    vidFrameRelease(&scaled);
+    *written = NULL;
+    return 1;
+  }
+
+  *written = scaled;
+  return write_jpg_profile(scaled, output->fileName, profile);
+}
+
+/* Convert the frame of a job to RGB24, once for all of its outputs
+ *  size - the largest output made from the RGB frame. A MJPEG frame is
+ *         only decoded to that size.
+ */
+static VidFrame *encode_rgb_frame(VidFrame *frame, const VidSize *size){
+  VidConv *converter;
+  VidFrame *rgbFrame;
+  VidSize rgbSize = frame->size;
+
+  if( vidFrameGetFormat(frame) == V4L2_PIX_FMT_RGB24 ){
+    vidFrameRef(frame);
+    return frame;
+  }
+
+  if( vidFrameGetFormat(frame) == V4L2_PIX_FMT_MJPEG ){
+    converter = vidConvFindScaler(V4L2_PIX_FMT_MJPEG, V4L2_PIX_FMT_RGB24);
+    rgbSize = *size;
+  } else {
+    converter = vidConvFind(vidFrameGetFormat(frame), V4L2_PIX_FMT_RGB24);
+  }
+  if( !converter ){
+    fprintf(stderr, "Couldn't find a valid converter.\n");
+    return NULL;
+  }
+
+  rgbFrame = vidFramePoolGet(V4L2_PIX_FMT_RGB24, rgbSize.width,
+                             rgbSize.height);
+  if( vidConvProcessScaled(converter, frame, rgbFrame, &rgbSize) ){
+    fprintf(stderr, "Error while converting frame format.\n");
+    vidFrameRelease(&rgbFrame);
+    return NULL;
+  }
+
+  return rgbFrame;
+}
+
+/* Write a frame to several JPEG images of decreasing sizes.
+ *  @return 0 if every file was written, nonzero otherwise
+ *
+ * The frame is converted to RGB once, if at all. The outputs are made from
+ * the largest to the smallest, and each one is shrunk from the previous one
+ * when it is large enough, so the full frame is only resampled once. A
+ * MJPEG frame is already a JPEG image: it is saved as it is, and decoded
+ * with DCT scaling for the smaller outputs.
+ */
+int write_jpg_multi(VidFrame *frame, const EncodeOutput *outputs,
+                    int nOutputs, const JpegProfile *profile){
+  VidFrame *rgbFrame = NULL, *source, *written, *prev = NULL;
+  int *order;
+  int i, j, k, retVal = 0;
+
+  /* sort the outputs by decreasing area */
+  order = malloc(sizeof(int) * nOutputs);
+  for( i = 0; i < nOutputs; i++ ){
+    k = outputs[i].size.width * outputs[i].size.height;
+    for( j = i; j > 0 && outputs[order[j - 1]].size.width *
+           outputs[order[j - 1]].size.height < k; j-- ){
+      order[j] = order[j - 1];
+    }
+    order[j] = i;
+  }
+
+  for( i = 0; i < nOutputs; i++ ){
+    const EncodeOutput *output = &outputs[order[i]];
+
+    /* a YUYV or MJPEG frame of the right size is written as it is, RGB is
+     * only needed to resample it or to hand it over */
+    if( !output->image &&
+        output->size.width == vidFrameGetWidth(frame) &&
+        output->size.height == vidFrameGetHeight(frame) ){
+      if( vidFrameGetFormat(frame) == V4L2_PIX_FMT_MJPEG ){
+        if( mjpeg_write_file(frame, output->fileName) ){
+          retVal = 1;
+        }
+        continue;
+      }
+      if( vidFrameGetFormat(frame) == V4L2_PIX_FMT_YUYV ){
+        if( write_jpg_profile(frame, output->fileName, profile) ){
+          retVal = 1;
+        }
+        continue;
+      }
+    }
+
+    if( !rgbFrame && !(rgbFrame = encode_rgb_frame(frame, &output->size)) ){
+      retVal = 1;
+      break;
+    }
+
+    source = rgbFrame;
+    if( prev && vidFrameGetWidth(prev) >= output->size.width &&
+        vidFrameGetHeight(prev) >= output->size.height ){
+      source = prev;
+    }
+
+    if( encode_output(source, output, profile, &written) ){
+      retVal = 1;
+    } else if( output->image ){
+      /* the caller's own frame is released by another thread, so the
+       * caller gets a copy of it */
+      if( written == frame ){
+        *output->image = vidFrameClone(written);
+      } else {
+        vidFrameRef(written);
+        *output->image = written;
+      }
+    }
+
+    /* the next output is shrunk from this one */
+    if( written && written != source ){
+      if( prev ){
+        vidFrameUnref(&prev);
+      }
+      prev = written;
+    }
+  }
+
+  if( prev ){
+    vidFrameUnref(&prev);
+  }
+  if( rgbFrame ){
+    vidFrameUnref(&rgbFrame);
+  }
+  free(order);
+
+  return retVal;
+}
+
+static void encode_job_free(EncodeJob *job){
+  int i;
+
+  for( i = 0; i < job->nOutputs; i++ ){
+    free(job->outputs[i].fileName);
+  }
+  free(job->outputs);
+  vidFrameUnref(&job->frame);
+  free(job);
+}
+
+static void *encode_thread(void *arg){
+  EncodeQueue *queue = arg;
+  EncodeJob *job;
+  int retVal;
+
+  for(;;){
+    /* wait for a job, leave once the queue is drained and stopped */
+    pthread_mutex_lock(&queue->lock);
+    while( !queue->head && !queue->stop ){
+      pthread_cond_wait(&queue->cond, &queue->lock);
+    }
+    job = queue->head;
+    if( job ){
+      queue->head = job->next;
+      if( !queue->head ){
+        queue->tail = NULL;
+      }
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    if( !job ){
+      break;
+    }
+
+    retVal = write_jpg_multi(job->frame, job->outputs, job->nOutputs,
+                             &job->profile);
+
+    if( job->done ){
+      job->done(retVal, job->data);
+    }
+    encode_job_free(job);
+  }
+
+  return NULL;
+}
+
+/* Start a pool of encoding threads.
+ *  nThreads - number of worker threads
+ *  @return the new queue, or NULL if no thread could be started
+ */
+EncodeQueue *encode_queue_new(int nThreads){
+  EncodeQueue *queue = malloc(sizeof(EncodeQueue));
+  int i;
+
+  memset(queue, 0, sizeof(EncodeQueue));
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->cond, NULL);
+
+  if( nThreads < 1 ){
+    nThreads = 1;
+  }
+  queue->threads = malloc(sizeof(pthread_t) * nThreads);
+
+  for( i = 0; i < nThreads; i++ ){
+    if( pthread_create(&queue->threads[i], NULL, encode_thread, queue) ){
+      fprintf(stderr, "Couldn't start an encoding thread.\n");
+      break;
+    }
+    queue->nThreads++;
+  }
+
+  if( !queue->nThreads ){
+    encode_queue_free(queue);
+    return NULL;
+  }
+
+  return queue;
+}
+
+/* Queue a frame to be written to one or more JPEG files.
+ *  @return 0 if the job was queued, nonzero otherwise
+ */
+int encode_queue_push(EncodeQueue *queue, VidFrame *frame,
+                      const JpegProfile *profile,
+                      const EncodeOutput *outputs, int nOutputs,
+                      EncodeDoneFunc done, void *data){
+  EncodeJob *job;
+  int i;
+
+  if( !queue || !frame ){
+    return 1;
+  }
+
+  job = malloc(sizeof(EncodeJob));
+  job->frame = frame;
+  job->profile = *profile;
+  job->nOutputs = nOutputs;
+  job->outputs = malloc(sizeof(EncodeOutput) * nOutputs);
+  for( i = 0; i < nOutputs; i++ ){
+    job->outputs[i].fileName = strdup(outputs[i].fileName);
+    job->outputs[i].size = outputs[i].size;
+    job->outputs[i].image = outputs[i].image;
+    if( outputs[i].image ){
+      *outputs[i].image = NULL;
+    }
+  }
+  job->done = done;
+  job->data = data;
+  job->next = NULL;
+
+  pthread_mutex_lock(&queue->lock);
+  if( queue->tail ){
+    queue->tail->next = job;
+  } else {
+    queue->head = job;
+  }
+  queue->tail = job;
+  pthread_cond_signal(&queue->cond);
+  pthread_mutex_unlock(&queue->lock);
+
+  return 0;
+}
+
+/* Finish the queued jobs, stop the threads and release the queue
+ *  queue - the encode queue
+ */
+void encode_queue_free(EncodeQueue *queue){
+  int i;
+
+  if( !queue ){
+    return;
+  }
+
+  pthread_mutex_lock(&queue->lock);
+  queue->stop = 1;
+  pthread_cond_broadcast(&queue->cond);
+  pthread_mutex_unlock(&queue->lock);
+
+  for( i = 0; i < queue->nThreads; i++ ){
+    pthread_join(queue->threads[i], NULL);
+  }
+
+  pthread_cond_destroy(&queue->cond);
+  pthread_mutex_destroy(&queue->lock);
+  free(queue->threads);
+  free(queue);
+}
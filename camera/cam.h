@@ -13,14 +13,44 @@
  * This code is defined in fourcc.c
  */
 #define YUYV 0x56595559
+/* Compressed format of the QuickCam Pro 9000, also defined in fourcc.c.
+ * It needs a fraction of the USB bandwidth of YUYV, so larger frames come
+ * at a higher frame rate */
+#define MJPEG 0x47504a4d
+/* The mode requested in MJPEG, the driver picks the closest one it has */
+#define MJPEG_WIDTH  1600
+#define MJPEG_HEIGHT 1200
+#define MJPEG_FPS    15
 /* Low resolution video should be 640x480 */
 #define LR_WIDTH  640
 #define LR_HEIGHT 480
+/* Number of recent frames kept for zero shutter lag capture,
+ * 0.8 seconds at 10 FPS */
+#define ZSL_FRAMES 8
+/* The camera opened by default */
+#define CAMERA_LOCATION "/dev/video0"
 
 /* Initializes the camera and returns a V4L2Capture pointer
  */
 V4L2Capture *open_camera();
 
+/* Initializes the camera in the given format, YUYV at HR_WIDTH x HR_HEIGHT
+ * or MJPEG at MJPEG_WIDTH x MJPEG_HEIGHT. The camera falls back to YUYV if
+ * it can't send MJPEG.
+ *  format - YUYV or MJPEG
+ *  @return a V4L2Capture pointer, or NULL if the camera can't be opened
+ */
+V4L2Capture *open_camera_format(fourcc_t format);
+
+/* Same as open_camera_format, for the camera at a location other than
+ * CAMERA_LOCATION. "replay:file" or "replay:file@fps" replays a recording
+ * of the camera instead, in the format and size it was recorded in.
+ *  location - the device file, or the recording to replay
+ *  format - YUYV or MJPEG
+ *  @return a V4L2Capture pointer, or NULL if the camera can't be opened
+ */
+V4L2Capture *open_camera_at(const char *location, fourcc_t format);
+
 /* Closes the video stream and releases resources
  *  capture - A pointer to the Video4Linux capture object
  */
@@ -32,6 +62,68 @@ void close_camera(V4L2Capture *capture);
  */
 VidFrame *getFrame(V4L2Capture *capture);
 
+/* Get the newest frame from the video stream, converted to RGB24 and
+ * scaled down to the requested size in a single pass. The full size RGB
+ * image is never created. This function does not block.
+ *  capture - A pointer to the Video4Linux capture object
+ *  size - The size of the returned frame, e.g. LR_WIDTH x LR_HEIGHT
+ *  @return a VidFrame object with data in RGB24 format, or NULL if no new
+ *          frame arrived since the last call or the frame is damaged
+ */
+VidFrame *getPreviewFrame(V4L2Capture *capture, VidSize size);
+
+/* DCT methods of the JPEG encoder */
+typedef enum {
+  /* accurate integer DCT, the libjpeg default */
+  JPEG_DCT_ISLOW,
+  /* faster and less accurate integer DCT */
+  JPEG_DCT_IFAST,
+  /* floating point DCT */
+  JPEG_DCT_FLOAT
+} JpegDctMethod;
+
+/* Resolution of the color channels relative to the brightness */
+typedef enum {
+  /* half width and half height, the libjpeg default */
+  JPEG_SUBSAMPLE_420,
+  /* half width */
+  JPEG_SUBSAMPLE_422,
+  /* full resolution, best for prints */
+  JPEG_SUBSAMPLE_444
+} JpegSubsampling;
+
+/* Settings of the JPEG encoder, which trade encoding time against file
+ * size and image quality */
+typedef struct {
+  /* integer in the range [0, 100] specifying JPEG quality parameter */
+  int quality;
+  JpegDctMethod dctMethod;
+  /* compute optimal Huffman tables, smaller files for an extra pass */
+  int optimize;
+  /* write a progressive JPEG, smaller files for more encoding time */
+  int progressive;
+  JpegSubsampling subsampling;
+} JpegProfile;
+
+/* Set the libjpeg defaults in a JPEG profile.
+ *  profile - the profile to set
+ *  quality - integer in the range [0, 100] specifying JPEG quality parameter
+ */
+void jpeg_profile_init(JpegProfile *profile, int quality);
+
+/* Get one of the named JPEG profiles: "default" (libjpeg defaults at
+ * quality 85), "fast", "small" and "print".
+ *  name - the name of the profile
+ *  profile - receives the profile
+ *  @return 0 if the profile exists, nonzero otherwise
+ */
+int jpeg_profile_lookup(const char *name, JpegProfile *profile);
+
+/* Get the name of the i-th named JPEG profile.
+ *  @return the name, or NULL past the last profile
+ */
+const char *jpeg_profile_name(int i);
+
 /* Write a Video4Linux2 frame to a JPEG image.
  *  frame - A pointer to the Video4Linux2 frame struct
  *  filename - C string specifying filename to save to
@@ -40,14 +132,121 @@ VidFrame *getFrame(V4L2Capture *capture);
  */
 int write_jpg(VidFrame *frame, char *fileName, int quality);
 
+/* Write a Video4Linux2 frame to a JPEG image with the given encoder
+ * settings. A YUYV frame is encoded from its own YCbCr samples, without
+ * an RGB copy.
+ *  frame - A pointer to the Video4Linux2 frame struct
+ *  filename - C string specifying filename to save to
+ *  profile - the encoder settings
+ *  @return 0 if the process was successful, nonzero if unsuccessful
+ */
+int write_jpg_profile(VidFrame *frame, char *fileName,
+                      const JpegProfile *profile);
+
+/* Read a JPEG image into a RGB24 frame.
+ *  filename - C string specifying the file to read
+ *  @return a new VidFrame object with data in RGB24 format, or NULL if the
+ *          file can't be read
+ */
+VidFrame *read_jpg(char *fileName);
+
+/* Read a JPEG image into a RGB24 frame, using the DCT scaling of the
+ * decoder to skip the detail lost when the image is fitted in box.
+ *  filename - C string specifying the file to read
+ *  box - the image is decoded at 1/2, 1/4 or 1/8 of its size while it
+ *        still reaches the width or the height of box. NULL for full size.
+ *  @return a new VidFrame object with data in RGB24 format, or NULL if the
+ *          file can't be read
+ */
+VidFrame *read_jpg_scaled(char *fileName, const VidSize *box);
+
 /* Using a Video4Linux2 capture object, write a high-resolution JPEG image.
  * Image size is defined in cam.h, HR_WIDTH and HR_HEIGHT
  *  capture - A pointer to the Video4Linux capture object
- *  lowRes - VidSize object holding the original video size
  *  filename - C string specifying filename to save to
- *  quality - integer in the range [0, 100] specifying JPEG quality parameter
+ *  profile - the encoder settings, NULL for the "default" profile. A MJPEG
+ *            frame is saved as the camera compressed it.
+ *  when - The moment the photo should show, from v4l2CaptureGetTime. The
+ *         frame closest to it is taken from the frames kept by the capture
+ *         thread (see v4l2CaptureSetHistory). If NULL, if no frame is
+ *         kept or if the next frame will be closer to the moment, the next
+ *         frame from the stream is used.
  *  @return 0 if the process was successful, nonzero otherwise
  */
-int capture_hr_jpg(V4L2Capture *capture, char *fileName, int quality);
+int capture_hr_jpg(V4L2Capture *capture, char *fileName,
+                   const JpegProfile *profile, const struct timeval *when);
+
+/* Get a high-resolution frame, for encoding later. The frame is chosen as
+ * in capture_hr_jpg. In burst mode the camera buffer itself is returned,
+ * not a copy: release the frame as soon as it is encoded.
+ *  capture - A pointer to the Video4Linux capture object
+ *  when - The moment the photo should show, or NULL for the next frame
+ *  @return a VidFrame object in the camera's format, owned by the caller
+ */
+VidFrame *capture_hr_frame(V4L2Capture *capture, const struct timeval *when);
+
+/* A JPEG file written by an encode job */
+typedef struct {
+  /* C string specifying filename to save to */
+  char *fileName;
+  /* The size of the image. The frame is resampled if it differs from
+   * the frame size. */
+  VidSize size;
+  /* If not NULL, receives the RGB24 image which was written, before the
+   * done function is called. The caller owns it and releases it. */
+  VidFrame **image;
+} EncodeOutput;
+
+/* Write a frame to several JPEG images of different sizes. The frame is
+ * converted to RGB at most once, and the outputs are made from the largest
+ * to the smallest, each shrunk from the previous one when it is large
+ * enough. An output of the size of a YUYV frame, whose image is not
+ * requested, is encoded from the YUYV samples.
+ *  frame - the frame to encode, in any format a converter exists for
+ *  outputs - the files to write. The image of an output, if requested, is
+ *            set before the function returns.
+ *  nOutputs - number of entries in outputs
+ *  profile - the encoder settings
+ *  @return 0 if every file was written, nonzero otherwise
+ */
+int write_jpg_multi(VidFrame *frame, const EncodeOutput *outputs,
+                    int nOutputs, const JpegProfile *profile);
+
+/* Called by a worker thread when an encode job is finished. Use g_idle_add
+ * to get back to the main loop.
+ *  result - 0 if every file was written, nonzero otherwise
+ *  data - the pointer given to encode_queue_push
+ */
+typedef void (*EncodeDoneFunc)(int result, void *data);
+
+/* A pool of threads which encode frames to JPEG in the background */
+typedef struct EncodeQueue EncodeQueue;
+
+/* Start a pool of encoding threads.
+ *  nThreads - number of worker threads
+ *  @return the new queue, or NULL if no thread could be started
+ */
+EncodeQueue *encode_queue_new(int nThreads);
+
+/* Queue a frame to be written to one or more JPEG files. Returns at once.
+ *  queue - the encode queue
+ *  frame - the frame to encode. The queue takes it over and releases it
+ *          when the job is done.
+ *  profile - the encoder settings, copied by the queue
+ *  outputs - the files to write, copied by the queue
+ *  nOutputs - number of entries in outputs
+ *  done - function called when the job is finished, may be NULL
+ *  data - passed to done
+ *  @return 0 if the job was queued, nonzero otherwise
+ */
+int encode_queue_push(EncodeQueue *queue, VidFrame *frame,
+                      const JpegProfile *profile,
+                      const EncodeOutput *outputs, int nOutputs,
+                      EncodeDoneFunc done, void *data);
+
+/* Finish the queued jobs, stop the threads and release the queue
+ *  queue - the encode queue
+ */
+void encode_queue_free(EncodeQueue *queue);
 
 #endif
@@ -0,0 +1,401 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "drv-file.h"
+
+/* Recording file
+ *
+ * A header, followed by the frames. Each frame has a header of its own
+ * and its data is padded to 8 bytes. Integers are in host byte order.
+ *
+ * The whole file is mapped for replay and the frames handed out point
+ * into the mapping, so replaying costs no copy and no read() once the
+ * pages are cached.
+ */
+
+#define RECORDING_MAGIC "PBCAMREC"
+#define RECORDING_ALIGN 8
+
+typedef struct {
+  char magic[8];
+  uint32_t format;
+  uint32_t width;
+  uint32_t height;
+  uint32_t bytesperline;
+  /// The rate of the camera, the default replay rate
+  uint32_t fps;
+  uint32_t reserved;
+} RecordingHeader;
+
+typedef struct {
+  /// Length of the frame data, without the padding
+  uint32_t length;
+  uint32_t reserved;
+  /// Timestamp of the frame given by the driver, in usec
+  int64_t timestamp;
+} RecordingFrame;
+
+/// A recording being replayed. Shared by the capture and the frames handed out.
+typedef struct {
+  unsigned char *map;
+  size_t maplen;
+
+  /// Offset of the data of each frame, and its length
+  size_t *offsets;
+  int *lengths;
+  int nFrames;
+
+  /// Index of the frame to deliver next. The replay loops.
+  int next;
+
+  /// Replay rate, 0 for as fast as possible
+  int fps;
+
+  /// Non-zero if the location gave the rate, which then wins over v4l2CaptureSetFPS()
+  int fixed_fps;
+
+  int streaming;
+
+  /// 1 for the capture, plus 1 per frame handed out
+  int refcount;
+} FileSource;
+
+static void file_log(V4L2Capture *capture,const char *msg,const char *arg){
+  if (capture->log)
+    fprintf(stderr,"[replay] %s: %s\n",msg,arg);
+}
+
+static void file_source_unref(FileSource *src){
+  if (__atomic_sub_fetch(&src->refcount,1,__ATOMIC_ACQ_REL))
+    return;
+
+  munmap(src->map,src->maplen);
+  free(src->offsets);
+  free(src->lengths);
+  free(src);
+}
+
+/// Called when the last reference to a frame handed out is dropped
+static void file_frame_recycle(VidFrame *frame){
+  FileSource *src = frame->owner;
+
+  free(frame);
+  file_source_unref(src);
+}
+
+/// Arm the timer at the replay rate, or disarm it
+static int file_set_timer(V4L2Capture *capture){
+  FileSource *src = capture->backend_data;
+  struct itimerspec its;
+  long long period = 1;
+
+  memset(&its,0,sizeof(its));
+  if (src->streaming){
+    if (src->fps > 0)
+      period = 1000000000LL / src->fps;
+    its.it_interval.tv_sec = period / 1000000000LL;
+    its.it_interval.tv_nsec = period % 1000000000LL;
+    its.it_value = its.it_interval;
+  }
+
+  return timerfd_settime(capture->fd,0,&its,0);
+}
+
+static int file_start_streaming(V4L2Capture *capture,int burst,int nBuffer,int memory){
+  FileSource *src = capture->backend_data;
+
+  src->streaming = 1;
+  capture->iomode = V4L2_CAP_STREAMING;
+  capture->burst_mode = burst;
+
+  return file_set_timer(capture);
+}
+
+static int file_stop_streaming(V4L2Capture *capture){
+  FileSource *src = capture->backend_data;
+
+  src->streaming = 0;
+  capture->iomode = V4L2_CAP_READWRITE;
+
+  return file_set_timer(capture);
+}
+
+/// Wait for the timer and hand out the frame which is due
+static VidFrame* file_query_frame(V4L2Capture *capture){
+  FileSource *src = capture->backend_data;
+  VidFrame *frame;
+  struct timespec ts;
+  uint64_t ticks;
+  int index;
+
+  if (!src->streaming)
+    return 0;
+
+  if (read(capture->fd,&ticks,sizeof(ticks)) != sizeof(ticks))
+    return 0;
+
+  /* As with a camera, the frames of the periods the caller missed are
+   * lost, and leave a gap in the sequence numbers. As fast as possible,
+   * every frame is delivered in turn. */
+  if (src->fps > 0)
+    src->next = (src->next + ticks - 1) % src->nFrames;
+
+  index = src->next;
+  if (++src->next >= src->nFrames)
+    src->next = 0;
+  capture->sequence += src->fps > 0 ? ticks : 1;
+
+  frame = vidFrameCreate();
+  frame->data = src->map + src->offsets[index];
+  frame->imagesize = src->lengths[index];
+  frame->readonly = 1;
+  frame->format = capture->format;
+  frame->size = capture->resolution;
+  frame->bytesperline = capture->bytesperline;
+  frame->recycle = file_frame_recycle;
+  frame->owner = src;
+
+  /* Stamped when delivered, as a camera does */
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  frame->timestamp.tv_sec = ts.tv_sec;
+  frame->timestamp.tv_usec = ts.tv_nsec / 1000;
+
+  __atomic_add_fetch(&src->refcount,1,__ATOMIC_RELAXED);
+
+  return frame;
+}
+
+/// A recording only has its own format and size
+static int file_set_image_format(V4L2Capture *capture,fourcc_t fourcc,VidSize *size){
+  if (fourcc != capture->format ||
+      (size && (size->width != capture->resolution.width ||
+                size->height != capture->resolution.height))){
+    file_log(capture,"The recording has another format",capture->location);
+    return -1;
+  }
+  return 0;
+}
+
+static int file_set_fps(V4L2Capture *capture,int fps){
+  FileSource *src = capture->backend_data;
+
+  if (!src->fixed_fps && fps > 0){
+    src->fps = fps;
+    capture->fps = fps;
+    file_set_timer(capture);
+  }
+  return 0;
+}
+
+static void file_release(V4L2Capture *capture){
+  file_source_unref(capture->backend_data);
+  capture->backend_data = 0;
+}
+
+static const V4L2CaptureBackend file_backend = {
+  "replay",
+  file_start_streaming,
+  file_stop_streaming,
+  file_query_frame,
+  file_set_image_format,
+  file_set_fps,
+  file_release
+};
+
+/// Find the frames of a mapped recording, skipping those shorter than minLength
+static int file_source_index(FileSource *src,size_t minLength,int *skipped){
+  RecordingFrame *rf;
+  size_t pos = sizeof(RecordingHeader);
+  int size = 0;
+
+  *skipped = 0;
+  while (pos + sizeof(RecordingFrame) <= src->maplen){
+    rf = (RecordingFrame *)(src->map + pos);
+    pos += sizeof(RecordingFrame);
+    if (rf->length > src->maplen - pos)
+      break; /* truncated by a crash, the frames before are fine */
+
+    /* The converters read a whole image, past the end of a short one */
+    if (rf->length < minLength){
+      (*skipped)++;
+      pos += (rf->length + RECORDING_ALIGN - 1) & ~(RECORDING_ALIGN - 1);
+      continue;
+    }
+
+    if (src->nFrames >= size){
+      size = size ? size * 2 : 64;
+      src->offsets = realloc(src->offsets,sizeof(size_t) * size);
+      src->lengths = realloc(src->lengths,sizeof(int) * size);
+    }
+    src->offsets[src->nFrames] = pos;
+    src->lengths[src->nFrames] = rf->length;
+    src->nFrames++;
+
+    pos += (rf->length + RECORDING_ALIGN - 1) & ~(RECORDING_ALIGN - 1);
+  }
+
+  return src->nFrames;
+}
+
+/**
+ *  @param location - the file name, optionally followed by "@fps"
+ *  @return A capture replaying the recording in a loop, or NULL on error.
+ *
+ *  The frames are delivered at the rate the recording was made at, the
+ *  rate of the location, or the rate given to v4l2CaptureSetFPS(). They
+ *  are stamped with CLOCK_MONOTONIC when delivered. The capture has the
+ *  format and size of the recording, and a frame handed out stays valid
+ *  until it is released.
+ */
+V4L2Capture* fileCaptureOpen(const char *location){
+  V4L2Capture *capture;
+  FileSource *src;
+  RecordingHeader *header;
+  struct stat st;
+  char *filename,*at;
+  int fd,bufsize = 0,skipped = 0;
+
+  filename = strdup(location);
+  at = strrchr(filename,'@');
+  if (at)
+    *at = 0;
+
+  fd = open(filename,O_RDONLY);
+  if (fd < 0){
+    fprintf(stderr,"[replay] %s: %s\n",filename,strerror(errno));
+    free(filename);
+    return 0;
+  }
+
+  src = malloc(sizeof(FileSource));
+  memset(src,0,sizeof(FileSource));
+  src->refcount = 1;
+
+  if (fstat(fd,&st) == 0 && st.st_size >= (off_t)sizeof(RecordingHeader)){
+    src->maplen = st.st_size;
+    src->map = mmap(NULL,src->maplen,PROT_READ,MAP_PRIVATE,fd,0);
+    if (src->map == MAP_FAILED)
+      src->map = 0;
+  }
+  close(fd);
+
+  /* An uncompressed frame must hold the whole image. A compressed one
+   * has no fixed size, and may have no row stride either. */
+  header = (RecordingHeader *)src->map;
+  if (header)
+    bufsize = vidFourccCalcFrameSize(header->format,header->width,
+                                     header->height);
+  if (!header || memcmp(header->magic,RECORDING_MAGIC,8) ||
+      !header->width || !header->height ||
+      (bufsize > 0 && !header->bytesperline) ||
+      !file_source_index(src,bufsize > 0 ? bufsize : 0,&skipped)){
+    fprintf(stderr,"[replay] %s is not a recording\n",filename);
+    if (src->map)
+      munmap(src->map,src->maplen);
+    free(src->offsets);
+    free(src->lengths);
+    free(src);
+    free(filename);
+    return 0;
+  }
+
+  if (skipped)
+    fprintf(stderr,"[replay] %s: skipped %d short frames\n",filename,skipped);
+
+  /* Sequential replay: let the kernel read ahead */
+  madvise(src->map,src->maplen,MADV_SEQUENTIAL);
+
+  src->fps = header->fps;
+  if (at){
+    src->fps = atoi(at + 1);
+    src->fixed_fps = 1;
+  }
+
+  capture = malloc(sizeof(V4L2Capture));
+  memset(capture,0,sizeof(V4L2Capture));
+  capture->fd = timerfd_create(CLOCK_MONOTONIC,TFD_CLOEXEC);
+  capture->backend = &file_backend;
+  capture->backend_data = src;
+  capture->location = strdup(location);
+  capture->name = strdup(filename);
+  capture->driver = strdup("replay");
+  capture->bus = strdup("file");
+  capture->capabilities = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING;
+  capture->iomode = V4L2_CAP_READWRITE;
+  capture->format = header->format;
+  capture->resolution.width = header->width;
+  capture->resolution.height = header->height;
+  capture->bytesperline = header->bytesperline;
+  capture->bufsize = bufsize;
+  capture->fps = src->fps;
+  capture->channel = -1;
+  capture->norm = -1;
+  capture->timestamp_monotonic = 1;
+  capture->log = 1;
+
+  free(filename);
+
+  return capture;
+}
+
+/**
+ *  @return The file, positioned after the header, or NULL on error
+ */
+FILE* fileRecordingCreate(const char *filename,V4L2Capture *capture){
+  RecordingHeader header;
+  FILE *file;
+
+  file = fopen(filename,"wb");
+  if (!file){
+    fprintf(stderr,"[record] %s: %s\n",filename,strerror(errno));
+    return 0;
+  }
+
+  memset(&header,0,sizeof(header));
+  memcpy(header.magic,RECORDING_MAGIC,8);
+  header.format = capture->format;
+  header.width = capture->resolution.width;
+  header.height = capture->resolution.height;
+  header.bytesperline = capture->bytesperline;
+  header.fps = capture->fps + 0.5;
+
+  if (fwrite(&header,sizeof(header),1,file) != 1){
+    fclose(file);
+    return 0;
+  }
+
+  return file;
+}
+
+/**
+ *  @return Non-zero value to indicate error
+ */
+int fileRecordingWrite(FILE *file,VidFrame *frame){
+  static const char padding[RECORDING_ALIGN];
+  RecordingFrame rf;
+  int pad;
+
+  memset(&rf,0,sizeof(rf));
+  rf.length = frame->imagesize;
+  rf.timestamp = (int64_t)frame->timestamp.tv_sec * 1000000 +
+    frame->timestamp.tv_usec;
+  pad = -rf.length & (RECORDING_ALIGN - 1);
+
+  if (fwrite(&rf,sizeof(rf),1,file) != 1 ||
+      fwrite(frame->data,1,rf.length,file) != rf.length ||
+      fwrite(padding,1,pad,file) != (size_t)pad)
+    return -1;
+
+  return 0;
+}
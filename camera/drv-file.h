@@ -0,0 +1,32 @@
+#ifndef DRV_FILE_H_
+#define DRV_FILE_H_
+
+#include <stdio.h>
+#include "drv-v4l2.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+  /* Recordings
+   *
+   * A recording holds the frames a capture delivered, as they came from
+   * the device (raw YUYV or MJPEG), so that they can be replayed through
+   * the V4L2Capture API without a camera: v4l2CaptureOpen("replay:file")
+   * or "replay:file@fps".
+   */
+
+  /// Open a recording for replay. location is "file" or "file@fps", fps 0 replays as fast as possible.
+  V4L2Capture* fileCaptureOpen(const char *location);
+
+  /// Create a recording of frames of the format and size of the capture. Returns NULL on error.
+  FILE* fileRecordingCreate(const char *filename,V4L2Capture *capture);
+
+  /// Append a frame to a recording
+  int fileRecordingWrite(FILE *file,VidFrame *frame);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
+
+#endif /*DRV_FILE_H_*/
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -9,7 +10,13 @@
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
 #include <unistd.h>
+#include <linux/dma-buf.h>
+#include <linux/udmabuf.h>
 #include "fourcc.h"
 
 /* TODO:
@@ -19,6 +26,7 @@
  */
 
 #include "drv-v4l2.h"
+#include "drv-file.h"
 
 #define DEBUG
 #ifdef DEBUG
@@ -159,17 +167,16 @@ static int capture_create_frames_buffer(V4L2Capture *dev,int size){
   return size;
 }
 
+static void ring_prepare_queue(V4L2BufferRing *ring,int index,struct v4l2_buffer *buffer);
+static void ring_cpu_access(V4L2BufferRing *ring,int index,int start);
+
 /// Enqueue a frame
 static int capture_enqueue(V4L2Capture *dev,int index){
   struct v4l2_buffer buffer;
   int res;
 	
   //printf("%s::index = %d\n",__func__,index);
-  memset (&buffer, 0, sizeof (buffer));
-	
-  buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  buffer.memory = V4L2_MEMORY_MMAP;
-  buffer.index = index;//?
+  ring_prepare_queue(dev->ring,index,&buffer);
 	
   res = v4l_ioctl(dev,VIDIOC_QBUF,&buffer);
 	
@@ -177,97 +184,409 @@ static int capture_enqueue(V4L2Capture *dev,int index){
 }
 
 /// Dequeue a frame (blocked I/O)
-
+/**
+ * @return The index of the buffer the driver filled, or -1 on error.
+ *
+ * The timestamp, sequence number and payload size reported by the
+ * driver are recorded in the frame.
+ */
 static int capture_dequeue(V4L2Capture *dev){
   struct v4l2_buffer buffer;
+  VidFrame *frame;
   int res;
   //printf("%s\n",__func__);
 	
   memset (&buffer, 0, sizeof (buffer));
 
   buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  buffer.memory = V4L2_MEMORY_MMAP;
+  buffer.memory = dev->memory;
 	
   res = v4l_ioctl(dev,VIDIOC_DQBUF,&buffer);
+  if (res < 0)
+    return -1;
+
+  if (buffer.index >= dev->frames){
+    capture_log(dev,"Driver returned an invalid buffer index %d\n",buffer.index);
+    return -1;
+  }
+
+  ring_cpu_access(dev->ring,buffer.index,1);
+
+  frame = &dev->framesbuffer[buffer.index];
+  frame->timestamp = buffer.timestamp;
+#ifdef V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC
+  dev->timestamp_monotonic = (buffer.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) ==
+    V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+#endif
+  if (buffer.bytesused)
+    frame->imagesize = buffer.bytesused;
+  dev->sequence = buffer.sequence;
 	
-  return res;
+  return buffer.index;
+}
+
+/// TRUE if the driver has another filled buffer ready to be dequeued
+static int capture_frame_pending(V4L2Capture *dev){
+  struct pollfd pfd;
+
+  pfd.fd = dev->fd;
+  pfd.events = POLLIN;
+  return poll(&pfd,1,0) > 0 && (pfd.revents & POLLIN);
+}
+
+/* Zero-copy hand-off
+ *
+ * In burst mode a query hands out the frame of the driver buffer itself
+ * instead of a copy, and the buffer is queued back to the driver when the
+ * last reference to the frame is dropped, from whichever thread. The
+ * buffers belong to a ring shared by the capture and the frames handed
+ * out, so a frame may outlive the stream: a buffer still held when
+ * streaming stops is freed when its frame is released, and the ring is
+ * freed once the capture and every frame let go of it.
+ *
+ * The memory of the buffers is one of
+ *  - V4L2_MEMORY_MMAP: allocated by the driver and mapped.
+ *  - V4L2_MEMORY_USERPTR: our own page aligned buffers from the frame pool,
+ *    which the driver writes into.
+ *  - V4L2_MEMORY_DMABUF: our own memory too, shared with the driver as
+ *    DMABUF file descriptors created by /dev/udmabuf.
+ * The buffers of the MMAP mode can in turn be exported as DMABUF
+ * (v4l2CaptureGetFrameDmabuf()).
+ */
+
+struct V4L2BufferRing {
+  /// The device, only used while streaming
+  int fd;
+
+  /// Non-zero while released buffers are queued back to the driver
+  int streaming;
+
+  /// 1 for the capture, plus 1 per frame handed out
+  int refcount;
+
+  /// V4L2_MEMORY_MMAP, V4L2_MEMORY_USERPTR or V4L2_MEMORY_DMABUF
+  int memory;
+
+  /// no. of buffers
+  int frames;
+
+  /// One frame per buffer, pointing into its memory
+  VidFrame *framesbuffer;
+
+  /// USERPTR mode: the pooled frames owning the memory of the buffers
+  VidFrame **userptr;
+
+  /// DMABUF file descriptor of each buffer, or -1
+  int *dmabuf;
+
+  pthread_mutex_t lock;
+};
+
+static void ring_recycle(VidFrame *frame);
+
+static V4L2BufferRing* ring_new(V4L2Capture *dev,int memory){
+  V4L2BufferRing *ring = malloc(sizeof(V4L2BufferRing));
+  int i;
+
+  memset(ring,0,sizeof(V4L2BufferRing));
+  ring->fd = dev->fd;
+  ring->refcount = 1;
+  ring->memory = memory;
+  ring->frames = dev->frames;
+  ring->framesbuffer = dev->framesbuffer;
+  ring->userptr = calloc(ring->frames,sizeof(VidFrame*));
+  ring->dmabuf = malloc(sizeof(int) * ring->frames);
+  for (i=0;i<ring->frames;i++)
+    ring->dmabuf[i] = -1;
+  pthread_mutex_init(&ring->lock,0);
+
+  return ring;
+}
+
+static void ring_unref(V4L2BufferRing *ring){
+  if (__atomic_sub_fetch(&ring->refcount,1,__ATOMIC_ACQ_REL))
+    return;
+
+  pthread_mutex_destroy(&ring->lock);
+  free(ring->dmabuf);
+  free(ring->userptr);
+  free(ring->framesbuffer);
+  free(ring);
+}
+
+/// Map a buffer allocated by the driver
+static int ring_alloc_mmap(V4L2Capture *dev,V4L2BufferRing *ring,int index){
+  VidFrame *frame = &ring->framesbuffer[index];
+  struct v4l2_buffer buffer;
+
+  memset (&buffer, 0, sizeof (buffer));
+  buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  buffer.memory = V4L2_MEMORY_MMAP;
+  buffer.index = index;
+  if (v4l_ioctl (dev, VIDIOC_QUERYBUF, &buffer) < 0)
+    return -1;
+
+  frame->data = mmap (NULL, buffer.length,
+                      PROT_READ | PROT_WRITE, /* required */
+                      MAP_SHARED,             /* recommended */
+                      dev->fd, buffer.m.offset);
+  if (frame->data == MAP_FAILED){
+    capture_log(dev,"mmap: %s\n",strerror(errno));
+    frame->data = 0;
+    return -1;
+  }
+  frame->buflen = buffer.length; /* remember for munmap() */
+
+  return 0;
+}
+
+/// Take a buffer of the driver's image size from the frame pool
+static int ring_alloc_userptr(V4L2Capture *dev,V4L2BufferRing *ring,int index){
+  VidFrame *frame = &ring->framesbuffer[index];
+  VidFrame *backing;
+
+  backing = vidFramePoolGetSized(dev->format,dev->resolution.width,
+                                 dev->resolution.height,dev->bufsize);
+  ring->userptr[index] = backing;
+  frame->data = backing->data;
+  frame->buflen = backing->buflen;
+
+  return 0;
+}
+
+/// Allocate a buffer of our own and share it with the driver as a DMABUF
+static int ring_alloc_dmabuf(V4L2Capture *dev,V4L2BufferRing *ring,int index){
+  VidFrame *frame = &ring->framesbuffer[index];
+  struct udmabuf_create create;
+  long page = sysconf(_SC_PAGESIZE);
+  int size = (dev->bufsize + page - 1) & ~(page - 1);
+  int memfd,udmabuf;
+
+  memfd = memfd_create("v4l2-buffer",MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (memfd < 0){
+    capture_log(dev,"memfd_create: %s\n",strerror(errno));
+    return -1;
+  }
+
+  /* udmabuf only accepts memory which can't shrink under the device */
+  if (ftruncate(memfd,size) < 0 ||
+      fcntl(memfd,F_ADD_SEALS,F_SEAL_SHRINK) < 0){
+    capture_log(dev,"memfd: %s\n",strerror(errno));
+    close(memfd);
+    return -1;
+  }
+
+  udmabuf = open("/dev/udmabuf",O_RDWR | O_CLOEXEC);
+  if (udmabuf >= 0){
+    memset(&create,0,sizeof(create));
+    create.memfd = memfd;
+    create.flags = UDMABUF_FLAGS_CLOEXEC;
+    create.offset = 0;
+    create.size = size;
+    ring->dmabuf[index] = ioctl(udmabuf,UDMABUF_CREATE,&create);
+    close(udmabuf);
+  }
+  if (ring->dmabuf[index] < 0){
+    capture_log(dev,"udmabuf: %s\n",strerror(errno));
+    ring->dmabuf[index] = -1;
+    close(memfd);
+    return -1;
+  }
+
+  /* The CPU reads the same pages through the memfd */
+  frame->data = mmap(NULL,size,PROT_READ | PROT_WRITE,MAP_SHARED,memfd,0);
+  close(memfd);
+  if (frame->data == MAP_FAILED){
+    capture_log(dev,"mmap: %s\n",strerror(errno));
+    frame->data = 0;
+    return -1;
+  }
+  frame->buflen = size;
+
+  return 0;
+}
+
+/// Free the memory of a buffer. Called with the lock held.
+static void ring_free_buffer(V4L2BufferRing *ring,int index){
+  VidFrame *frame = &ring->framesbuffer[index];
+
+  if (ring->memory == V4L2_MEMORY_USERPTR){
+    if (ring->userptr[index])
+      vidFrameRelease(&ring->userptr[index]);
+  } else if (frame->data){
+    munmap(frame->data,frame->buflen);
+  }
+  frame->data = 0;
+  frame->buflen = 0;
+
+  if (ring->dmabuf[index] >= 0){
+    close(ring->dmabuf[index]);
+    ring->dmabuf[index] = -1;
+  }
+}
+
+/// Fill the v4l2_buffer to queue a buffer with
+static void ring_prepare_queue(V4L2BufferRing *ring,int index,struct v4l2_buffer *buffer){
+  VidFrame *frame = &ring->framesbuffer[index];
+
+  memset (buffer, 0, sizeof (*buffer));
+  buffer->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  buffer->memory = ring->memory;
+  buffer->index = index;
+
+  if (ring->memory == V4L2_MEMORY_USERPTR){
+    buffer->m.userptr = (unsigned long)frame->data;
+    buffer->length = frame->buflen;
+  } else if (ring->memory == V4L2_MEMORY_DMABUF){
+    buffer->m.fd = ring->dmabuf[index];
+    buffer->length = frame->buflen;
+    ring_cpu_access(ring,index,0);
+  }
+}
+
+/// Bracket the CPU access to a DMABUF buffer, between the dequeue and the queue
+static void ring_cpu_access(V4L2BufferRing *ring,int index,int start){
+  struct dma_buf_sync sync;
+
+  if (ring->memory != V4L2_MEMORY_DMABUF)
+    return;
+
+  sync.flags = DMA_BUF_SYNC_READ | (start ? DMA_BUF_SYNC_START : DMA_BUF_SYNC_END);
+  ioctl(ring->dmabuf[index],DMA_BUF_IOCTL_SYNC,&sync);
 }
 
 /**
+ *  Request the buffers of the streaming mode from the driver and set up
+ *  their memory.
+ *
  *  @todo  implement vidFrameMmap() to avoid to access VidFrame
  *  member attributes directly 
  */
 
-static int capture_mmap(V4L2Capture *dev,int nBuffer){
+static int capture_request_buffers(V4L2Capture *dev,int nBuffer,int memory){
   int res;
   struct v4l2_requestbuffers reqbuf;
-  unsigned int i;
+  V4L2BufferRing *ring;
+  int i;
+
+  if (memory != V4L2_MEMORY_MMAP && dev->bufsize <= 0){
+    capture_log(dev,"The driver didn't tell the image size\n");
+    return -1;
+  }
 
   memset (&reqbuf, 0, sizeof (reqbuf));
   reqbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  reqbuf.memory = V4L2_MEMORY_MMAP;
+  reqbuf.memory = memory;
   reqbuf.count = nBuffer;
 	
   res = v4l_ioctl (dev, VIDIOC_REQBUFS, &reqbuf);
 	
   if (res<0){
-    capture_log(dev,"Video mmap-streaming is not supported\n");
+    capture_log(dev,"Video %s-streaming is not supported\n",
+                memory == V4L2_MEMORY_USERPTR ? "userptr" :
+                memory == V4L2_MEMORY_DMABUF ? "dmabuf" : "mmap");
     return res;
   } 
 	
   //capture_log(dev,"Allocated %d frames for buffer reading\n",reqbuf.count); 
 	
   capture_create_frames_buffer(dev,reqbuf.count);
+  ring = dev->ring = ring_new(dev,memory);
+  dev->memory = memory;
 
   for (i=0; i < dev->frames ; i++){
-    struct v4l2_buffer buffer;
-    memset (&buffer, 0, sizeof (buffer));
-		
-    buffer.type = reqbuf.type;
-    buffer.memory = V4L2_MEMORY_MMAP;
-    buffer.index = i;
-    res = v4l_ioctl (dev, VIDIOC_QUERYBUF, &buffer);
-    if (!res){
-      dev->framesbuffer[i].buflen =buffer.length; /* remember for munmap() */
-      dev->framesbuffer[i].readonly = 1; /* Do not allow to be modified by client */
-#if 0			 
-      dev->framesbuffer[i].data = mmap (NULL, buffer.bufsize,
-                                        PROT_READ, /* required */
-                                        MAP_SHARED,             /* recommended */
-                                        dev->fd, buffer.m.offset);
-#else
-      dev->framesbuffer[i].data = mmap (NULL, buffer.length,
-                                        PROT_READ | PROT_WRITE, /* required */
-                                        MAP_SHARED,             /* recommended */
-                                        dev->fd, buffer.m.offset);
-#endif                                 
-                                 
-      if (dev->framesbuffer[i].data == MAP_FAILED){
-        capture_log(dev,"mmap: %s\n",strerror(errno));
-        res = -1;
-        break;
-      }                              
-    } else {
-      break;	
-    }
+    if (memory == V4L2_MEMORY_USERPTR)
+      res = ring_alloc_userptr(dev,ring,i);
+    else if (memory == V4L2_MEMORY_DMABUF)
+      res = ring_alloc_dmabuf(dev,ring,i);
+    else
+      res = ring_alloc_mmap(dev,ring,i);
+    if (res < 0)
+      break;
+
+    ring->framesbuffer[i].readonly = 1; /* Do not allow to be modified by client */
   }
-  return res;
+
+  if (res < 0){
+    for (i=0; i < dev->frames ; i++)
+      ring_free_buffer(ring,i);
+    dev->framesbuffer = 0;
+    dev->frames = 0;
+    dev->ring = 0;
+    ring_unref(ring);
+    return res;
+  }
+
+  ring->streaming = 1;
+  return 0;
 }
-/**
- *  @todo  implement vidFrameMunmap() to avoid to access VidFrame
- *  member attributes directly 
- */
 
-static int capture_munmap(V4L2Capture *dev){
-  int res=0;
+/// Hand out the frame of a buffer the driver filled, with a reference for the user
+static VidFrame* ring_hand_out(V4L2BufferRing *ring,int index){
+  VidFrame *frame = &ring->framesbuffer[index];
+
+  __atomic_add_fetch(&ring->refcount,1,__ATOMIC_RELAXED);
+
+  pthread_mutex_lock(&ring->lock);
+  frame->refcount = 1;
+  frame->recycle = ring_recycle;
+  frame->owner = ring;
+  pthread_mutex_unlock(&ring->lock);
+
+  return frame;
+}
+
+/// Called when the last reference to a frame handed out is dropped
+static void ring_recycle(VidFrame *frame){
+  V4L2BufferRing *ring = frame->owner;
+  int index = frame - ring->framesbuffer;
+  struct v4l2_buffer buffer;
+
+  pthread_mutex_lock(&ring->lock);
+  frame->recycle = 0;
+  if (ring->streaming){
+    ring_prepare_queue(ring,index,&buffer);
+    if (ioctl(ring->fd,VIDIOC_QBUF,&buffer) < 0)
+      DPRINTF("VIDIOC_QBUF: %s\n",strerror(errno));
+  } else {
+    ring_free_buffer(ring,index);
+  }
+  pthread_mutex_unlock(&ring->lock);
+
+  ring_unref(ring);
+}
+
+/// Stop the stream and free the buffers nobody holds
+static void ring_stop(V4L2Capture *dev){
+  V4L2BufferRing *ring = dev->ring;
+  int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
   int i;
-  for (i=0; i < dev->frames ; i++){
-    munmap(dev->framesbuffer[i].data,dev->framesbuffer[i].buflen);
-    dev->framesbuffer[i].data = 0;
-    dev->framesbuffer[i].buflen = 0;
+
+  pthread_mutex_lock(&ring->lock);
+  ring->streaming = 0;
+  v4l_ioctl(dev,VIDIOC_STREAMOFF,&type);
+  for (i=0;i<ring->frames;i++){
+    if (ring->framesbuffer[i].recycle != ring_recycle)
+      ring_free_buffer(ring,i);
   }
-  return res;
-	
+  pthread_mutex_unlock(&ring->lock);
+
+  /* the frames buffer is the ring's now */
+  dev->framesbuffer = 0;
+  dev->frames = 0;
+  dev->ring = 0;
+  ring_unref(ring);
+}
+
+/// Frames which are not handed out stay with the capture until the next query
+static void capture_frame_keep(VidFrame *frame){
+}
+
+/// Give a frame kept by the capture to the user, who releases it as any other frame
+static VidFrame* capture_lend(VidFrame *frame){
+  frame->refcount = 1;
+  frame->recycle = capture_frame_keep;
+  return frame;
 }
 
 static int capture_refresh_norm(V4L2Capture *dev){
@@ -520,23 +839,110 @@ static int capture_query_fps(V4L2Capture *capture,int *numerator,int *denominato
 /* Public Functions ***/
 ////////////////////////
 
-/**
- *  @param filename - The location of device.
- *  @Return Pointer to a initialized video capturing
- * structure, or NULL if failed to open the camera. 
- * 
- *  The function v4l2CaptureOpen opens and querys the properties
- * of a V4L2 video device. The result will be used to initialize
- * the newly allocated V4L2Capture. 
- * 
- *  Soon the video device is not used anymore , it should 
- *  be released by v4l2CaptureRelease
- * 
- * @see v4l2CaptureRelease. 
- * 
+/* Statistics
+ *
+ * Updated by the thread which dequeues the frames and by the converters,
+ * read by the UI. Everything is under stats_lock, taken a few times per
+ * frame at most.
  */
 
-V4L2Capture* v4l2CaptureOpen(const char *filename) {
+static long long stats_now(void){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/// Publish the sums of the current second once it is over. stats_lock must be held.
+static void stats_roll(V4L2Capture *capture,long long now){
+  V4L2CaptureStats *stats = &capture->stats;
+  long long elapsed = now - capture->stats_window_start;
+  unsigned int frames = capture->stats_window_frames;
+  unsigned int converted = capture->stats_window_converted;
+
+  if (elapsed < 1000000)
+    return;
+
+  stats->fps = frames * 1e6 / elapsed;
+  stats->wait_ms = frames ? capture->stats_wait_sum / 1e3 / frames : 0;
+  stats->wait_max_ms = capture->stats_wait_max / 1e3;
+  stats->convert_ms = converted ? capture->stats_convert_sum / 1e3 / converted : 0;
+  stats->convert_max_ms = capture->stats_convert_max / 1e3;
+
+  capture->stats_window_start = now;
+  capture->stats_window_frames = 0;
+  capture->stats_wait_sum = capture->stats_wait_max = 0;
+  capture->stats_window_converted = 0;
+  capture->stats_convert_sum = capture->stats_convert_max = 0;
+}
+
+static void stats_reset(V4L2Capture *capture){
+  pthread_mutex_lock(&capture->stats_lock);
+  memset(&capture->stats,0,sizeof(capture->stats));
+  capture->stats_ring_skipped = 0;
+  capture->stats_window_start = stats_now();
+  capture->stats_window_frames = 0;
+  capture->stats_wait_sum = capture->stats_wait_max = 0;
+  capture->stats_window_converted = 0;
+  capture->stats_convert_sum = capture->stats_convert_max = 0;
+  pthread_mutex_unlock(&capture->stats_lock);
+}
+
+/// Account a frame the backend delivered after a wait of usec
+static void stats_frame(V4L2Capture *capture,long long wait){
+  V4L2CaptureStats *stats = &capture->stats;
+  int gap;
+
+  pthread_mutex_lock(&capture->stats_lock);
+
+  /* The frames skipped in the ring left a gap too. Without sequence
+   * numbers (read() I/O) the gap is -1. */
+  if (stats->frames){
+    gap = (int)(capture->sequence - capture->stats_sequence) - 1;
+    if (gap > (int)capture->stats_ring_skipped)
+      stats->dropped += gap - capture->stats_ring_skipped;
+  }
+  stats->skipped += capture->stats_ring_skipped;
+  capture->stats_ring_skipped = 0;
+  capture->stats_sequence = capture->sequence;
+
+  stats->frames++;
+  capture->stats_window_frames++;
+  capture->stats_wait_sum += wait;
+  if (wait > capture->stats_wait_max)
+    capture->stats_wait_max = wait;
+
+  stats_roll(capture,stats_now());
+
+  pthread_mutex_unlock(&capture->stats_lock);
+}
+
+/// Account a delivered frame the caller never got
+static void stats_skip(V4L2Capture *capture){
+  pthread_mutex_lock(&capture->stats_lock);
+  capture->stats.skipped++;
+  pthread_mutex_unlock(&capture->stats_lock);
+}
+
+static VidFrame* capture_query_frame(V4L2Capture* capture);
+static int capture_start_streaming(V4L2Capture *capture,int burst_mode,
+                                   int nBuffer,int memory);
+static int capture_stop_streaming(V4L2Capture *capture);
+static int capture_set_image_format(V4L2Capture *capture,fourcc_t fourcc,VidSize *size);
+static int capture_set_fps(V4L2Capture *capture,int fps);
+
+/// The frames of a V4L2 device
+static const V4L2CaptureBackend v4l2_backend = {
+  "v4l2",
+  capture_start_streaming,
+  capture_stop_streaming,
+  capture_query_frame,
+  capture_set_image_format,
+  capture_set_fps,
+  0
+};
+
+static V4L2Capture* capture_open_device(const char *filename) {
   struct v4l2_capability argp;
   int fd;
   int res;
@@ -551,6 +957,7 @@ V4L2Capture* v4l2CaptureOpen(const char *filename) {
       capture = malloc(sizeof(V4L2Capture));
       memset(capture,0,sizeof(V4L2Capture));
       capture->fd = fd;
+      capture->backend = &v4l2_backend;
       capture->name = strdup((char *)argp.card);
       capture->driver = strdup((char *)argp.driver);
       capture->bus = strdup((char *)argp.bus_info);
@@ -588,39 +995,82 @@ V4L2Capture* v4l2CaptureOpen(const char *filename) {
 }
 
 /**
- *  @param capture - video capture structure
- *  @return A newly grabbed video frame. It should not be released or modified by user.
+ *  @param filename - The location of device.
+ *  @Return Pointer to a initialized video capturing
+ * structure, or NULL if failed to open the camera. 
  * 
- *  \todo time stamp
+ *  The function v4l2CaptureOpen opens and querys the properties
+ * of a V4L2 video device. The result will be used to initialize
+ * the newly allocated V4L2Capture. 
+ * 
+ *  Soon the video device is not used anymore , it should 
+ *  be released by v4l2CaptureRelease
+ * 
+ * @see v4l2CaptureRelease. 
+ * 
+ *  A location "replay:file" or "replay:file@fps" opens a recording
+ * instead, see fileCaptureOpen().
  */
-VidFrame* v4l2CaptureQueryFrame(V4L2Capture* capture){
+
+V4L2Capture* v4l2CaptureOpen(const char *filename) {
+  V4L2Capture *capture;
+
+  if (strncmp(filename,"replay:",7) == 0)
+    capture = fileCaptureOpen(filename + 7);
+  else
+    capture = capture_open_device(filename);
+
+  if (capture){
+    pthread_mutex_init(&capture->record_lock,0);
+    pthread_mutex_init(&capture->stats_lock,0);
+    stats_reset(capture);
+  }
+
+  return capture;
+}
+
+/// Read a frame from device (blocked I/O)
+
+static VidFrame* capture_query_frame(V4L2Capture* capture){
   VidFrame *frame=0;
-  int n;
+  int n,index;
 		
   if (capture->iomode == V4L2_CAP_STREAMING){
 		
-    capture->curr_frame_idx++;
-		
-    if (capture->curr_frame_idx >= capture->frames){
-      capture->curr_frame_idx = 0;	
-    }
-		
-    capture_dequeue(capture);
-		
-    frame= &capture->framesbuffer[capture->curr_frame_idx];
-    //#ifndef BURST_MODE
     if (!capture->burst_mode){
-      int next = capture->curr_frame_idx +1;
+      /* Only one buffer is queued at a time */
+      index = capture_dequeue(capture);
+      if (index < 0)
+        return 0;
+
+      capture->curr_frame_idx = index;
+      frame= capture_lend(&capture->framesbuffer[index]);
+
+      int next = index +1;
 		
       if (next >= capture->frames)
         next=0;
 		
       capture_enqueue(capture,next);
     } else {
-      //#else
-      capture_enqueue(capture,capture->curr_frame_idx);
+      /* The buffers handed out by the previous calls go back to the ring
+       * when they are released, all the others are already queued */
+      index = capture_dequeue(capture);
+
+      /* Drop frames which were waiting in the ring, so that the caller
+       * always gets the freshest one */
+      while (index >= 0 && capture_frame_pending(capture)){
+        capture_enqueue(capture,index);
+        index = capture_dequeue(capture);
+        capture->stats_ring_skipped++;
+      }
+
+      if (index < 0)
+        return 0;
+
+      /* The buffer stays out of the ring while the caller holds it */
+      frame= ring_hand_out(capture->ring,index);
     }
-    //#endif		
 		
   } else if (capture->iomode == V4L2_CAP_READWRITE) {
 		
@@ -633,7 +1083,7 @@ VidFrame* v4l2CaptureQueryFrame(V4L2Capture* capture){
       capture->curr_frame_idx = 0;	
     }
 		
-    frame= &capture->framesbuffer[capture->curr_frame_idx]; 
+    frame= capture_lend(&capture->framesbuffer[capture->curr_frame_idx]); 
 		
     if (vidFrameGetBufferLength(frame) < capture->bufsize){
       //frame->data = realloc(frame->data,capture->bufsize);
@@ -654,6 +1104,509 @@ VidFrame* v4l2CaptureQueryFrame(V4L2Capture* capture){
   return frame;
 }
 
+/// Query the backend for a frame, waited for since waitStart, and record it if asked to
+static VidFrame* capture_next_frame(V4L2Capture* capture,long long waitStart){
+  VidFrame *frame = capture->backend->query_frame(capture);
+
+  if (frame)
+    stats_frame(capture,stats_now() - waitStart);
+
+  if (frame && capture->record){
+    pthread_mutex_lock(&capture->record_lock);
+    if (capture->record && fileRecordingWrite(capture->record,frame)){
+      capture_log(capture,"Recording: %s\n",strerror(errno));
+      fclose(capture->record);
+      capture->record = 0;
+    }
+    pthread_mutex_unlock(&capture->record_lock);
+  }
+
+  return frame;
+}
+
+/* Capture thread
+ *
+ * The thread dequeues frames as fast as the device delivers them and
+ * posts each one into a triple buffer. In burst mode the slots hold the
+ * frames of the driver buffers themselves (see the zero-copy hand-off),
+ * otherwise a copy. The writer owns the "back" slot,
+ * the reader owns the "front" slot and the third slot is exchanged
+ * atomically between them, together with a flag telling whether it holds
+ * a frame the reader hasn't seen yet. The thread never waits for the
+ * reader, and the reader always gets the newest frame.
+ *
+ * The front slot belongs to the readers as a whole, so they take
+ * mailbox_lock to read, which lets v4l2CaptureLatestFrame() and
+ * v4l2CaptureQueryFrame() be called from different threads. The capture
+ * thread only takes the lock to wake up a reader sleeping in
+ * v4l2CaptureQueryFrame(), never when all readers poll.
+ *
+ * Every publication also signals an eventfd, so that a main loop can
+ * sleep in poll() until there is something to read.
+ *
+ * Optionally the thread also keeps a reference to the last few frames, so
+ * that a still can be picked by its timestamp after the fact (zero shutter
+ * lag). In burst mode those are driver buffers held out of the ring, so the
+ * ring needs V4L2_THREAD_BUFFERS buffers more than the history is deep.
+ * Only the frame picked is ever copied.
+ */
+
+#define MAILBOX_FRESH 4
+#define MAILBOX_INDEX 3
+
+/// Publish the back slot and take the shared slot as the new back slot
+static void mailbox_publish(V4L2Capture *capture){
+  int old = __atomic_exchange_n(&capture->mailbox_state,
+                                capture->mailbox_back | MAILBOX_FRESH,
+                                __ATOMIC_SEQ_CST);
+  uint64_t one = 1;
+  capture->mailbox_back = old & MAILBOX_INDEX;
+
+  if (write(capture->mailbox_fd,&one,sizeof(one)) < 0)
+    capture_log(capture,"eventfd write: %s\n",strerror(errno));
+
+  /* Ordered after the exchange: either a reader about to sleep is seen
+   * here, or it sees the fresh frame before it sleeps */
+  if (__atomic_load_n(&capture->mailbox_waiters,__ATOMIC_SEQ_CST)){
+    pthread_mutex_lock(&capture->mailbox_lock);
+    pthread_cond_broadcast(&capture->mailbox_cond);
+    pthread_mutex_unlock(&capture->mailbox_lock);
+  }
+}
+
+/// Take the frame of the shared slot if it is unread. Return NULL otherwise. Call with mailbox_lock held.
+static VidFrame* mailbox_take(V4L2Capture *capture){
+  VidFrame *frame;
+  uint64_t count;
+  int old;
+
+  /* Reset the eventfd first: a frame published after this point will
+   * signal it again, so no wake-up is lost */
+  if (read(capture->mailbox_fd,&count,sizeof(count)) < 0 && errno != EAGAIN)
+    capture_log(capture,"eventfd read: %s\n",strerror(errno));
+
+  if (!(__atomic_load_n(&capture->mailbox_state,__ATOMIC_SEQ_CST) & MAILBOX_FRESH))
+    return 0;
+
+  old = __atomic_exchange_n(&capture->mailbox_state,capture->mailbox_front,
+                            __ATOMIC_ACQ_REL);
+  capture->mailbox_front = old & MAILBOX_INDEX;
+
+  /* The reference of the slot goes to the caller */
+  frame = capture->mailbox[capture->mailbox_front];
+  capture->mailbox[capture->mailbox_front] = 0;
+
+  return frame;
+}
+
+/// Keep a reference to a frame in the history ring, dropping the oldest one
+static void history_push(V4L2Capture *capture,VidFrame *frame){
+  VidFrame *old;
+
+  vidFrameRef(frame);
+
+  pthread_mutex_lock(&capture->history_lock);
+
+  old = capture->history[capture->history_next];
+  capture->history[capture->history_next] = frame;
+
+  if (++capture->history_next >= capture->history_depth)
+    capture->history_next = 0;
+  if (capture->history_count < capture->history_depth)
+    capture->history_count++;
+
+  pthread_mutex_unlock(&capture->history_lock);
+
+  /* A driver buffer goes back to the ring, outside of the lock */
+  vidFrameUnref(&old);
+}
+
+static long long timeval_usec(const struct timeval *tv){
+  return (long long)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+/// Timestamp of the newest frame in the history, or -1 if it is empty. period receives the time since the frame before it, or 0.
+static long long history_newest(V4L2Capture *capture,long long *period){
+  long long res = -1;
+  int i;
+
+  *period = 0;
+  pthread_mutex_lock(&capture->history_lock);
+  if (capture->history_count){
+    i = capture->history_next - 1;
+    if (i < 0)
+      i = capture->history_depth - 1;
+    res = timeval_usec(&capture->history[i]->timestamp);
+    if (capture->history_count > 1){
+      if (--i < 0)
+        i = capture->history_depth - 1;
+      *period = res - timeval_usec(&capture->history[i]->timestamp);
+    }
+  }
+  pthread_mutex_unlock(&capture->history_lock);
+
+  return res;
+}
+
+static void* capture_thread(void *data){
+  V4L2Capture *capture = data;
+  struct pollfd pfd;
+  VidFrame *frame;
+  long long waitStart = stats_now();
+
+  pfd.fd = capture->fd;
+  pfd.events = POLLIN;
+
+  while (!capture->thread_stop){
+    /* Wake up regularly to check whether we are asked to stop */
+    if (poll(&pfd,1,100) <= 0)
+      continue;
+
+    frame = capture_next_frame(capture,waitStart);
+    if (!frame)
+      continue;
+
+    /* Copy the frames which don't outlive the next query */
+    frame = v4l2CaptureKeepFrame(capture,frame);
+
+    if (capture->history_depth)
+      history_push(capture,frame);
+
+    /* Drop the frame the reader skipped, if any */
+    if (capture->mailbox[capture->mailbox_back]){
+      vidFrameUnref(&capture->mailbox[capture->mailbox_back]);
+      stats_skip(capture);
+    }
+    capture->mailbox[capture->mailbox_back] = frame;
+
+    mailbox_publish(capture);
+
+    /* The time spent on the frame is not waiting for the next one */
+    waitStart = stats_now();
+  }
+
+  return 0;
+}
+
+/**
+ *  @param capture - video capture structure
+ *  @return A newly grabbed video frame, which should not be modified.
+ *  Release it with vidFrameUnref().
+ * 
+ *  When the capture thread is running, this waits for the next frame
+ *  published by the thread. In burst mode the frame is the driver buffer
+ *  itself, which goes back to the driver when the frame is released, so
+ *  it should not be held longer than needed. Otherwise the frame stays
+ *  valid until the next call of v4l2CaptureQueryFrame() or
+ *  v4l2CaptureLatestFrame(), even if it is held.
+ *
+ *  \todo time stamp
+ */
+VidFrame* v4l2CaptureQueryFrame(V4L2Capture* capture){
+  VidFrame *frame=0;
+
+  if (!capture->threaded)
+    return capture_next_frame(capture,stats_now());
+
+  pthread_mutex_lock(&capture->mailbox_lock);
+  __atomic_add_fetch(&capture->mailbox_waiters,1,__ATOMIC_SEQ_CST);
+  while ( !(frame = mailbox_take(capture)) && !capture->thread_stop)
+    pthread_cond_wait(&capture->mailbox_cond,&capture->mailbox_lock);
+  __atomic_sub_fetch(&capture->mailbox_waiters,1,__ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&capture->mailbox_lock);
+
+  return frame;
+}
+
+/**
+ *  @param capture - video capture structure
+ *  @param frame - a frame returned by v4l2CaptureQueryFrame() or
+ *  v4l2CaptureLatestFrame(). Its reference is taken over.
+ *  @return A frame which stays valid until it is released: the frame
+ *  itself if it was handed out by the buffer ring or by a recording, a
+ *  copy if the capture reuses it on the next query.
+ */
+VidFrame* v4l2CaptureKeepFrame(V4L2Capture* capture,VidFrame *frame){
+  VidFrame *copy;
+
+  if (!frame || frame->recycle != capture_frame_keep)
+    return frame;
+
+  copy = vidFrameClone(frame);
+  copy->format = frame->format;
+  copy->timestamp = frame->timestamp;
+  vidFrameUnref(&frame);
+
+  return copy;
+}
+
+/**
+ *  @param frame - a frame returned by v4l2CaptureQueryFrame() or
+ *  v4l2CaptureLatestFrame()
+ *  @return A DMABUF file descriptor of the buffer behind the frame, or -1
+ *  if there is none (the frame is a copy, or the driver can't export).
+ *
+ *  The descriptor belongs to the capture and stays open until streaming
+ *  stops, dup() it to keep it longer. Buffers of the MMAP mode are
+ *  exported by the driver the first time they are asked for.
+ */
+int v4l2CaptureGetFrameDmabuf(VidFrame *frame){
+  V4L2BufferRing *ring;
+  struct v4l2_exportbuffer exp;
+  int index,fd;
+
+  if (!frame || frame->recycle != ring_recycle)
+    return -1;
+
+  ring = frame->owner;
+  index = frame - ring->framesbuffer;
+
+  pthread_mutex_lock(&ring->lock);
+  if (ring->dmabuf[index] < 0 && ring->memory == V4L2_MEMORY_MMAP &&
+      ring->streaming){
+    memset(&exp,0,sizeof(exp));
+    exp.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    exp.index = index;
+    exp.flags = O_RDONLY | O_CLOEXEC;
+    if (ioctl(ring->fd,VIDIOC_EXPBUF,&exp) == 0)
+      ring->dmabuf[index] = exp.fd;
+  }
+  fd = ring->dmabuf[index];
+  pthread_mutex_unlock(&ring->lock);
+
+  return fd;
+}
+
+/**
+ *  @param capture - video capture structure
+ *  @return The newest frame if one arrived since the last call, or NULL.
+ *  It should not be modified. Release it with vidFrameUnref().
+ *
+ *  Unlike v4l2CaptureQueryFrame() this never blocks, so it can be called
+ *  from the UI thread. Without a capture thread the device is polled
+ *  and a frame is only read if the driver has one ready.
+ */
+VidFrame* v4l2CaptureLatestFrame(V4L2Capture* capture){
+  VidFrame *frame;
+
+  if (capture->threaded){
+    pthread_mutex_lock(&capture->mailbox_lock);
+    frame = mailbox_take(capture);
+    pthread_mutex_unlock(&capture->mailbox_lock);
+    return frame;
+  }
+
+  if (!capture_frame_pending(capture))
+    return 0;
+
+  return capture_next_frame(capture,stats_now());
+}
+
+/**
+ *  @param capture - video capture structure
+ *  @Return Non-zero value to indicate error
+ *
+ *  Start a thread which dequeues frames continuously, so that slow
+ *  devices never block the caller. Streaming should be started first.
+ *  The thread is stopped by v4l2CaptureStopThread() or
+ *  v4l2CaptureStopStreaming().
+ */
+int v4l2CaptureStartThread(V4L2Capture *capture){
+  int i;
+
+  if (capture->threaded)
+    return 0;
+
+  for (i=0;i<3;i++)
+    capture->mailbox[i] = 0;
+  capture->mailbox_state = 0;
+  capture->mailbox_front = 1;
+  capture->mailbox_back = 2;
+  capture->mailbox_waiters = 0;
+  capture->thread_stop = 0;
+
+  /* The history must leave the driver enough buffers to fill */
+  if (capture->history_depth && capture->burst_mode && capture->ring &&
+      capture->history_depth > capture->frames - V4L2_THREAD_BUFFERS){
+    capture_log(capture,"%d buffers can't keep a history of %d frames, "
+                "stream with %d\n",capture->frames,capture->history_depth,
+                capture->history_depth + V4L2_THREAD_BUFFERS);
+    capture->history_depth = capture->frames - V4L2_THREAD_BUFFERS;
+    if (capture->history_depth < 0)
+      capture->history_depth = 0;
+  }
+
+  if (capture->history_depth)
+    capture->history = calloc(capture->history_depth,sizeof(VidFrame*));
+  capture->history_count = 0;
+  capture->history_next = 0;
+
+  capture->mailbox_fd = eventfd(0,EFD_NONBLOCK);
+  if (capture->mailbox_fd < 0){
+    capture_log(capture,"eventfd: %s\n",strerror(errno));
+    return -1;
+  }
+
+  pthread_mutex_init(&capture->mailbox_lock,0);
+  pthread_cond_init(&capture->mailbox_cond,0);
+  pthread_mutex_init(&capture->history_lock,0);
+
+  if (pthread_create(&capture->thread,0,capture_thread,capture)){
+    capture_log(capture,"Could not create the capture thread\n");
+    pthread_cond_destroy(&capture->mailbox_cond);
+    pthread_mutex_destroy(&capture->mailbox_lock);
+    pthread_mutex_destroy(&capture->history_lock);
+    close(capture->mailbox_fd);
+    return -1;
+  }
+
+  capture->threaded = 1;
+  return 0;
+}
+
+/**
+ *  @param capture - video capture structure
+ *  @return A file descriptor which polls readable (POLLIN) when
+ *  v4l2CaptureLatestFrame() would return a frame.
+ *
+ *  With the capture thread running this is an eventfd signalled by the
+ *  thread, otherwise the device itself. Query it again after starting or
+ *  stopping the thread.
+ */
+int v4l2CaptureGetPollFd(V4L2Capture *capture){
+  if (capture->threaded)
+    return capture->mailbox_fd;
+
+  return capture->fd;
+}
+
+int v4l2CaptureStopThread(V4L2Capture *capture){
+  int i;
+
+  if (!capture->threaded)
+    return 0;
+
+  capture->thread_stop = 1;
+  pthread_join(capture->thread,0);
+
+  /* Wake up readers still waiting for a frame */
+  pthread_mutex_lock(&capture->mailbox_lock);
+  pthread_cond_broadcast(&capture->mailbox_cond);
+  pthread_mutex_unlock(&capture->mailbox_lock);
+
+  capture->threaded = 0;
+  pthread_cond_destroy(&capture->mailbox_cond);
+  pthread_mutex_destroy(&capture->mailbox_lock);
+  close(capture->mailbox_fd);
+
+  for (i=0;i<3;i++)
+    vidFrameUnref(&capture->mailbox[i]);
+
+  pthread_mutex_destroy(&capture->history_lock);
+  if (capture->history){
+    for (i=0;i<capture->history_depth;i++)
+      vidFrameUnref(&capture->history[i]);
+    free(capture->history);
+    capture->history = 0;
+  }
+  capture->history_count = 0;
+
+  return 0;
+}
+
+/**
+ *  @param capture - video capture structure
+ *  @param depth - no. of frames to keep, 0 to disable the history
+ *  @Return Non-zero value to indicate error
+ *
+ *  Ask the capture thread to keep a reference to the last depth frames,
+ *  to be retrieved by v4l2CaptureFrameAt(). In burst mode they hold
+ *  driver buffers: stream with at least depth + V4L2_THREAD_BUFFERS
+ *  buffers, or the history is cut down when the thread starts.
+ */
+int v4l2CaptureSetHistory(V4L2Capture *capture,int depth){
+  if (capture->threaded){
+    capture_log(capture,"The history can't be changed while the capture thread runs\n");
+    return -1;
+  }
+
+  capture->history_depth = depth > 0 ? depth : 0;
+  return 0;
+}
+
+/**
+ *  @param capture - video capture structure
+ *  @param when - the moment to capture, on the clock of v4l2CaptureGetTime()
+ *  @return A new frame, to be released by user, or NULL if no frame is kept
+ *  or the next frame will be closer to when.
+ *
+ *  Copy the kept frame whose timestamp is closest to when. This never
+ *  waits: if every kept frame is more than half a frame period before
+ *  when, the moment is still being exposed, NULL is returned and the
+ *  caller should take the next frame of the stream instead.
+ */
+VidFrame* v4l2CaptureFrameAt(V4L2Capture *capture,const struct timeval *when){
+  long long target = timeval_usec(when);
+  long long diff,best_diff = 0,newest,period;
+  VidFrame *best = 0,*res;
+  int i;
+
+  if (!capture->threaded || !capture->history_depth)
+    return 0;
+
+  /* The period the frames actually arrive at, else the one asked for */
+  newest = history_newest(capture,&period);
+  if (period <= 0 && capture->fps > 0)
+    period = 1000000 / capture->fps;
+  if (newest < 0 || (newest < target && target - newest > period / 2))
+    return 0;
+
+  pthread_mutex_lock(&capture->history_lock);
+  for (i=0;i<capture->history_count;i++){
+    diff = timeval_usec(&capture->history[i]->timestamp) - target;
+    if (diff < 0)
+      diff = -diff;
+    if (!best || diff < best_diff){
+      best = capture->history[i];
+      best_diff = diff;
+    }
+  }
+  if (best)
+    vidFrameRef(best);
+  pthread_mutex_unlock(&capture->history_lock);
+
+  if (!best)
+    return 0;
+
+  /* Copy outside of the lock, the capture thread goes on meanwhile */
+  res = vidFrameClone(best);
+  res->format = best->format;
+  res->timestamp = best->timestamp;
+  vidFrameUnref(&best);
+
+  return res;
+}
+
+/**
+ *  @param capture - video capture structure
+ *  @param tv - returns the current time
+ *
+ *  Drivers stamp frames either with the monotonic clock or with the wall
+ *  clock. This reads whichever the device uses, so the result can be
+ *  compared with frame timestamps and passed to v4l2CaptureFrameAt().
+ */
+void v4l2CaptureGetTime(V4L2Capture *capture,struct timeval *tv){
+  struct timespec ts;
+
+  if (capture->timestamp_monotonic){
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    tv->tv_sec = ts.tv_sec;
+    tv->tv_usec = ts.tv_nsec / 1000;
+  } else {
+    gettimeofday(tv,0);
+  }
+}
+
 void v4l2CaptureRelease(V4L2Capture** capture){
 	
   if (capture == 0 || *capture == 0)
@@ -663,10 +1616,16 @@ void v4l2CaptureRelease(V4L2Capture** capture){
 	
 	
   v4l2CaptureStopStreaming(_cap);
+  v4l2CaptureStopRecording(_cap);
 	
   if (_cap->fd){
     close(_cap->fd);
   }
+
+  if (_cap->backend->release)
+    _cap->backend->release(_cap);
+  pthread_mutex_destroy(&_cap->record_lock);
+  pthread_mutex_destroy(&_cap->stats_lock);
 	
   free(_cap->location);
   free(_cap->name);
@@ -696,6 +1655,22 @@ void v4l2CaptureSetLog(V4L2Capture *capture,int state){
  * @param burst_mode - Turn on burst mode.
  * @param nBuffer - no. of buffer should be allocated. (The min value is 2.) 
  * @Return Non-zero value to indicate error
+ *
+ * Same as v4l2CaptureStartStreamingMemory() with V4L2_MEMORY_MMAP.
+ */
+
+int v4l2CaptureStartStreaming(V4L2Capture *capture,int burst_mode,int nBuffer){
+  return v4l2CaptureStartStreamingMemory(capture,burst_mode,nBuffer,
+                                         V4L2_MEMORY_MMAP);
+}
+
+/// Start streaming I/O
+/** 
+ * @param capture - video capturing structure
+ * @param burst_mode - Turn on burst mode.
+ * @param nBuffer - no. of buffer should be allocated. (The min value is 2.) 
+ * @param memory - V4L2_MEMORY_MMAP, V4L2_MEMORY_USERPTR or V4L2_MEMORY_DMABUF
+ * @Return Non-zero value to indicate error
  * 
  * Streaming is an I/O method where only pointers to buffers
  * are exchanged between application and driver. Depend on 
@@ -710,11 +1685,34 @@ void v4l2CaptureSetLog(V4L2Capture *capture,int state){
  * burst mode, all buffers are enqueued in order to get 
  * the highest throughput. Otherwise, only a single buffer
  * is enqueued for each iteration of v4l2CaputreQueryFrame() .
- *  
+ *
+ * In burst mode the buffers form a ring: the driver keeps filling
+ * every buffer but the ones the user still holds, and a query
+ * drains the frames which are already waiting and returns the newest
+ * one. A frame is then never older than one frame period, whereas
+ * without burst mode every query waits for a whole new exposure.
+ *
+ * With V4L2_MEMORY_MMAP the driver allocates the buffers and they are
+ * mapped. With V4L2_MEMORY_USERPTR the driver writes into page aligned
+ * buffers of the frame pool, and with V4L2_MEMORY_DMABUF into memory of
+ * ours shared as DMABUF (this needs /dev/udmabuf). Either way the
+ * frames handed out point into the buffers, and the converters and the
+ * encoder read the memory the driver wrote. A driver which doesn't
+ * support the memory makes this fail, the caller may then fall back to
+ * V4L2_MEMORY_MMAP.
  *  
  */
 
-int v4l2CaptureStartStreaming(V4L2Capture *capture,int burst_mode,int nBuffer){
+int v4l2CaptureStartStreamingMemory(V4L2Capture *capture,int burst_mode,
+                                    int nBuffer,int memory){
+  /* The device numbers the frames from 0 again */
+  stats_reset(capture);
+
+  return capture->backend->start_streaming(capture,burst_mode,nBuffer,memory);
+}
+
+static int capture_start_streaming(V4L2Capture *capture,int burst_mode,
+                                   int nBuffer,int memory){
   int res = -1;
   if ( capture->iomode != V4L2_CAP_STREAMING &&
        capture->capabilities & V4L2_CAP_STREAMING ){
@@ -722,17 +1720,13 @@ int v4l2CaptureStartStreaming(V4L2Capture *capture,int burst_mode,int nBuffer){
     if (nBuffer<2)
       nBuffer = 2;	
 			
-    res = capture_mmap(capture,nBuffer);
+    res = capture_request_buffers(capture,nBuffer,memory);
     if (!res) {
       capture->iomode = V4L2_CAP_STREAMING;
       capture->burst_mode = burst_mode;
       //#ifndef BURST_MODE
       if (!capture->burst_mode) {			
-        int next = capture->curr_frame_idx +1;
-        if (next >= capture->frames)
-          next=0;
-		
-        capture_enqueue(capture,next);
+        capture_enqueue(capture,0);
       } else {
         //#else
         int i;
@@ -752,20 +1746,103 @@ int v4l2CaptureStartStreaming(V4L2Capture *capture,int burst_mode,int nBuffer){
 
 /// Stop streaming mode
 int v4l2CaptureStopStreaming(V4L2Capture *capture){
+  v4l2CaptureStopThread(capture);
+
+  return capture->backend->stop_streaming(capture);
+}
+
+static int capture_stop_streaming(V4L2Capture *capture){
   int res = 0;
   int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 			
-  v4l_ioctl(capture,VIDIOC_STREAMOFF,&type);
+  /* The buffers still held by the user are unmapped when released */
+  if (capture->ring)
+    ring_stop(capture);
+  else
+    v4l_ioctl(capture,VIDIOC_STREAMOFF,&type);
 		
-  if (capture->iomode == V4L2_CAP_STREAMING){
-    res = capture_munmap(capture);
-    if (!res) {
-      capture->iomode = V4L2_CAP_READWRITE;
-    }	
-  }
+  if (capture->iomode == V4L2_CAP_STREAMING)
+    capture->iomode = V4L2_CAP_READWRITE;
+
   return res;	
 }
 
+/**
+ *  @param capture - video capture structure
+ *  @param filename - the file to write
+ *  @Return Non-zero value to indicate error
+ *
+ *  Every frame the capture delivers from now on is appended to the file
+ *  as it came from the device, until v4l2CaptureStopRecording(). Opening
+ *  "replay:filename" plays it back. The frames are written by whichever
+ *  thread dequeues them, the capture thread if it runs.
+ */
+int v4l2CaptureStartRecording(V4L2Capture *capture,const char *filename){
+  FILE *file = fileRecordingCreate(filename,capture);
+
+  if (!file)
+    return -1;
+
+  /* a recording of raw frames grows fast, write it in large chunks */
+  setvbuf(file,0,_IOFBF,1 << 20);
+
+  v4l2CaptureStopRecording(capture);
+  pthread_mutex_lock(&capture->record_lock);
+  capture->record = file;
+  pthread_mutex_unlock(&capture->record_lock);
+
+  return 0;
+}
+
+int v4l2CaptureStopRecording(V4L2Capture *capture){
+  FILE *file;
+  int res = 0;
+
+  pthread_mutex_lock(&capture->record_lock);
+  file = capture->record;
+  capture->record = 0;
+  pthread_mutex_unlock(&capture->record_lock);
+
+  if (file)
+    res = fclose(file);
+
+  return res;
+}
+
+/**
+ *  @param capture - video capture structure
+ *  @param stats - receives the statistics
+ *  @Return Non-zero value to indicate error
+ *
+ *  The rates and times are averages over the last second, or over the
+ *  time since the previous one ended when no frame came to close it: a
+ *  device which stalls shows a falling rate, then 0. The counts are
+ *  those since streaming started.
+ */
+int v4l2CaptureGetStats(V4L2Capture *capture,V4L2CaptureStats *stats){
+  pthread_mutex_lock(&capture->stats_lock);
+  stats_roll(capture,stats_now());
+  *stats = capture->stats;
+  pthread_mutex_unlock(&capture->stats_lock);
+
+  return 0;
+}
+
+/**
+ *  The capture doesn't convert its frames, the caller which does tells
+ *  how long a conversion took, see getFrame().
+ */
+void v4l2CaptureAddConvertTime(V4L2Capture *capture,long long usec){
+  pthread_mutex_lock(&capture->stats_lock);
+  capture->stats.converted++;
+  capture->stats_window_converted++;
+  capture->stats_convert_sum += usec;
+  if (usec > capture->stats_convert_max)
+    capture->stats_convert_max = usec;
+  stats_roll(capture,stats_now());
+  pthread_mutex_unlock(&capture->stats_lock);
+}
+
 //////////////////////////////////////////////
 /* Query and set properties functions */
 //////////////////////////////////////////////
@@ -866,6 +1943,10 @@ int v4l2CaptureGetImageFormat(V4L2Capture *capture){
  */
 
 int v4l2CaptureSetImageFormat(V4L2Capture *capture,fourcc_t fourcc,VidSize *size){
+  return capture->backend->set_image_format(capture,fourcc,size);
+}
+
+static int capture_set_image_format(V4L2Capture *capture,fourcc_t fourcc,VidSize *size){
   struct v4l2_format argp;
   int res;
 	
@@ -958,6 +2039,10 @@ double v4l2CaptureGetFPS(V4L2Capture *capture){
 }
 
 int v4l2CaptureSetFPS(V4L2Capture *capture,int fps){
+  return capture->backend->set_fps(capture,fps);
+}
+
+static int capture_set_fps(V4L2Capture *capture,int fps){
   struct v4l2_streamparm argp;
   int res;
   argp.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
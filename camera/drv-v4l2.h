@@ -1,7 +1,9 @@
 #ifndef V4L_H_
 #define V4L_H_
 
+#include <stdio.h>
 #include <sys/time.h>
+#include <pthread.h>
 #include <linux/videodev.h>
 //#include <linux/videodev2.h>
 #include <linux/types.h>
@@ -14,10 +16,76 @@
 extern "C" {
 #endif /* defined(__cplusplus) */
 
-  /// Video capturing structure
+  /// Driver buffers of the streaming mode, shared with the frames handed out
+  typedef struct V4L2BufferRing V4L2BufferRing;
+
+  typedef struct V4L2Capture V4L2Capture;
 
+  /// The source of the frames of a capture. A V4L2 device is one, a recording replayed from a file another.
   typedef struct {
+    const char *name;
+
+    /// Start delivering frames. fd becomes readable when one is ready.
+    int (*start_streaming)(V4L2Capture *capture,int burst,int nBuffer,int memory);
+
+    /// Stop delivering frames. The frames still held stay valid.
+    int (*stop_streaming)(V4L2Capture *capture);
+
+    /// Return the next frame with a reference for the caller, waiting for it if needed
+    VidFrame* (*query_frame)(V4L2Capture *capture);
+
+    int (*set_image_format)(V4L2Capture *capture,fourcc_t fourcc,VidSize *size);
+
+    int (*set_fps)(V4L2Capture *capture,int fps);
+
+    /// Free the data of the backend
+    void (*release)(V4L2Capture *capture);
+  } V4L2CaptureBackend;
+
+  /// Statistics of the frames delivered since streaming started, see v4l2CaptureGetStats()
+  /**
+   * The rates and times are averages over the last second. A frame
+   * lost by the camera, the bus or the driver (no buffer was queued)
+   * leaves a gap in the sequence numbers and is counted as dropped. A
+   * frame which arrived but was replaced by a newer one before the caller
+   * took it is counted as skipped: the consumer is the slow one.
+   */
+  typedef struct {
+    /// Frames delivered by the device
+    unsigned long frames;
+
+    /// Frames lost before they were delivered
+    unsigned long dropped;
+
+    /// Frames delivered but never handed to the caller
+    unsigned long skipped;
+
+    /// Frames converted, see v4l2CaptureAddConvertTime()
+    unsigned long converted;
+
+    /// Rate of the delivered frames
+    double fps;
+
+    /// Time spent waiting for the device per frame, mean and max, in msec
+    double wait_ms;
+    double wait_max_ms;
+
+    /// Time spent converting a frame, mean and max, in msec
+    double convert_ms;
+    double convert_max_ms;
+  } V4L2CaptureStats;
+
+  /// Video capturing structure
+
+  struct V4L2Capture {
+    /// The device, or a descriptor which becomes readable when the backend has a frame
     int fd;
+
+    /// The source of the frames
+    const V4L2CaptureBackend *backend;
+
+    /// Private data of the backend
+    void *backend_data;
 	
     /* General Information */
 	
@@ -64,8 +132,11 @@ extern "C" {
     /// The current I/O moade = {V4L2_CAP_READWRITE(default) | V4L2_CAP_STREAMING}
     int iomode; 
 
-    /// Burst mode 
+    /// Burst mode. All streaming buffers are kept queued as a ring.
     int burst_mode;
+
+    /// Memory of the streaming buffers (V4L2_MEMORY_MMAP, V4L2_MEMORY_USERPTR or V4L2_MEMORY_DMABUF)
+    int memory;
 	
     /// The current input frame's pixel format in fourcc code (little endian) 
     int format;
@@ -97,28 +168,155 @@ extern "C" {
     /// no. of frames for buffer
     int frames;	
 		
-    /// Index to current frames buffer
+    /// Index to current frames buffer. In streaming mode, the buffer the
+    /// driver filled last, which is held by the user until the next query.
     int curr_frame_idx;
+
+    /// Sequence number the driver gave to the current frame
+    unsigned int sequence;
+
+    /// The mapped buffers while streaming. The frames buffer is owned by it.
+    V4L2BufferRing *ring;
+
+    /* Capture thread */
+
+    /// Non-zero while the capture thread is running
+    int threaded;
+
+    /// The capture thread
+    pthread_t thread;
+
+    /// Set to ask the capture thread to exit
+    volatile int thread_stop;
+
+    /// Triple buffer holding the frames published by the capture thread
+    VidFrame *mailbox[3];
+
+    /// Index of the shared slot, plus a flag telling whether it holds an unread frame. Exchanged atomically.
+    int mailbox_state;
+
+    /// Index of the slot being filled by the capture thread
+    int mailbox_back;
+
+    /// Index of the slot owned by the reader
+    int mailbox_front;
+
+    /// Serializes the readers, which share the front slot, and lets them sleep until a frame is published
+    pthread_mutex_t mailbox_lock;
+    pthread_cond_t mailbox_cond;
+
+    /// No. of readers sleeping on mailbox_cond. The capture thread only takes mailbox_lock when it is not 0.
+    int mailbox_waiters;
+
+    /// eventfd which becomes readable when the capture thread publishes a frame
+    int mailbox_fd;
+
+    /// No. of recent frames kept by the capture thread for v4l2CaptureFrameAt()
+    int history_depth;
+
+    /// Ring of references to the recent frames. The oldest one is dropped first.
+    VidFrame **history;
+
+    /// No. of valid frames in the ring
+    int history_count;
+
+    /// Index of the slot the next frame is written to
+    int history_next;
+
+    pthread_mutex_t history_lock;
+
+    /// Non-zero if the driver stamps buffers with CLOCK_MONOTONIC instead of the wall clock
+    int timestamp_monotonic;
+
+    /// The recording every delivered frame is written to, or NULL
+    FILE *record;
+
+    pthread_mutex_t record_lock;
+
+    /* Statistics */
+
+    /// The published statistics, the rates and times are averages over the last second
+    V4L2CaptureStats stats;
+
+    /// Sequence number of the last frame delivered, once stats.frames is not 0
+    unsigned int stats_sequence;
+
+    /// Frames skipped in the ring since the last delivery, which are not dropped
+    unsigned int stats_ring_skipped;
+
+    /// Start of the current second in usec, and the sums over it
+    long long stats_window_start;
+    unsigned int stats_window_frames;
+    long long stats_wait_sum,stats_wait_max;
+    unsigned int stats_window_converted;
+    long long stats_convert_sum,stats_convert_max;
+
+    pthread_mutex_t stats_lock;
 	
-  } V4L2Capture;
+  };
 
 
   /////////////////////////
   /* Basic Operations ****/
   /////////////////////////
 
-  /// Initializes capturing video from V4L2 device 
+  /// Initializes capturing video from V4L2 device, or from a recording if location is "replay:file[@fps]"
   V4L2Capture* v4l2CaptureOpen(const char *location);
 
-  /// Read a frame from device
+  /// Read a frame from device. Release it with vidFrameUnref().
   VidFrame* v4l2CaptureQueryFrame(V4L2Capture*);
 
+  /// Return the newest frame if a new one is available, NULL otherwise. Never blocks. Release it with vidFrameUnref().
+  VidFrame* v4l2CaptureLatestFrame(V4L2Capture*);
+
+  /// Turn a queried frame into one which stays valid until it is released, without copying the driver buffers of burst mode
+  VidFrame* v4l2CaptureKeepFrame(V4L2Capture*,VidFrame *frame);
+
+  /// DMABUF file descriptor of the buffer behind a queried frame, or -1
+  int v4l2CaptureGetFrameDmabuf(VidFrame *frame);
+
+  /// Dequeue frames continuously from a capture thread
+  int v4l2CaptureStartThread(V4L2Capture *capture);
+
+  /// Stop the capture thread
+  int v4l2CaptureStopThread(V4L2Capture *capture);
+
+  /// File descriptor which becomes readable when v4l2CaptureLatestFrame() has a new frame
+  int v4l2CaptureGetPollFd(V4L2Capture *capture);
+
+  /// Buffers a burst mode stream needs besides the history: the mailbox slots and two queued to the driver
+#define V4L2_THREAD_BUFFERS 5
+
+  /// Set the no. of recent frames the capture thread keeps. Call before v4l2CaptureStartThread().
+  int v4l2CaptureSetHistory(V4L2Capture *capture,int depth);
+
+  /// Return a copy of the kept frame whose timestamp is closest to the given time, NULL if the next frame will be closer
+  VidFrame* v4l2CaptureFrameAt(V4L2Capture *capture,const struct timeval *when);
+
+  /// Current time on the clock used for frame timestamps
+  void v4l2CaptureGetTime(V4L2Capture *capture,struct timeval *tv);
+
   /// Start streaming mode
   int v4l2CaptureStartStreaming(V4L2Capture *capture,int burst,int nBuffer);
 
+  /// Start streaming mode with buffers of the given memory (V4L2_MEMORY_MMAP, V4L2_MEMORY_USERPTR or V4L2_MEMORY_DMABUF)
+  int v4l2CaptureStartStreamingMemory(V4L2Capture *capture,int burst,int nBuffer,int memory);
+
   /// Stop streaming mode
   int v4l2CaptureStopStreaming(V4L2Capture *capture);
 
+  /// Write every frame delivered from now on to a recording, which "replay:" opens
+  int v4l2CaptureStartRecording(V4L2Capture *capture,const char *filename);
+
+  /// Close the recording
+  int v4l2CaptureStopRecording(V4L2Capture *capture);
+
+  /// Copy the frame rate, dropped frames, dequeue wait and conversion time statistics
+  int v4l2CaptureGetStats(V4L2Capture *capture,V4L2CaptureStats *stats);
+
+  /// Account the conversion of a frame of the capture, which took usec
+  void v4l2CaptureAddConvertTime(V4L2Capture *capture,long long usec);
+
   /// Close and release the data allocated
   void v4l2CaptureRelease(V4L2Capture**);
 
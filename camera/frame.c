@@ -1,6 +1,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include <linux/ioctl.h>
 #include <linux/videodev.h>
@@ -10,7 +13,9 @@
 #include "frame.h"
 #include "fourcc.h"
 #include "yuv2rgb.h"
+#include "mjpeg.h"
 #include "utils.h"
+#include "trace.h"
 
 /* Image Format Converter */
 VidConv converters[] = {
@@ -40,6 +45,37 @@ VidConv converters[] = {
   output: V4L2_PIX_FMT_BGR24,
   convert: yuyv_to_bgr24
   },
+
+  {
+  name: "YUYV to RGB24 Scaling Converter",
+  input: V4L2_PIX_FMT_YUYV,
+  output: V4L2_PIX_FMT_RGB24,
+  convert: yuyv_to_rgb24_scaled,
+  scaling: 1
+  },
+
+  {
+  name: "YUYV to BGR24 Scaling Converter",
+  input: V4L2_PIX_FMT_YUYV,
+  output: V4L2_PIX_FMT_BGR24,
+  convert: yuyv_to_bgr24_scaled,
+  scaling: 1
+  },
+
+  {
+  name: "MJPEG to RGB24 Converter",
+  input: V4L2_PIX_FMT_MJPEG,
+  output: V4L2_PIX_FMT_RGB24,
+  convert: mjpeg_to_rgb24
+  },
+
+  {
+  name: "MJPEG to RGB24 Scaling Converter",
+  input: V4L2_PIX_FMT_MJPEG,
+  output: V4L2_PIX_FMT_RGB24,
+  convert: mjpeg_to_rgb24_scaled,
+  scaling: 1
+  },
   {0,0,0,0}	
 };
 
@@ -52,10 +88,23 @@ VidFrame *vidFrameCreate(){
   return frame;
 }
 
+static int frame_pool_put(VidFrame *frame);
+
 void vidFrameRelease(VidFrame **frame){
   if ((*frame)->refcount>1){
     rvtk_log(RVTK_ERROR,"Release a frame with refcount > 1 \n");	
   }
+
+  if ((*frame)->recycle){
+    (*frame)->recycle(*frame);
+    *frame = 0;
+    return;
+  }
+
+  if ((*frame)->pool && frame_pool_put(*frame)){
+    *frame = 0;
+    return;
+  }
 	
   if  ( (*frame)->data !=0 ){
     free((*frame)->data);		
@@ -70,14 +119,14 @@ void vidFrameRelease(VidFrame **frame){
 }
 
 void vidFrameRef(VidFrame *frame){
-  frame->refcount++;	
+  __atomic_add_fetch(&frame->refcount,1,__ATOMIC_RELAXED);
 }
 
 void vidFrameUnref(VidFrame **frameptr){
   if (frameptr==0 || *frameptr ==0 )
     return;
 		
-  if ( --(*frameptr)->refcount == 0) {
+  if (__atomic_sub_fetch(&(*frameptr)->refcount,1,__ATOMIC_ACQ_REL) == 0) {
     rvtk_log(RVTK_DEBUG,"A frame's refcount dropped to zero\n");
     vidFrameRelease(frameptr);	
   } 
@@ -175,12 +224,193 @@ VidFrame* vidFrameClone(VidFrame *frame){
   return new_frame;	
 }
 
-VidConv* vidConvFind(fourcc_t input,fourcc_t output){
+/* Frame Pool
+ *
+ * Frames of the same format and size are recycled instead of freed, so the
+ * preview and the encoder don't allocate, and fault in, a new image buffer
+ * for every frame. A pooled frame goes back to its pool when it is
+ * released, by vidFrameRelease or by the last vidFrameUnref, and each pool
+ * keeps a few of them. Buffers of a huge page or more are aligned on huge
+ * pages, so that the kernel can back the huge pages they span. A buffer
+ * just short of a whole number of huge pages, like a RGB frame of 960x720,
+ * is rounded up to it, as long as it wastes less than an eighth of it.
+ */
+
+#define FRAME_POOL_DEPTH 4
+#define FRAME_POOL_HUGE_PAGE (2*1024*1024)
+#define FRAME_POOL_CACHE_LINE 64
+
+struct VidFramePool {
+  fourcc_t format;
+  int width;
+  int height;
+  int bufsize;
+  VidFrame *free[FRAME_POOL_DEPTH];
+  int nFree;
+  /// Frames pointing to the pool, free or in use
+  int nFrames;
+  struct VidFramePool *next;
+};
+
+static VidFramePool *frame_pools = 0;
+static pthread_mutex_t frame_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Buffers of a page or more are page aligned, so that a driver can also
+ * write into them (V4L2_MEMORY_USERPTR) */
+static unsigned char* frame_pool_alloc(int size,int *buflen){
+  size_t align = FRAME_POOL_CACHE_LINE;
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t len = size;
+  size_t rounded = (len + FRAME_POOL_HUGE_PAGE - 1) & ~(size_t)(FRAME_POOL_HUGE_PAGE - 1);
+  void *data;
+
+  if (len >= FRAME_POOL_HUGE_PAGE / 2 && rounded - len <= len / 8){
+    align = FRAME_POOL_HUGE_PAGE;
+    len = rounded;
+  } else if (len >= FRAME_POOL_HUGE_PAGE){
+    align = FRAME_POOL_HUGE_PAGE;
+  } else if (len >= page){
+    align = page;
+  }
+
+  if (posix_memalign(&data,align,len))
+    return 0;
+#ifdef MADV_HUGEPAGE
+  if (align == FRAME_POOL_HUGE_PAGE)
+    madvise(data,len,MADV_HUGEPAGE);
+#endif
+
+  *buflen = len;
+  return data;
+}
+
+/// Put a released frame back in its pool. Returns 0 if the pool is full, the frame then leaves the pool.
+static int frame_pool_put(VidFrame *frame){
+  VidFramePool *pool = frame->pool;
+  int res = 0;
+
+  pthread_mutex_lock(&frame_pool_lock);
+  if (pool->nFree < FRAME_POOL_DEPTH && frame->data &&
+      frame->buflen >= pool->bufsize){
+    pool->free[pool->nFree++] = frame;
+    res = 1;
+  } else {
+    pool->nFrames--;
+    frame->pool = 0;
+  }
+  pthread_mutex_unlock(&frame_pool_lock);
+
+  if (res && frame->name){
+    free(frame->name);
+    frame->name = 0;
+  }
+  return res;
+}
+
+/**
+ *  @return A frame with refcount equal to 1 and a buffer of the image size.
+ *  Formats without a fixed image size are not pooled, the frame then has no buffer.
+ */
+
+VidFrame* vidFramePoolGet(fourcc_t format,int width,int height){
+  return vidFramePoolGetSized(format,width,height,
+                              vidFourccCalcFrameSize(format,width,height));
+}
+
+/**
+ *  @return A frame with refcount equal to 1 and a buffer of bufsize bytes,
+ *  e.g. the image size a driver asks for. Without a size the frame has no buffer.
+ */
+
+VidFrame* vidFramePoolGetSized(fourcc_t format,int width,int height,int bufsize){
+  VidFramePool *pool;
+  VidFrame *frame = 0;
+
+  if (bufsize <= 0){
+    frame = vidFrameCreate();
+    frame->format = format;
+    frame->size.width = width;
+    frame->size.height = height;
+    return frame;
+  }
+
+  pthread_mutex_lock(&frame_pool_lock);
+  for (pool = frame_pools; pool; pool = pool->next){
+    if (pool->format == format && pool->width == width &&
+        pool->height == height && pool->bufsize == bufsize)
+      break;
+  }
+  if (!pool){
+    pool = malloc(sizeof(VidFramePool));
+    memset(pool,0,sizeof(VidFramePool));
+    pool->format = format;
+    pool->width = width;
+    pool->height = height;
+    pool->bufsize = bufsize;
+    pool->next = frame_pools;
+    frame_pools = pool;
+  }
+  if (pool->nFree)
+    frame = pool->free[--pool->nFree];
+  else
+    pool->nFrames++;
+  pthread_mutex_unlock(&frame_pool_lock);
+
+  if (!frame){
+    frame = vidFrameCreate();
+    frame->data = frame_pool_alloc(bufsize,&frame->buflen);
+    if (!frame->data)
+      vidFrameResizeBuffer(frame,bufsize);
+    frame->pool = pool;
+  }
+
+  frame->refcount = 1;
+  frame->readonly = 0;
+  frame->format = format;
+  frame->size.width = width;
+  frame->size.height = height;
+  frame->bytesperline = vidFourccCalcFrameSize(format,width,1);
+  frame->imagesize = bufsize;
+  memset(&frame->timestamp,0,sizeof(frame->timestamp));
+
+  return frame;
+}
+
+/**
+ *  Free the frames kept for reuse, and the pools which no frame in use
+ *  points to anymore.
+ */
+
+void vidFramePoolTrim(){
+  VidFramePool **link,*pool;
+  VidFrame *frame;
+
+  pthread_mutex_lock(&frame_pool_lock);
+  link = &frame_pools;
+  while ((pool = *link)){
+    while (pool->nFree){
+      frame = pool->free[--pool->nFree];
+      pool->nFrames--;
+      free(frame->data);
+      free(frame);
+    }
+    if (!pool->nFrames){
+      *link = pool->next;
+      free(pool);
+    } else {
+      link = &pool->next;
+    }
+  }
+  pthread_mutex_unlock(&frame_pool_lock);
+}
+
+static VidConv* conv_find(fourcc_t input,fourcc_t output,int scaling){
   VidConv * res=0;
   int i=0;
   while (converters[i].input!=0){
     if (converters[i].input == input &&
-        converters[i].output == output ){
+        converters[i].output == output &&
+        converters[i].scaling == scaling ){
       res = &converters[i];
       break;
     }
@@ -189,10 +419,35 @@ VidConv* vidConvFind(fourcc_t input,fourcc_t output){
   return res;
 }
 
+VidConv* vidConvFind(fourcc_t input,fourcc_t output){
+  return conv_find(input,output,0);
+}
+
+VidConv* vidConvFindScaler(fourcc_t input,fourcc_t output){
+  return conv_find(input,output,1);
+}
+
 int vidConvProcess(VidConv *conv,VidFrame *src,VidFrame *dest){
+  return vidConvProcessScaled(conv,src,dest,&src->size);
+}
+
+/**
+ *  @param size The size of the converted image. Converters without
+ *  the scaling flag only accept the size of src.
+ */
+
+int vidConvProcessScaled(VidConv *conv,VidFrame *src,VidFrame *dest,VidSize *size){
+  int64_t traceStart;
   int res = -1;
+
+  if (!conv->scaling &&
+      (size->width != src->size.width || size->height != src->size.height)){
+    rvtk_log(RVTK_ERROR,"Converter [%s] can't resample the image\n",conv->name);
+    return res;
+  }
+
   dest->format = conv->output;
-  dest->size = src->size;
+  dest->size = *size;
   dest->imagesize = vidFourccCalcFrameSize(conv->output,dest->size.width,dest->size.height);
   if (dest->imagesize < 0){
     const char *name = vidFourccToString(conv->output);
@@ -203,6 +458,8 @@ int vidConvProcess(VidConv *conv,VidFrame *src,VidFrame *dest){
     return res; 	
   }
 
+  traceStart = traceBegin();
   res = conv->convert(src,dest);		
+  traceEnd("vidConvProcess",traceStart);
   return res;			
 }
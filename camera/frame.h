@@ -17,8 +17,11 @@ typedef struct {
   int height;
 } VidSize;
 
+/// Frame Pool, recycles the image buffers of frames of one format and size
+typedef struct VidFramePool VidFramePool;
+
 /// Video Frame
-typedef struct {
+typedef struct VidFrame {
   /// A frame may be named.
   char *name;
 	
@@ -48,12 +51,21 @@ typedef struct {
 	
   /// refcount
   int refcount;
+
+  /// The pool the frame goes back to when it is released, or NULL
+  VidFramePool *pool;
+
+  /// If set, called instead of freeing the frame when it is released, e.g. to give a driver buffer back
+  void (*recycle)(struct VidFrame *frame);
+
+  /// The object which recycles the frame
+  void *owner;
 } VidFrame;
 
 /// Allocate and initialize a V4L2Frame structure
 VidFrame *vidFrameCreate();
 
-/// Increases the reference count of frame
+/// Increases the reference count of frame. The reference count is atomic, so a frame may be shared between threads.
 void vidFrameRef(VidFrame *frame);
 
 /// Decreases the reference count of frame. When its reference count drops to 0, the frame is finalized
@@ -100,6 +112,17 @@ void vidFrameCopy(VidFrame *src,VidFrame *dest,int deep);
 /// Clone a frame by create a deep copy of the object.  
 VidFrame* vidFrameClone(VidFrame *frame);
 
+/* Frame Pool */
+
+/// Get a frame of format and size, with its image buffer, from the pool of that format and size. Releasing it returns it to the pool.
+VidFrame* vidFramePoolGet(fourcc_t format,int width,int height);
+
+/// Same as vidFramePoolGet(), with a buffer of the given size instead of the image size
+VidFrame* vidFramePoolGetSized(fourcc_t format,int width,int height,int bufsize);
+
+/// Free the frames kept by the pools for reuse, and the pools no frame in use belongs to
+void vidFramePoolTrim();
+
 /* Image Format Convertor */
 
 typedef int (*v4l2ConvFunc) (VidFrame *src,VidFrame *dest);
@@ -116,16 +139,27 @@ typedef struct {
 	
   /// The callback function to handle the convertion
   v4l2ConvFunc convert;	
+
+  /// Non-zero if the converter resamples the image to the size of dest
+  int scaling;
 } VidConv;
 
 /// Find a converter to convert image format from input to output
 
 VidConv* vidConvFind(fourcc_t input,fourcc_t output);
 
+/// Find a converter which converts from input to output and resamples the image in the same pass
+
+VidConv* vidConvFindScaler(fourcc_t input,fourcc_t output);
+
 /// Execute the image converter.
 
 int vidConvProcess(VidConv *conv,VidFrame *src,VidFrame *dest);
 
+/// Execute a scaling image converter. The result is resampled to size.
+
+int vidConvProcessScaled(VidConv *conv,VidFrame *src,VidFrame *dest,VidSize *size);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif /* defined(__cplusplus) */
@@ -0,0 +1,62 @@
+/*
+ * glib-source.c
+ *
+ * Delivers camera frames through the GLib main loop
+ *
+ */
+
+#include <glib.h>
+#include "drv-v4l2.h"
+#include "glib-source.h"
+
+typedef struct {
+  GSource source;
+  GPollFD pollfd;
+} V4L2Source;
+
+/* Nothing to do before polling, wait for the descriptor without timeout
+ */
+static gboolean v4l2_source_prepare(GSource *source, gint *timeout){
+  *timeout = -1;
+  return FALSE;
+}
+
+/* Ready once the descriptor polled readable
+ */
+static gboolean v4l2_source_check(GSource *source){
+  V4L2Source *v4l2_source = (V4L2Source *)source;
+
+  return (v4l2_source->pollfd.revents & G_IO_IN) != 0;
+}
+
+static gboolean v4l2_source_dispatch(GSource *source, GSourceFunc callback,
+                                     gpointer user_data){
+  if (!callback)
+    return FALSE;
+
+  return callback(user_data);
+}
+
+static GSourceFuncs v4l2_source_funcs = {
+  v4l2_source_prepare,
+  v4l2_source_check,
+  v4l2_source_dispatch,
+  NULL
+};
+
+/* Create a GSource which dispatches when a new frame can be read from the
+ * capture without blocking.
+ *  capture - A pointer to the Video4Linux capture object
+ *  @return a new GSource
+ */
+GSource *v4l2CaptureCreateSource(V4L2Capture *capture){
+  GSource *source = g_source_new(&v4l2_source_funcs, sizeof(V4L2Source));
+  V4L2Source *v4l2_source = (V4L2Source *)source;
+
+  v4l2_source->pollfd.fd = v4l2CaptureGetPollFd(capture);
+  v4l2_source->pollfd.events = G_IO_IN;
+  v4l2_source->pollfd.revents = 0;
+  g_source_add_poll(source, &v4l2_source->pollfd);
+
+  return source;
+}
@@ -0,0 +1,26 @@
+/*
+ * glib-source.h
+ *
+ * Delivers camera frames through the GLib main loop
+ *
+ */
+
+#include <glib.h>
+#include "drv-v4l2.h"
+
+#ifndef V4L2_GLIB_SOURCE_H
+#define V4L2_GLIB_SOURCE_H
+
+/* Create a GSource which dispatches when a new frame can be read from the
+ * capture without blocking, i.e. when v4l2CaptureLatestFrame() would return
+ * a frame. The main loop sleeps in poll() on the capture's file descriptor
+ * in between, so no CPU time is spent waiting for the camera.
+ * Create the source after v4l2CaptureStartThread() if the capture thread
+ * is used, since that changes the descriptor to watch.
+ *  capture - A pointer to the Video4Linux capture object
+ *  @return a new GSource; set its callback with g_source_set_callback()
+ *          (a GSourceFunc) and attach it with g_source_attach()
+ */
+GSource *v4l2CaptureCreateSource(V4L2Capture *capture);
+
+#endif
@@ -0,0 +1,322 @@
+/*
+ * mjpeg.c
+ *
+ * Motion JPEG frames, as the camera compresses them: decoding them to RGB24
+ * and writing them to JPEG files without decoding them.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <setjmp.h>
+#include <linux/videodev2.h>
+#include "frame.h"
+#include "resize.h"
+#include "mjpeg.h"
+#include "jpeglib.h"
+
+/* The Huffman tables of section K.3 of the JPEG standard, as one DHT
+ * segment. UVC cameras leave them out of their frames and assume these, so
+ * they are put back before a frame is decoded or saved. */
+static const JOCTET mjpeg_dht[] = {
+  0xff, 0xc4, 0x01, 0xa2,
+  /* brightness DC */
+  0x00, 0x00, 0x01, 0x05, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06,
+  0x07, 0x08, 0x09, 0x0a, 0x0b,
+  /* color DC */
+  0x01, 0x00, 0x03, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06,
+  0x07, 0x08, 0x09, 0x0a, 0x0b,
+  /* brightness AC */
+  0x10, 0x00, 0x02, 0x01, 0x03, 0x03, 0x02, 0x04, 0x03, 0x05, 0x05, 0x04,
+  0x04, 0x00, 0x00, 0x01, 0x7d, 0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05,
+  0x12, 0x21, 0x31, 0x41, 0x06, 0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14,
+  0x32, 0x81, 0x91, 0xa1, 0x08, 0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1,
+  0xf0, 0x24, 0x33, 0x62, 0x72, 0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19,
+  0x1a, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38,
+  0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54,
+  0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+  0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84,
+  0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97,
+  0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa,
+  0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4,
+  0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7,
+  0xd8, 0xd9, 0xda, 0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9,
+  0xea, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa,
+  /* color AC */
+  0x11, 0x00, 0x02, 0x01, 0x02, 0x04, 0x04, 0x03, 0x04, 0x07, 0x05, 0x04,
+  0x04, 0x00, 0x01, 0x02, 0x77, 0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05,
+  0x21, 0x31, 0x06, 0x12, 0x41, 0x51, 0x07, 0x61, 0x71, 0x13, 0x22, 0x32,
+  0x81, 0x08, 0x14, 0x42, 0x91, 0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52,
+  0xf0, 0x15, 0x62, 0x72, 0xd1, 0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1,
+  0x17, 0x18, 0x19, 0x1a, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37,
+  0x38, 0x39, 0x3a, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53,
+  0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67,
+  0x68, 0x69, 0x6a, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82,
+  0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95,
+  0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8,
+  0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2,
+  0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5,
+  0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8,
+  0xe9, 0xea, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa
+};
+
+static const JOCTET mjpeg_eoi[] = { 0xff, 0xd9 };
+
+/* Check that a frame is a JPEG stream and look for its Huffman tables
+ *  @return 1 if the frame has its own tables, 0 if it relies on the
+ *          standard ones, -1 if it isn't a JPEG stream
+ */
+static int mjpeg_has_dht(const unsigned char *data, int length){
+  int i = 2;
+
+  if( length < 4 || data[0] != 0xff || data[1] != 0xd8 ){
+    return -1;
+  }
+
+  /* the tables come before the scan */
+  while( i + 4 <= length && data[i] == 0xff ){
+    if( data[i + 1] == 0xc4 ){
+      return 1;
+    }
+    if( data[i + 1] == 0xda ){
+      break;
+    }
+    if( data[i + 1] == 0xff ){
+      /* fill byte */
+      i++;
+      continue;
+    }
+    i += 2 + ((data[i + 2] << 8) | data[i + 3]);
+  }
+
+  return 0;
+}
+
+/* Source manager reading a frame from memory, in up to three pieces so
+ * that the tables can be inserted after the SOI marker without a copy */
+typedef struct {
+  struct jpeg_source_mgr pub;
+  const JOCTET *chunk[3];
+  size_t chunkLength[3];
+  int nChunks;
+  int next;
+} MjpegSource;
+
+static void mjpeg_init_source(j_decompress_ptr cinfo){
+}
+
+static boolean mjpeg_fill_input_buffer(j_decompress_ptr cinfo){
+  MjpegSource *src = (MjpegSource *)cinfo->src;
+
+  if( src->next < src->nChunks ){
+    src->pub.next_input_byte = src->chunk[src->next];
+    src->pub.bytes_in_buffer = src->chunkLength[src->next];
+    src->next++;
+  } else {
+    /* a truncated frame, end it so the rest of the image is left gray */
+    src->pub.next_input_byte = mjpeg_eoi;
+    src->pub.bytes_in_buffer = sizeof(mjpeg_eoi);
+  }
+
+  return TRUE;
+}
+
+static void mjpeg_skip_input_data(j_decompress_ptr cinfo, long numBytes){
+  struct jpeg_source_mgr *src = cinfo->src;
+
+  if( numBytes <= 0 ){
+    return;
+  }
+  while( numBytes > (long)src->bytes_in_buffer ){
+    numBytes -= src->bytes_in_buffer;
+    mjpeg_fill_input_buffer(cinfo);
+  }
+  src->next_input_byte += numBytes;
+  src->bytes_in_buffer -= numBytes;
+}
+
+static void mjpeg_term_source(j_decompress_ptr cinfo){
+}
+
+static void mjpeg_src(j_decompress_ptr cinfo, MjpegSource *src,
+                      const unsigned char *data, int length, int hasDht){
+  memset(src, 0, sizeof(MjpegSource));
+  src->pub.init_source = mjpeg_init_source;
+  src->pub.fill_input_buffer = mjpeg_fill_input_buffer;
+  src->pub.skip_input_data = mjpeg_skip_input_data;
+  src->pub.resync_to_restart = jpeg_resync_to_restart;
+  src->pub.term_source = mjpeg_term_source;
+
+  if( hasDht ){
+    src->chunk[0] = data;
+    src->chunkLength[0] = length;
+    src->nChunks = 1;
+  } else {
+    src->chunk[0] = data;
+    src->chunkLength[0] = 2;
+    src->chunk[1] = mjpeg_dht;
+    src->chunkLength[1] = sizeof(mjpeg_dht);
+    src->chunk[2] = data + 2;
+    src->chunkLength[2] = length - 2;
+    src->nChunks = 3;
+  }
+
+  cinfo->src = &src->pub;
+}
+
+/* Errors of a frame give up on that frame instead of exiting */
+struct mjpeg_error_mgr {
+  struct jpeg_error_mgr pub;
+  jmp_buf setjmp_buffer;
+};
+
+static void mjpeg_error_exit(j_common_ptr cinfo){
+  struct mjpeg_error_mgr *err = (struct mjpeg_error_mgr *)cinfo->err;
+
+  (*cinfo->err->output_message)(cinfo);
+  longjmp(err->setjmp_buffer, 1);
+}
+
+/* Corrupt data warnings are common on a busy USB bus, at every frame, and
+ * a damaged frame is still shown */
+static void mjpeg_emit_message(j_common_ptr cinfo, int msgLevel){
+}
+
+/* Decode a frame to RGB24, shrunk by the decoder as much as possible while
+ * still covering box. The image goes to dest if box is NULL or it has the
+ * size of box, otherwise to a frame of the pool returned in decoded.
+ */
+static int mjpeg_decode(VidFrame *src, VidFrame *dest, const VidSize *box,
+                        VidFrame **decoded){
+  struct jpeg_decompress_struct cinfo;
+  struct mjpeg_error_mgr jerr;
+  MjpegSource source;
+  JSAMPROW row_pointer[1];
+  VidFrame *volatile out = NULL;
+  const unsigned char *data = vidFrameGetImageData(src);
+  int length = vidFrameGetImageLength(src);
+  int hasDht, rowStride;
+
+  if( (hasDht = mjpeg_has_dht(data, length)) < 0 ){
+    fprintf(stderr, "The frame is not a JPEG image.\n");
+    return -1;
+  }
+
+  cinfo.err = jpeg_std_error(&jerr.pub);
+  jerr.pub.error_exit = mjpeg_error_exit;
+  jerr.pub.emit_message = mjpeg_emit_message;
+  if( setjmp(jerr.setjmp_buffer) ){
+    jpeg_destroy_decompress(&cinfo);
+    if( out && out != dest ){
+      VidFrame *frame = out;
+      vidFrameRelease(&frame);
+    }
+    return -1;
+  }
+
+  jpeg_create_decompress(&cinfo);
+  mjpeg_src(&cinfo, &source, data, length, hasDht);
+  jpeg_read_header(&cinfo, TRUE);
+
+  cinfo.out_color_space = JCS_RGB;
+
+  if( box ){
+    cinfo.scale_num = 1;
+    for( cinfo.scale_denom = 8; cinfo.scale_denom > 1;
+         cinfo.scale_denom /= 2 ){
+      jpeg_calc_output_dimensions(&cinfo);
+      if( (int)cinfo.output_width >= box->width &&
+          (int)cinfo.output_height >= box->height ){
+        break;
+      }
+    }
+  }
+
+  jpeg_start_decompress(&cinfo);
+
+  rowStride = cinfo.output_width * 3;
+  if( !box || ((int)cinfo.output_width == box->width &&
+               (int)cinfo.output_height == box->height) ){
+    out = dest;
+    if( rowStride * (int)cinfo.output_height > vidFrameGetBufferLength(out) ){
+      vidFrameResizeBuffer(out, rowStride * cinfo.output_height);
+    }
+    out->format = V4L2_PIX_FMT_RGB24;
+    out->size.width = cinfo.output_width;
+    out->size.height = cinfo.output_height;
+    out->bytesperline = rowStride;
+    out->imagesize = rowStride * cinfo.output_height;
+  } else {
+    out = vidFramePoolGet(V4L2_PIX_FMT_RGB24, cinfo.output_width,
+                          cinfo.output_height);
+  }
+
+  while( cinfo.output_scanline < cinfo.output_height ){
+    row_pointer[0] = vidFrameGetImageData(out) +
+      cinfo.output_scanline * rowStride;
+    (void) jpeg_read_scanlines(&cinfo, row_pointer, 1);
+  }
+
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+
+  if( out != dest ){
+    *decoded = out;
+  }
+  return 0;
+}
+
+int mjpeg_to_rgb24(VidFrame *src,VidFrame *dest){
+  return mjpeg_decode(src, dest, NULL, NULL);
+}
+
+int mjpeg_to_rgb24_scaled(VidFrame *src,VidFrame *dest){
+  VidSize size = dest->size;
+  VidFrame *decoded = NULL;
+  int res;
+
+  if( mjpeg_decode(src, dest, &size, &decoded) ){
+    return -1;
+  }
+  if( !decoded ){
+    return 0;
+  }
+
+  /* the decoder only scales by powers of two, the rest is area averaged */
+  res = vidFrameResize(decoded, dest, &size, VID_RESIZE_BOX);
+
+  vidFrameRelease(&decoded);
+  return res;
+}
+
+int mjpeg_write_file(VidFrame *frame,const char *fileName){
+  const unsigned char *data = vidFrameGetImageData(frame);
+  int length = vidFrameGetImageLength(frame);
+  FILE *outFile;
+  int hasDht, ok;
+
+  if( (hasDht = mjpeg_has_dht(data, length)) < 0 ){
+    fprintf(stderr, "The frame is not a JPEG image.\n");
+    return 1;
+  }
+
+  if( (outFile = fopen(fileName, "wb")) == NULL ){
+    fprintf(stderr, "Can't create file %s. \n", fileName);
+    return 1;
+  }
+
+  if( hasDht ){
+    ok = fwrite(data, length, 1, outFile) == 1;
+  } else {
+    ok = fwrite(data, 2, 1, outFile) == 1 &&
+      fwrite(mjpeg_dht, sizeof(mjpeg_dht), 1, outFile) == 1 &&
+      fwrite(data + 2, length - 2, 1, outFile) == 1;
+  }
+  if( fclose(outFile) ){
+    ok = 0;
+  }
+
+  return !ok;
+}
@@ -0,0 +1,23 @@
+#ifndef __MJPEG_H_
+#define __MJPEG_H_
+
+#include "frame.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/// Decode a MJPEG frame to RGB24
+int mjpeg_to_rgb24(VidFrame *src,VidFrame *dest);
+
+/// Decode a MJPEG frame to RGB24 at the size of dest. The decoder shrinks it by 1/2, 1/4 or 1/8 and the rest is area averaged.
+int mjpeg_to_rgb24_scaled(VidFrame *src,VidFrame *dest);
+
+/// Write a MJPEG frame to a JPEG file as it is, without decoding it. Returns non-zero on error.
+int mjpeg_write_file(VidFrame *frame,const char *fileName);
+
+#ifdef __cplusplus
+}
+#endif /* defined(__cplusplus) */
+
+#endif
@@ -0,0 +1,312 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/videodev2.h>
+
+#include "frame.h"
+#include "resize.h"
+#include "utils.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RESIZE_X86
+#include <emmintrin.h>
+#endif
+
+/*
+ * Separable resampling
+ *
+ * Each output pixel is a weighted sum of source pixels, with weights which
+ * only depend on its column (horizontal taps) and on its row (vertical
+ * taps). An output row is computed in two passes: the source rows under
+ * it are first combined into one row of 16 bit intermediate values, which
+ * is then reduced horizontally. Shrinking rows first keeps the wide pass,
+ * which touches every source pixel, on contiguous memory where it is
+ * vectorized, and leaves only the narrow rows to the horizontal pass.
+ *
+ * Weights are fixed point with WEIGHT_BITS fractional bits, and sum up to
+ * exactly WEIGHT_ONE for every output pixel. The intermediate row keeps
+ * PASS_BITS fractional bits, so that 255 << PASS_BITS still fits in a
+ * signed 16 bit value.
+ */
+
+#define WEIGHT_BITS 14
+#define WEIGHT_ONE (1 << WEIGHT_BITS)
+#define PASS_BITS 7
+
+/// Taps of one axis
+typedef struct {
+  /// First source index for each output index
+  int *start;
+  /// No. of taps for each output index
+  int *count;
+  /// Weights, taps entries for each output index
+  short *weights;
+  /// Maximum no. of taps
+  int taps;
+} ResizeTable;
+
+typedef void (*vertical_row_func)(const unsigned char **rows,const short *w,
+                                  int taps,short *out,int n);
+
+static void vertical_row_c(const unsigned char **rows,const short *w,
+                           int taps,short *out,int n);
+
+static vertical_row_func vertical_row = 0;
+
+static void resize_table_init(ResizeTable *table,int slen,int dlen,
+                              VidResizeFilter filter){
+  double scale = (double)slen / dlen;
+  double *w;
+  double a,b,c,f,overlap;
+  int i,j,k,n,first,sum,largest;
+  short *iw;
+
+  /* An area average of less than one pixel is an interpolation */
+  if (filter == VID_RESIZE_BOX && scale > 1.0)
+    table->taps = (int)scale + 2;
+  else {
+    filter = VID_RESIZE_BILINEAR;
+    table->taps = 2;
+  }
+
+  w = malloc(sizeof(double) * table->taps);
+
+  table->start = malloc(sizeof(int) * dlen);
+  table->count = malloc(sizeof(int) * dlen);
+  table->weights = malloc(sizeof(short) * dlen * table->taps);
+  memset(table->weights,0,sizeof(short) * dlen * table->taps);
+
+  for (j=0;j<dlen;j++){
+    n = 0;
+    if (filter == VID_RESIZE_BOX){
+      /* The output pixel covers [a,b) in the source */
+      a = j * scale;
+      b = a + scale;
+      first = (int)a;
+      for (i=first;i<b && i<slen && n<table->taps;i++){
+        overlap = (b < i + 1 ? b : i + 1) - (a > i ? a : i);
+        w[n++] = overlap / scale;
+      }
+    } else {
+      /* Sample at the pixel centres */
+      c = (j + 0.5) * scale - 0.5;
+      if (c < 0)
+        c = 0;
+      first = (int)c;
+      f = c - first;
+      if (first >= slen - 1){
+        first = slen - 1;
+        f = 0;
+      }
+      w[n++] = 1.0 - f;
+      if (first + 1 < slen)
+        w[n++] = f;
+    }
+
+    /* Round to fixed point, the rounding error goes to the largest tap */
+    iw = table->weights + j * table->taps;
+    sum = 0;
+    largest = 0;
+    for (k=0;k<n;k++){
+      iw[k] = (short)(w[k] * WEIGHT_ONE + 0.5);
+      sum += iw[k];
+      if (iw[k] > iw[largest])
+        largest = k;
+    }
+    iw[largest] += WEIGHT_ONE - sum;
+
+    table->start[j] = first;
+    table->count[j] = n;
+  }
+
+  free(w);
+}
+
+static void resize_table_clear(ResizeTable *table){
+  free(table->start);
+  free(table->count);
+  free(table->weights);
+}
+
+/// Combine the columns [x,n) of source rows into an intermediate row
+static void vertical_span_c(const unsigned char **rows,const short *w,
+                            int taps,short *out,int x,int n){
+  int k,acc;
+
+  for (;x<n;x++){
+    acc = 0;
+    for (k=0;k<taps;k++)
+      acc += w[k] * rows[k][x];
+    out[x] = (acc + (1 << (WEIGHT_BITS - PASS_BITS - 1))) >> (WEIGHT_BITS - PASS_BITS);
+  }
+}
+
+/// Combine source rows into one intermediate row
+static void vertical_row_c(const unsigned char **rows,const short *w,
+                           int taps,short *out,int n){
+  vertical_span_c(rows,w,taps,out,0,n);
+}
+
+#ifdef RESIZE_X86
+
+/// Combine source rows into one intermediate row, 8 values at a time.
+/// Rows are taken by pairs and multiplied with their weights by pmaddwd.
+__attribute__((target("sse2")))
+static void vertical_row_sse2(const unsigned char **rows,const short *w,
+                              int taps,short *out,int n){
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i round = _mm_set1_epi32(1 << (WEIGHT_BITS - PASS_BITS - 1));
+  __m128i a,b,wp,lo,hi;
+  int x,k;
+
+  for (x=0;x+8<=n;x+=8){
+    lo = zero;
+    hi = zero;
+    for (k=0;k+1<taps;k+=2){
+      a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(rows[k] + x)),zero);
+      b = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(rows[k + 1] + x)),zero);
+      wp = _mm_set1_epi32((unsigned short)w[k] | ((unsigned int)w[k + 1] << 16));
+      lo = _mm_add_epi32(lo,_mm_madd_epi16(_mm_unpacklo_epi16(a,b),wp));
+      hi = _mm_add_epi32(hi,_mm_madd_epi16(_mm_unpackhi_epi16(a,b),wp));
+    }
+    if (k < taps){
+      a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(rows[k] + x)),zero);
+      wp = _mm_set1_epi32((unsigned short)w[k]);
+      lo = _mm_add_epi32(lo,_mm_madd_epi16(_mm_unpacklo_epi16(a,zero),wp));
+      hi = _mm_add_epi32(hi,_mm_madd_epi16(_mm_unpackhi_epi16(a,zero),wp));
+    }
+    lo = _mm_srai_epi32(_mm_add_epi32(lo,round),WEIGHT_BITS - PASS_BITS);
+    hi = _mm_srai_epi32(_mm_add_epi32(hi,round),WEIGHT_BITS - PASS_BITS);
+    _mm_storeu_si128((__m128i*)(out + x),_mm_packs_epi32(lo,hi));
+  }
+
+  vertical_span_c(rows,w,taps,out,x,n);
+}
+
+#endif /* RESIZE_X86 */
+
+static void resize_init(){
+  vertical_row = vertical_row_c;
+#ifdef RESIZE_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2"))
+    vertical_row = vertical_row_sse2;
+#endif
+}
+
+/// Reduce an intermediate row to the output width
+static void horizontal_row(const short *tmp,const ResizeTable *table,
+                           unsigned char *d,int dw){
+  const short *w;
+  const short *s;
+  int j,k,n,r,g,b;
+
+  for (j=0;j<dw;j++){
+    w = table->weights + j * table->taps;
+    s = tmp + table->start[j] * 3;
+    n = table->count[j];
+    r = g = b = 0;
+    for (k=0;k<n;k++){
+      r += w[k] * s[0];
+      g += w[k] * s[1];
+      b += w[k] * s[2];
+      s += 3;
+    }
+    r = (r + (1 << (WEIGHT_BITS + PASS_BITS - 1))) >> (WEIGHT_BITS + PASS_BITS);
+    g = (g + (1 << (WEIGHT_BITS + PASS_BITS - 1))) >> (WEIGHT_BITS + PASS_BITS);
+    b = (b + (1 << (WEIGHT_BITS + PASS_BITS - 1))) >> (WEIGHT_BITS + PASS_BITS);
+    *(d++) = r > 255 ? 255 : r;
+    *(d++) = g > 255 ? 255 : g;
+    *(d++) = b > 255 ? 255 : b;
+  }
+}
+
+/**
+ *  @param src - the source image, 3 bytes per pixel
+ *  @param sw,sh - size of the source
+ *  @param sstride - row stride of the source in bytes
+ *  @param dest - the resampled image
+ *  @param dw,dh - size of the resampled image
+ *  @param dstride - row stride of dest in bytes
+ *  @param filter - the resampling kernel
+ *  @return Non-zero value to indicate error
+ *
+ *  The channels are processed independently, so the channel order does
+ *  not matter. Source and destination must not overlap.
+ */
+int vidResizeRGB24(const unsigned char *src,int sw,int sh,int sstride,
+                   unsigned char *dest,int dw,int dh,int dstride,
+                   VidResizeFilter filter){
+  ResizeTable xtable,ytable;
+  const unsigned char **rows;
+  const short *w;
+  short *tmp;
+  int i,k;
+
+  if (sw <= 0 || sh <= 0 || dw <= 0 || dh <= 0)
+    return -1;
+
+  if (!vertical_row)
+    resize_init();
+
+  resize_table_init(&xtable,sw,dw,filter);
+  resize_table_init(&ytable,sh,dh,filter);
+
+  tmp = malloc(sizeof(short) * sw * 3);
+  rows = malloc(sizeof(unsigned char*) * ytable.taps);
+
+  for (i=0;i<dh;i++){
+    for (k=0;k<ytable.count[i];k++)
+      rows[k] = src + (ytable.start[i] + k) * sstride;
+    w = ytable.weights + i * ytable.taps;
+
+    vertical_row(rows,w,ytable.count[i],tmp,sw * 3);
+    horizontal_row(tmp,&xtable,dest + i * dstride,dw);
+  }
+
+  free(tmp);
+  free(rows);
+  resize_table_clear(&xtable);
+  resize_table_clear(&ytable);
+
+  return 0;
+}
+
+/**
+ *  @param src - a RGB24 or BGR24 frame
+ *  @param dest - the resampled frame
+ *  @param size - the size of dest
+ *  @param filter - the resampling kernel
+ *  @return Non-zero value to indicate error
+ */
+int vidFrameResize(VidFrame *src,VidFrame *dest,VidSize *size,VidResizeFilter filter){
+  int sstride;
+  int bufsize;
+
+  if (src->format != V4L2_PIX_FMT_RGB24 && src->format != V4L2_PIX_FMT_BGR24){
+    rvtk_log(RVTK_ERROR,"vidFrameResize only handles 24 bit RGB frames\n");
+    return -1;
+  }
+
+  if (src == dest || size->width <= 0 || size->height <= 0)
+    return -1;
+
+  sstride = vidFrameGetRowStride(src);
+  if (sstride <= 0)
+    sstride = vidFrameGetWidth(src) * 3;
+
+  bufsize = size->width * size->height * 3;
+  if (vidFrameGetBufferLength(dest) < bufsize)
+    vidFrameResizeBuffer(dest,bufsize);
+
+  dest->format = src->format;
+  dest->size = *size;
+  dest->bytesperline = size->width * 3;
+  dest->imagesize = bufsize;
+  dest->timestamp = src->timestamp;
+
+  return vidResizeRGB24(vidFrameGetImageData(src),vidFrameGetWidth(src),
+                        vidFrameGetHeight(src),sstride,
+                        vidFrameGetImageData(dest),size->width,size->height,
+                        dest->bytesperline,filter);
+}
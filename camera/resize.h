@@ -0,0 +1,30 @@
+#ifndef __RESIZE_H_
+#define __RESIZE_H_
+
+#include "frame.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+/// Resampling kernels
+typedef enum {
+  /// Area average. Every source pixel contributes to the output pixels it overlaps, best for shrinking.
+  VID_RESIZE_BOX=0,
+  /// Linear interpolation between the two nearest source pixels on each axis
+  VID_RESIZE_BILINEAR=1
+} VidResizeFilter;
+
+/// Resample a RGB24 or BGR24 frame to size. dest gets the format of src.
+int vidFrameResize(VidFrame *src,VidFrame *dest,VidSize *size,VidResizeFilter filter);
+
+/// Resample a packed 24 bit image
+int vidResizeRGB24(const unsigned char *src,int sw,int sh,int sstride,
+                   unsigned char *dest,int dw,int dh,int dstride,
+                   VidResizeFilter filter);
+
+#ifdef __cplusplus
+}
+#endif /* defined(__cplusplus) */
+
+#endif
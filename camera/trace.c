@@ -0,0 +1,207 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+/* A span, written by the thread which ran it. seq is the number of the
+ * span plus 1, stored last, so a reader can tell a complete slot from one
+ * being overwritten. */
+typedef struct {
+  unsigned long seq;
+  const char *name;
+  int tid;
+  int64_t start;
+  /// -1 for an instant
+  int64_t duration;
+} TraceEvent;
+
+int trace_enabled = 0;
+
+static TraceEvent *trace_ring;
+
+/// Number of spans recorded, the next slot is trace_head % TRACE_RING_SIZE
+static unsigned long trace_head;
+
+static const char *trace_file;
+
+/// Written by the signal handler, read by the dump thread
+static int trace_pipe[2] = { -1,-1 };
+
+static __thread int trace_tid;
+
+int64_t traceNow(void){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void trace_record(const char *name,int64_t start,int64_t duration){
+  TraceEvent *ev;
+  unsigned long n;
+
+  if (!trace_tid)
+    trace_tid = syscall(SYS_gettid);
+
+  n = __atomic_fetch_add(&trace_head,1,__ATOMIC_RELAXED);
+  ev = &trace_ring[n % TRACE_RING_SIZE];
+
+  __atomic_store_n(&ev->seq,0,__ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  ev->name = name;
+  ev->tid = trace_tid;
+  ev->start = start;
+  ev->duration = duration;
+  __atomic_store_n(&ev->seq,n + 1,__ATOMIC_RELEASE);
+}
+
+void traceSpan(const char *name,int64_t start){
+  if (trace_enabled)
+    trace_record(name,start,traceNow() - start);
+}
+
+void traceInstant(const char *name){
+  if (trace_enabled)
+    trace_record(name,traceNow(),-1);
+}
+
+/**
+ *  @return Non-zero value to indicate error
+ *
+ *  The spans are written oldest first, with the timestamps and the
+ *  durations in usec as the format wants. Spans recorded while the dump
+ *  runs may be missing from it.
+ */
+int traceDump(const char *filename){
+  TraceEvent ev;
+  unsigned long head,n,seq;
+  char tmpname[4096];
+  FILE *file;
+  int pid = getpid();
+  int first = 1;
+
+  if (!trace_ring)
+    return -1;
+
+  /* Write aside and rename, a reader never sees half a trace */
+  snprintf(tmpname,sizeof(tmpname),"%s.tmp",filename);
+  file = fopen(tmpname,"w");
+  if (!file){
+    fprintf(stderr,"[trace] %s: %s\n",tmpname,strerror(errno));
+    return -1;
+  }
+
+  fprintf(file,"{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+  head = __atomic_load_n(&trace_head,__ATOMIC_ACQUIRE);
+  n = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+  for (;n < head;n++){
+    TraceEvent *slot = &trace_ring[n % TRACE_RING_SIZE];
+
+    seq = __atomic_load_n(&slot->seq,__ATOMIC_ACQUIRE);
+    ev = *slot;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (seq != n + 1 || __atomic_load_n(&slot->seq,__ATOMIC_RELAXED) != seq)
+      continue; /* overwritten meanwhile */
+
+    fprintf(file,"%s\n{\"name\":\"%s\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f",
+            first ? "" : ",",ev.name,pid,ev.tid,ev.start / 1e3);
+    if (ev.duration < 0)
+      fprintf(file,",\"ph\":\"i\",\"s\":\"p\"}");
+    else
+      fprintf(file,",\"ph\":\"X\",\"dur\":%.3f}",ev.duration / 1e3);
+    first = 0;
+  }
+
+  fprintf(file,"\n]}\n");
+
+  if (fclose(file) != 0 || rename(tmpname,filename) != 0){
+    fprintf(stderr,"[trace] %s: %s\n",filename,strerror(errno));
+    unlink(tmpname);
+    return -1;
+  }
+
+  return 0;
+}
+
+/// Only wakes up the dump thread, stdio is not safe in a signal handler
+static void trace_signal(int sig){
+  int saved = errno;
+  char c = 0;
+
+  if (write(trace_pipe[1],&c,1) < 0){
+    /* a dump is pending already */
+  }
+  errno = saved;
+}
+
+static void *trace_dump_thread(void *arg){
+  char c;
+
+  for (;;){
+    if (read(trace_pipe[0],&c,1) <= 0){
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    if (traceDump(trace_file) == 0)
+      fprintf(stderr,"[trace] Written to %s\n",trace_file);
+  }
+
+  return NULL;
+}
+
+/**
+ *  @return Non-zero value to indicate error. Tracing stays disabled.
+ *
+ *  Call it once, before the threads to trace are started.
+ */
+int traceInit(void){
+  struct sigaction sa;
+  pthread_attr_t attr;
+  pthread_t thread;
+  const char *file = getenv(TRACE_ENV);
+  int res;
+
+  if (!file || !*file || trace_enabled)
+    return 0;
+
+  trace_ring = calloc(TRACE_RING_SIZE,sizeof(TraceEvent));
+  if (!trace_ring || pipe(trace_pipe) != 0){
+    fprintf(stderr,"[trace] Can't enable tracing: %s\n",strerror(errno));
+    free(trace_ring);
+    trace_ring = 0;
+    return -1;
+  }
+  fcntl(trace_pipe[1],F_SETFL,O_NONBLOCK);
+  trace_file = file;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+  res = pthread_create(&thread,&attr,trace_dump_thread,NULL);
+  pthread_attr_destroy(&attr);
+  if (res != 0){
+    fprintf(stderr,"[trace] Can't start the dump thread\n");
+    return -1;
+  }
+
+  memset(&sa,0,sizeof(sa));
+  sa.sa_handler = trace_signal;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1,&sa,NULL);
+
+  trace_enabled = 1;
+  fprintf(stderr,"[trace] Enabled, kill -USR1 %d writes %s\n",(int)getpid(),
+          trace_file);
+
+  return 0;
+}
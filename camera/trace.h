@@ -0,0 +1,66 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* defined(__cplusplus) */
+
+  /* Tracing
+   *
+   * Spans of the stages of a session (capture, conversion, encoding,
+   * effects, delivery) are kept in a ring buffer of the last
+   * TRACE_RING_SIZE spans, and written as a Chrome trace (chrome://tracing,
+   * Perfetto) when the program gets SIGUSR1:
+   *
+   *   PHOTOBOOTH_TRACE=/tmp/photobooth-trace.json photobooth &
+   *   kill -USR1 $!
+   *
+   * When the variable is not set a span costs a load and a branch.
+   *
+   *   int64_t start = traceBegin();
+   *   ...
+   *   traceEnd("write_jpg",start);
+   *
+   * Names must be string constants, only the pointer is kept.
+   */
+
+#define TRACE_ENV "PHOTOBOOTH_TRACE"
+
+#define TRACE_RING_SIZE 16384
+
+  /// Non-zero once traceInit() enabled tracing
+  extern int trace_enabled;
+
+  /// Enable tracing if TRACE_ENV names a file, and dump to it on SIGUSR1. Returns non-zero on error.
+  int traceInit(void);
+
+  /// Write the spans in the ring to a file as a Chrome trace. Returns non-zero on error.
+  int traceDump(const char *filename);
+
+  /// CLOCK_MONOTONIC in nsec
+  int64_t traceNow(void);
+
+  /// Record a span from start until now
+  void traceSpan(const char *name,int64_t start);
+
+  /// Record a span without duration, e.g. a button press
+  void traceInstant(const char *name);
+
+  /// The start of a span, 0 when tracing is disabled
+  static inline int64_t traceBegin(void){
+    return trace_enabled ? traceNow() : 0;
+  }
+
+  /// The end of a span started by traceBegin()
+  static inline void traceEnd(const char *name,int64_t start){
+    if (start)
+      traceSpan(name,start);
+  }
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif /* defined(__cplusplus) */
+
+#endif /*TRACE_H_*/
@@ -0,0 +1,180 @@
+/*
+ * yuv2rgb-check.c
+ *
+ * Checks that the SSE2 and AVX2 back-ends of yuv2rgb.c give exactly the
+ * bytes of the LUT back-end, on random images and on the extremes of the
+ * samples, at widths which leave every possible remainder to the scalar
+ * tail of the vector loops. Run by "make check".
+ *
+ * Usage: yuv2rgb-check
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <linux/videodev2.h>
+#include "frame.h"
+#include "yuv2rgb.h"
+
+/* The LUT back-end converts pixel pairs, so an odd width reads a pair and
+ * writes a pixel past the end of the row */
+#define SLACK 64
+
+typedef int (*ConvFunc)(VidFrame *src, VidFrame *dest);
+
+static const struct {
+  const char *name;
+  fourcc_t format;
+  ConvFunc convert;
+} conversions[] = {
+  { "yuyv->rgb24", V4L2_PIX_FMT_YUYV, yuyv_to_rgb24 },
+  { "yuyv->bgr24", V4L2_PIX_FMT_YUYV, yuyv_to_bgr24 },
+  { "yuv420->rgb24", V4L2_PIX_FMT_YUV420, yuv420_to_rgb24 },
+  { "yuv420->bgr24", V4L2_PIX_FMT_YUV420, yuv420_to_bgr24 },
+};
+
+#define N_CONVERSIONS (int)(sizeof(conversions) / sizeof(conversions[0]))
+
+static const int heights[] = { 1, 2, 5 };
+
+static const char *patterns[] = { "random", "zero", "full", "stripes",
+                                  "extreme chroma" };
+
+#define N_PATTERNS (int)(sizeof(patterns) / sizeof(patterns[0]))
+
+static unsigned int seed = 1;
+
+static unsigned char next_random(void){
+  seed = seed * 1103515245 + 12345;
+  return seed >> 16;
+}
+
+static VidFrame *create_frame(fourcc_t format, int width, int height,
+                              int length){
+  VidFrame *frame = vidFrameCreate();
+
+  vidFrameResizeBuffer(frame, length);
+  frame->format = format;
+  frame->size.width = width;
+  frame->size.height = height;
+  frame->imagesize = length;
+  memset(vidFrameGetImageData(frame), 0, length);
+
+  return frame;
+}
+
+/* The samples of pattern p, wherever they land in the planes */
+static void fill(VidFrame *frame, int length, int p){
+  unsigned char *data = vidFrameGetImageData(frame);
+  int i;
+
+  for( i = 0; i < length; i++ ){
+    switch( p ){
+    case 0:
+      data[i] = next_random();
+      break;
+    case 1:
+      data[i] = 0;
+      break;
+    case 2:
+      data[i] = 255;
+      break;
+    case 3:
+      data[i] = (i & 1) ? 0 : 255;
+      break;
+    default:
+      /* the chroma extremes saturate the sums in both directions */
+      data[i] = (i % 3 == 0) ? 255 : (i % 3 == 1) ? 0 : next_random();
+      break;
+    }
+  }
+}
+
+/* Convert src with one back-end, return 0 if it isn't supported here */
+static int convert(int accel, int c, VidFrame *src, VidFrame *dest,
+                   int length){
+  if( yuv2rgb_set_accel(accel) != accel ){
+    return 0;
+  }
+
+  memset(vidFrameGetImageData(dest), 0xa5, length);
+  conversions[c].convert(src, dest);
+
+  return 1;
+}
+
+static int check(int c, int width, int height, int p, int *skipped){
+  static const int accels[] = { YUV2RGB_ACCEL_SSE2, YUV2RGB_ACCEL_AVX2 };
+  static const char *names[] = { "sse2", "avx2" };
+  VidFrame *src, *ref, *out;
+  int srcLength, dstLength;
+  int failed = 0;
+  int a, k;
+
+  srcLength = width * height * 2 + SLACK;
+  dstLength = width * height * 3 + SLACK;
+  src = create_frame(conversions[c].format, width, height, srcLength);
+  ref = create_frame(V4L2_PIX_FMT_RGB24, width, height, dstLength);
+  out = create_frame(V4L2_PIX_FMT_RGB24, width, height, dstLength);
+
+  fill(src, srcLength, p);
+  convert(YUV2RGB_ACCEL_NONE, c, src, ref, dstLength);
+
+  for( a = 0; a < 2; a++ ){
+    if( !convert(accels[a], c, src, out, dstLength) ){
+      skipped[a] = 1;
+      continue;
+    }
+    if( memcmp(vidFrameGetImageData(ref), vidFrameGetImageData(out),
+               dstLength) != 0 ){
+      for( k = 0; k < dstLength &&
+             vidFrameGetImageData(ref)[k] == vidFrameGetImageData(out)[k];
+           k++ );
+      printf("FAIL %s %s %dx%d %s: first difference at byte %d "
+             "(pixel %d), %d instead of %d\n", conversions[c].name,
+             names[a], width, height, patterns[p], k, k / 3,
+             vidFrameGetImageData(out)[k], vidFrameGetImageData(ref)[k]);
+      failed = 1;
+    }
+  }
+
+  vidFrameRelease(&src);
+  vidFrameRelease(&ref);
+  vidFrameRelease(&out);
+
+  return failed;
+}
+
+int main(int argc, char *argv[]){
+  /* every width from 1 to 70 leaves each remainder of 16 and 32, then
+   * the widths of the cameras and their neighbours */
+  static const int large[] = { 160, 318, 320, 322, 638, 640, 960 };
+  int skipped[2] = { 0, 0 };
+  int failures = 0, checks = 0;
+  int c, w, h, p, i;
+
+  for( c = 0; c < N_CONVERSIONS; c++ ){
+    for( w = 1; w <= 70 + (int)(sizeof(large) / sizeof(int)); w++ ){
+      int width = w <= 70 ? w : large[w - 71];
+
+      for( h = 0; h < (int)(sizeof(heights) / sizeof(int)); h++ ){
+        for( p = 0; p < N_PATTERNS; p++ ){
+          failures += check(c, width, heights[h], p, skipped);
+          checks++;
+        }
+      }
+    }
+  }
+
+  yuv2rgb_set_accel(YUV2RGB_ACCEL_AUTO);
+
+  for( i = 0; i < 2; i++ ){
+    if( skipped[i] ){
+      printf("%s is not supported by this CPU, not checked\n",
+             i == 0 ? "SSE2" : "AVX2");
+    }
+  }
+  printf("%d of %d images differ from the LUT back-end\n", failures, checks);
+
+  return failures != 0;
+}
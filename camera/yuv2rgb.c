@@ -1,11 +1,37 @@
+#include <stdlib.h>
+#include <string.h>
+
 #include "fourcc.h"
 #include "yuv2rgb.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#define YUV2RGB_X86
+#include <immintrin.h>
+#endif
+
 static int yuv420_to_rgbmodel(VidFrame *src,VidFrame *dest,unsigned int rgbModel[]);
 static int yuyv_to_rgbmodel(VidFrame *src,VidFrame *dest,unsigned int rgbModel[]);
+static int yuyv_to_rgbmodel_scaled(VidFrame *src,VidFrame *dest,unsigned int rgbModel[]);
 
 static int initialized=0;
 
+/* Row converters. The SIMD versions handle as many pixels as they can in
+ * vector registers and leave the remainder of the row to the LUT version,
+ * so all of them produce exactly the same bytes. */
+typedef void (*yuyv_row_func)(const unsigned char *s,unsigned char *d,int w,
+	const unsigned int rgbModel[]);
+typedef void (*yuv420_row_func)(const unsigned char *y,const unsigned char *u,
+	const unsigned char *v,unsigned char *d,int w,const unsigned int rgbModel[]);
+
+static void yuyv_row_c(const unsigned char *s,unsigned char *d,int w,
+	const unsigned int rgbModel[]);
+static void yuv420_row_c(const unsigned char *y,const unsigned char *u,
+	const unsigned char *v,unsigned char *d,int w,const unsigned int rgbModel[]);
+
+static int accel = -1;
+static yuyv_row_func yuyv_row = yuyv_row_c;
+static yuv420_row_func yuv420_row = yuv420_row_c;
+
 /** Refer from xawtv & camstream source code. 
 
     Reference file: 	camstrea:: lib/ccvt/ccvt_c2.c
@@ -38,6 +64,9 @@ static int conv_init(){
 	for (; i < 2 * CLIP + 256; i++)
 		clip[i] = 255;
 
+	if (accel < 0)
+		yuv2rgb_set_accel(YUV2RGB_ACCEL_AUTO);
+
 	return 0;
 }
 
@@ -81,11 +110,9 @@ int yuv420_to_bgr24(VidFrame *src,VidFrame *dest){
  */
 
 static int yuv420_to_rgbmodel(VidFrame *src,VidFrame *dest,unsigned int rgbModel[]){ 
-	unsigned char *d,*_d;
+	unsigned char *d;
 	unsigned char *y,*u,*v;
-	unsigned char *_u,*_v;
-	int i,j;
-	unsigned int channel[3];
+	int i;
 	
 	int w=vidFrameGetWidth(src);
 	int h=vidFrameGetHeight(src);
@@ -98,35 +125,40 @@ static int yuv420_to_rgbmodel(VidFrame *src,VidFrame *dest,unsigned int rgbModel
 	u = y +w*h;
 	v = u+(w*h)/4;
 	
+	/* Each chroma row is shared by two luma rows */
 	for (i=0;i<h;i++) {
-		_u = u; _v = v; _d = d;
-		for (j=0;j<w;j+=2) {
-			channel[0] = R(*y,*v);
-			channel[1] = G(*y,*u,*v);
-			channel[2] = B(*y,*u);
-			*(d++) = channel[ rgbModel[0] ];
-			*(d++) = channel[ rgbModel[1]];
-			*(d++)  = channel[rgbModel[2]];
-			y++;
-			
-			channel[0] = R(*y,*v);
-			channel[1] = G(*y,*u,*v);
-			channel[2] = B(*y,*u);
-			
-			*(d++) = channel[ rgbModel[0] ];
-			*(d++) = channel[ rgbModel[1]];
-			*(d++)  = channel[rgbModel[2]];
-			y++;u++;v++;
-		}
-		
-		if ( !(i % 2) ){
-			u = _u; v = _v;
-		}
+		yuv420_row(y + i * w, u + (i/2) * (w/2), v + (i/2) * (w/2),
+			d + i * w * 3, w, rgbModel);
 	}
 	
 	return 0;
 }
 
+static void yuv420_row_c(const unsigned char *y,const unsigned char *u,
+	const unsigned char *v,unsigned char *d,int w,const unsigned int rgbModel[]){
+	unsigned int channel[3];
+	int j;
+
+	for (j=0;j<w;j+=2) {
+		channel[0] = R(*y,*v);
+		channel[1] = G(*y,*u,*v);
+		channel[2] = B(*y,*u);
+		*(d++) = channel[ rgbModel[0] ];
+		*(d++) = channel[ rgbModel[1]];
+		*(d++)  = channel[rgbModel[2]];
+		y++;
+		
+		channel[0] = R(*y,*v);
+		channel[1] = G(*y,*u,*v);
+		channel[2] = B(*y,*u);
+		
+		*(d++) = channel[ rgbModel[0] ];
+		*(d++) = channel[ rgbModel[1]];
+		*(d++)  = channel[rgbModel[2]];
+		y++;u++;v++;
+	}
+}
+
 int yuyv_to_rgb24(VidFrame *src,VidFrame *dest){
 	if (!initialized){
 		initialized = 1;
@@ -173,10 +205,8 @@ static int yuyv_to_rgbmodel(VidFrame *src,VidFrame *dest,unsigned int rgbModel[]
 	int w=vidFrameGetWidth(src);
 	int h=vidFrameGetHeight(src);
 	
-	unsigned int channel[3];
 	unsigned char *s,*d;
-	unsigned char y,u,v;
-	int i,j;
+	int i;
 	
 	dest->bytesperline = w * 3;
 	
@@ -184,18 +214,147 @@ static int yuyv_to_rgbmodel(VidFrame *src,VidFrame *dest,unsigned int rgbModel[]
 	s = vidFrameGetImageData(src);
 	
 	for (i=0;i<h;i++) {
-		for (j=0;j<w;j+=2) {
-			y = s[0]; u=s[1]; v= s[3];
-			
-			channel[0] = R( y , v);
-			channel[1] = G( y,u,v);
-			channel[2] = B(y,u);
-			
-			*(d++) = channel[ rgbModel[0] ];
-			*(d++) = channel[ rgbModel[1]];
-			*(d++)  = channel[rgbModel[2]];
+		yuyv_row(s, d, w, rgbModel);
+		s += w * 2;
+		d += w * 3;
+	}
+	
+	return 0;
+}
+
+static void yuyv_row_c(const unsigned char *s,unsigned char *d,int w,
+	const unsigned int rgbModel[]){
+	unsigned int channel[3];
+	unsigned char y,u,v;
+	int j;
+
+	for (j=0;j<w;j+=2) {
+		y = s[0]; u=s[1]; v= s[3];
+		
+		channel[0] = R( y , v);
+		channel[1] = G( y,u,v);
+		channel[2] = B(y,u);
+		
+		*(d++) = channel[ rgbModel[0] ];
+		*(d++) = channel[ rgbModel[1]];
+		*(d++)  = channel[rgbModel[2]];
+		
+		y = s[2];
+		
+		channel[0] = R( y , v);
+		channel[1] = G( y,u,v);
+		channel[2] = B(y,u);
+		
+		*(d++) = channel[ rgbModel[0] ];
+		*(d++) = channel[ rgbModel[1]];
+		*(d++)  = channel[rgbModel[2]];
+		s+=4;
+	}
+}
+
+int yuyv_to_rgb24_scaled(VidFrame *src,VidFrame *dest){
+	if (!initialized){
+		initialized = 1;
+		conv_init();
+	}
+	
+	int bufsize =  vidFourccCalcFrameSize(dest->format,dest->size.width,dest->size.height);
+	if (bufsize > vidFrameGetBufferLength(dest) ){
+		vidFrameResizeBuffer(dest,bufsize);	
+	}
+	
+	unsigned int rgbModel[3] = {0,1,2}; /* RGB */
+	return yuyv_to_rgbmodel_scaled(src,dest,rgbModel);
+}
+
+int yuyv_to_bgr24_scaled(VidFrame *src,VidFrame *dest){
+	if (!initialized){
+		initialized = 1;
+		conv_init();
+	}
+	
+	int bufsize =  vidFourccCalcFrameSize(dest->format,dest->size.width,dest->size.height);
+	if (bufsize > vidFrameGetBufferLength(dest) ){
+		vidFrameResizeBuffer(dest,bufsize);	
+	}
+	
+	unsigned int rgbModel[3] = {2,1,0}; /* RGB */
+	return yuyv_to_rgbmodel_scaled(src,dest,rgbModel);
+}
+
+/* Column table of the scaled conversion. The preview converts every frame
+ * between the same sizes, so the table is only computed when they change.
+ * One per thread, the converters may run in several. */
+static __thread int *xoff_table;
+static __thread int xoff_sw,xoff_dw;
+
+static const int *yuyv_xoff(int sw,int dw){
+	int j,xs;
+	
+	if (xoff_table && xoff_sw == sw && xoff_dw == dw)
+		return xoff_table;
+	
+	free(xoff_table);
+	xoff_table = malloc(sizeof(int) * dw);
+	if (!xoff_table)
+		return 0;
+	
+	/* Byte offset of the sampled pixel's pair [Y0 U Y1 V] in a source row,
+	 * with the low bit telling whether it is Y0 or Y1. Sampling at the
+	 * pixel centres like GDK_INTERP_NEAREST. */
+	for (j=0;j<dw;j++) {
+		xs = ((2 * j + 1) * sw) / (2 * dw);
+		xoff_table[j] = (xs & ~1) * 2 + (xs & 1);
+	}
+	xoff_sw = sw;
+	xoff_dw = dw;
+	
+	return xoff_table;
+}
+
+/**
+ * yuyv_to_rgbmodel_scaled:
+ * @param frame The source video frame
+ * @param dest The destination frame. Its size is the size of the output
+ *  image. (The buffer must be large enough to hold the final image)
+ * @param rgbModel: An array to describe the order of 'R','G','B" color model.
+ *
+ *  Convert a YUYV image into RGB24|BGR24 and resample it to the size of
+ *  dest (nearest neighbour) in a single pass. Only the sampled pixels are
+ *  ever converted, and no full size RGB image is created.
+ */
+
+static int yuyv_to_rgbmodel_scaled(VidFrame *src,VidFrame *dest,unsigned int rgbModel[]) {
+	int sw=vidFrameGetWidth(src);
+	int sh=vidFrameGetHeight(src);
+	int dw=vidFrameGetWidth(dest);
+	int dh=vidFrameGetHeight(dest);
+	
+	unsigned int channel[3];
+	unsigned char *s,*d,*row;
+	unsigned char y,u,v;
+	const int *xoff;
+	int i,j;
+	
+	if (dw <= 0 || dh <= 0)
+		return -1;
+	
+	dest->bytesperline = dw * 3;
+	
+	d = vidFrameGetImageData(dest);
+	s = vidFrameGetImageData(src);
+	
+	xoff = yuyv_xoff(sw,dw);
+	if (!xoff)
+		return -1;
+	
+	for (i=0;i<dh;i++) {
+		row = s + (((2 * i + 1) * sh) / (2 * dh)) * sw * 2;
+		
+		for (j=0;j<dw;j++) {
+			unsigned char *pair = row + (xoff[j] & ~1);
 			
-			y = s[2];
+			y = pair[(xoff[j] & 1) * 2]; u = pair[1]; v = pair[3];
 			
 			channel[0] = R( y , v);
 			channel[1] = G( y,u,v);
@@ -204,10 +363,300 @@ static int yuyv_to_rgbmodel(VidFrame *src,VidFrame *dest,unsigned int rgbModel[]
 			*(d++) = channel[ rgbModel[0] ];
 			*(d++) = channel[ rgbModel[1]];
 			*(d++)  = channel[rgbModel[2]];
-			s+=4;
 		}
-		
 	}
 	
 	return 0;
 }
+
+#ifdef YUV2RGB_X86
+
+/**
+ * SSE2 / AVX2 back-ends.
+ *
+ *  The LUT entries are ((c-128) * k) >> 8. With x = (c-128) << 7 the same
+ *  value is (x * 2k) >> 16, which is exactly what pmulhw computes, so the
+ *  vector code rounds identically to the tables. The clip table becomes the
+ *  unsigned saturation of packuswb.
+ *
+ *  Chroma is handled per pixel pair: the even and the odd luma samples of
+ *  each pair are kept in separate registers and share the same chroma terms.
+ */
+
+#define K_CR  (359*2)
+#define K_CG1 (183*2)
+#define K_CG2 (88*2)
+#define K_CB  (454*2)
+
+/* pshufb masks for interleaving 16 R, G and B bytes into 48 bytes RGB24 */
+static unsigned char rgb24_shuffle[3][3][16];
+
+static void rgb24_shuffle_init(){
+	int j,c,k;
+
+	for (j=0;j<3;j++)
+		for (c=0;c<3;c++)
+			for (k=0;k<16;k++){
+				int n = j * 16 + k;
+				rgb24_shuffle[j][c][k] = (n % 3 == c) ? n / 3 : 0x80;
+			}
+}
+
+/* Weave even/odd pixel values (8 x int16 each) back into 16 bytes in pixel order */
+#define SSE2_WEAVE(e,o) _mm_unpacklo_epi8(_mm_packus_epi16(e,o), \
+	_mm_srli_si128(_mm_packus_epi16(e,o),8))
+
+__attribute__((target("sse2")))
+static inline void sse2_yuv_pairs(__m128i ye,__m128i yo,__m128i u,__m128i v,
+	__m128i *r,__m128i *g,__m128i *b){
+	const __m128i c128 = _mm_set1_epi16(128);
+	__m128i uu = _mm_slli_epi16(_mm_sub_epi16(u,c128),7);
+	__m128i vv = _mm_slli_epi16(_mm_sub_epi16(v,c128),7);
+	__m128i rv = _mm_mulhi_epi16(vv,_mm_set1_epi16(K_CR));
+	__m128i gc = _mm_add_epi16(_mm_mulhi_epi16(vv,_mm_set1_epi16(K_CG1)),
+		_mm_mulhi_epi16(uu,_mm_set1_epi16(K_CG2)));
+	__m128i bu = _mm_mulhi_epi16(uu,_mm_set1_epi16(K_CB));
+
+	*r = SSE2_WEAVE(_mm_add_epi16(ye,rv),_mm_add_epi16(yo,rv));
+	*g = SSE2_WEAVE(_mm_sub_epi16(ye,gc),_mm_sub_epi16(yo,gc));
+	*b = SSE2_WEAVE(_mm_add_epi16(ye,bu),_mm_add_epi16(yo,bu));
+}
+
+/* Store 16 pixels as RGB24. SSE2 has no byte shuffle, so widen every pixel
+ * to 32 bits and write them with overlapping 4 byte stores. The last pixel
+ * is written byte-wise to stay inside the 48 byte block. */
+__attribute__((target("sse2")))
+static inline void sse2_store_rgb24(unsigned char *d,__m128i c0,__m128i c1,__m128i c2){
+	const __m128i zero = _mm_setzero_si128();
+	unsigned int px[16] __attribute__((aligned(16)));
+	__m128i lo = _mm_unpacklo_epi8(c0,c1);
+	__m128i hi = _mm_unpackhi_epi8(c0,c1);
+	__m128i c2lo = _mm_unpacklo_epi8(c2,zero);
+	__m128i c2hi = _mm_unpackhi_epi8(c2,zero);
+	int i;
+
+	_mm_store_si128((__m128i *)&px[0],_mm_unpacklo_epi16(lo,c2lo));
+	_mm_store_si128((__m128i *)&px[4],_mm_unpackhi_epi16(lo,c2lo));
+	_mm_store_si128((__m128i *)&px[8],_mm_unpacklo_epi16(hi,c2hi));
+	_mm_store_si128((__m128i *)&px[12],_mm_unpackhi_epi16(hi,c2hi));
+
+	for (i=0;i<15;i++)
+		memcpy(d + i * 3,&px[i],4);
+	d[45] = px[15];
+	d[46] = px[15] >> 8;
+	d[47] = px[15] >> 16;
+}
+
+__attribute__((target("sse2")))
+static void yuyv_row_sse2(const unsigned char *s,unsigned char *d,int w,
+	const unsigned int rgbModel[]){
+	const __m128i mask = _mm_set1_epi32(0xff);
+	__m128i r,g,b;
+	int j;
+
+	for (j=0;j+16<=w;j+=16){
+		__m128i a0 = _mm_loadu_si128((const __m128i *)s);
+		__m128i a1 = _mm_loadu_si128((const __m128i *)(s+16));
+
+		__m128i ye = _mm_packs_epi32(_mm_and_si128(a0,mask),_mm_and_si128(a1,mask));
+		__m128i u  = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(a0,8),mask),
+			_mm_and_si128(_mm_srli_epi32(a1,8),mask));
+		__m128i yo = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(a0,16),mask),
+			_mm_and_si128(_mm_srli_epi32(a1,16),mask));
+		__m128i v  = _mm_packs_epi32(_mm_srli_epi32(a0,24),_mm_srli_epi32(a1,24));
+
+		sse2_yuv_pairs(ye,yo,u,v,&r,&g,&b);
+		if (rgbModel[0] == 0)
+			sse2_store_rgb24(d,r,g,b);
+		else
+			sse2_store_rgb24(d,b,g,r);
+
+		s += 32;
+		d += 48;
+	}
+
+	if (j < w)
+		yuyv_row_c(s,d,w-j,rgbModel);
+}
+
+__attribute__((target("sse2")))
+static void yuv420_row_sse2(const unsigned char *y,const unsigned char *u,
+	const unsigned char *v,unsigned char *d,int w,const unsigned int rgbModel[]){
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i mask = _mm_set1_epi16(0xff);
+	__m128i r,g,b;
+	int j;
+
+	for (j=0;j+16<=w;j+=16){
+		__m128i yy = _mm_loadu_si128((const __m128i *)y);
+		__m128i uu = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)u),zero);
+		__m128i vv = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)v),zero);
+
+		sse2_yuv_pairs(_mm_and_si128(yy,mask),_mm_srli_epi16(yy,8),uu,vv,&r,&g,&b);
+		if (rgbModel[0] == 0)
+			sse2_store_rgb24(d,r,g,b);
+		else
+			sse2_store_rgb24(d,b,g,r);
+
+		y += 16; u += 8; v += 8;
+		d += 48;
+	}
+
+	if (j < w)
+		yuv420_row_c(y,u,v,d,w-j,rgbModel);
+}
+
+/* AVX2: 16 pixel pairs per iteration. Every 128-bit lane holds 8 pairs in
+ * order (lane 0 = pairs 0-7, lane 1 = pairs 8-15), so the lane-wise pack
+ * and unpack instructions give 16 pixels in order per lane. */
+
+#define AVX2_WEAVE(e,o) _mm256_unpacklo_epi8(_mm256_packus_epi16(e,o), \
+	_mm256_srli_si256(_mm256_packus_epi16(e,o),8))
+
+__attribute__((target("avx2")))
+static inline void avx2_yuv_pairs(__m256i ye,__m256i yo,__m256i u,__m256i v,
+	__m256i *r,__m256i *g,__m256i *b){
+	const __m256i c128 = _mm256_set1_epi16(128);
+	__m256i uu = _mm256_slli_epi16(_mm256_sub_epi16(u,c128),7);
+	__m256i vv = _mm256_slli_epi16(_mm256_sub_epi16(v,c128),7);
+	__m256i rv = _mm256_mulhi_epi16(vv,_mm256_set1_epi16(K_CR));
+	__m256i gc = _mm256_add_epi16(_mm256_mulhi_epi16(vv,_mm256_set1_epi16(K_CG1)),
+		_mm256_mulhi_epi16(uu,_mm256_set1_epi16(K_CG2)));
+	__m256i bu = _mm256_mulhi_epi16(uu,_mm256_set1_epi16(K_CB));
+
+	*r = AVX2_WEAVE(_mm256_add_epi16(ye,rv),_mm256_add_epi16(yo,rv));
+	*g = AVX2_WEAVE(_mm256_sub_epi16(ye,gc),_mm256_sub_epi16(yo,gc));
+	*b = AVX2_WEAVE(_mm256_add_epi16(ye,bu),_mm256_add_epi16(yo,bu));
+}
+
+__attribute__((target("avx2")))
+static inline void ssse3_store_rgb24(unsigned char *d,__m128i c0,__m128i c1,__m128i c2){
+	int j;
+
+	for (j=0;j<3;j++){
+		__m128i o = _mm_or_si128(
+			_mm_shuffle_epi8(c0,_mm_loadu_si128((const __m128i *)rgb24_shuffle[j][0])),
+			_mm_or_si128(
+			_mm_shuffle_epi8(c1,_mm_loadu_si128((const __m128i *)rgb24_shuffle[j][1])),
+			_mm_shuffle_epi8(c2,_mm_loadu_si128((const __m128i *)rgb24_shuffle[j][2]))));
+		_mm_storeu_si128((__m128i *)(d + j * 16),o);
+	}
+}
+
+__attribute__((target("avx2")))
+static inline void avx2_store_rgb24(unsigned char *d,__m256i c0,__m256i c1,__m256i c2){
+	ssse3_store_rgb24(d,_mm256_castsi256_si128(c0),_mm256_castsi256_si128(c1),
+		_mm256_castsi256_si128(c2));
+	ssse3_store_rgb24(d+48,_mm256_extracti128_si256(c0,1),
+		_mm256_extracti128_si256(c1,1),_mm256_extracti128_si256(c2,1));
+}
+
+__attribute__((target("avx2")))
+static void yuyv_row_avx2(const unsigned char *s,unsigned char *d,int w,
+	const unsigned int rgbModel[]){
+	const __m256i mask = _mm256_set1_epi32(0xff);
+	__m256i r,g,b;
+	int j;
+
+/* packs_epi32 interleaves the lanes of both sources; 0xd8 restores pair order */
+#define AVX2_PAIRS(x0,x1) _mm256_permute4x64_epi64(_mm256_packs_epi32(x0,x1),0xd8)
+
+	for (j=0;j+32<=w;j+=32){
+		__m256i a0 = _mm256_loadu_si256((const __m256i *)s);
+		__m256i a1 = _mm256_loadu_si256((const __m256i *)(s+32));
+
+		__m256i ye = AVX2_PAIRS(_mm256_and_si256(a0,mask),_mm256_and_si256(a1,mask));
+		__m256i u  = AVX2_PAIRS(_mm256_and_si256(_mm256_srli_epi32(a0,8),mask),
+			_mm256_and_si256(_mm256_srli_epi32(a1,8),mask));
+		__m256i yo = AVX2_PAIRS(_mm256_and_si256(_mm256_srli_epi32(a0,16),mask),
+			_mm256_and_si256(_mm256_srli_epi32(a1,16),mask));
+		__m256i v  = AVX2_PAIRS(_mm256_srli_epi32(a0,24),_mm256_srli_epi32(a1,24));
+
+		avx2_yuv_pairs(ye,yo,u,v,&r,&g,&b);
+		if (rgbModel[0] == 0)
+			avx2_store_rgb24(d,r,g,b);
+		else
+			avx2_store_rgb24(d,b,g,r);
+
+		s += 64;
+		d += 96;
+	}
+
+#undef AVX2_PAIRS
+
+	if (j < w)
+		yuyv_row_sse2(s,d,w-j,rgbModel);
+}
+
+__attribute__((target("avx2")))
+static void yuv420_row_avx2(const unsigned char *y,const unsigned char *u,
+	const unsigned char *v,unsigned char *d,int w,const unsigned int rgbModel[]){
+	const __m256i mask = _mm256_set1_epi16(0xff);
+	__m256i r,g,b;
+	int j;
+
+	for (j=0;j+32<=w;j+=32){
+		__m256i yy = _mm256_loadu_si256((const __m256i *)y);
+		__m256i uu = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)u));
+		__m256i vv = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)v));
+
+		avx2_yuv_pairs(_mm256_and_si256(yy,mask),_mm256_srli_epi16(yy,8),uu,vv,&r,&g,&b);
+		if (rgbModel[0] == 0)
+			avx2_store_rgb24(d,r,g,b);
+		else
+			avx2_store_rgb24(d,b,g,r);
+
+		y += 32; u += 16; v += 16;
+		d += 96;
+	}
+
+	if (j < w)
+		yuv420_row_sse2(y,u,v,d,w-j,rgbModel);
+}
+
+#endif /* YUV2RGB_X86 */
+
+/**
+ * yuv2rgb_set_accel:
+ * @param level One of YUV2RGB_ACCEL_*. YUV2RGB_ACCEL_AUTO picks the best
+ *  back-end supported by the running CPU.
+ * @return The back-end actually in use. A level the CPU can't run falls
+ *  back to the next lower one.
+ */
+
+int yuv2rgb_set_accel(int level){
+	int best = YUV2RGB_ACCEL_NONE;
+
+#ifdef YUV2RGB_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		best = YUV2RGB_ACCEL_SSE2;
+	if (__builtin_cpu_supports("avx2"))
+		best = YUV2RGB_ACCEL_AVX2;
+	rgb24_shuffle_init();
+#endif
+
+	if (level == YUV2RGB_ACCEL_AUTO || level > best)
+		level = best;
+
+	yuyv_row = yuyv_row_c;
+	yuv420_row = yuv420_row_c;
+#ifdef YUV2RGB_X86
+	if (level == YUV2RGB_ACCEL_SSE2){
+		yuyv_row = yuyv_row_sse2;
+		yuv420_row = yuv420_row_sse2;
+	} else if (level == YUV2RGB_ACCEL_AVX2){
+		yuyv_row = yuyv_row_avx2;
+		yuv420_row = yuv420_row_avx2;
+	}
+#endif
+	accel = level;
+
+	return accel;
+}
+
+int yuv2rgb_get_accel(){
+	if (accel < 0)
+		yuv2rgb_set_accel(YUV2RGB_ACCEL_AUTO);
+	return accel;
+}
@@ -3,9 +3,27 @@
 
 #include "frame.h"
 
+/// Conversion back-ends, selected at run time according to the CPU
+typedef enum {
+	YUV2RGB_ACCEL_NONE=0,
+	YUV2RGB_ACCEL_SSE2=1,
+	YUV2RGB_ACCEL_AVX2=2,
+	YUV2RGB_ACCEL_AUTO=3
+} Yuv2RgbAccel;
+
 int yuv420_to_rgb24(VidFrame *src,VidFrame *dest);
 int yuv420_to_bgr24(VidFrame *src,VidFrame *dest);
 int yuyv_to_rgb24(VidFrame *src,VidFrame *dest);
 int yuyv_to_bgr24(VidFrame *src,VidFrame *dest);
 
+/* Convert and resample to the size of dest in one pass */
+int yuyv_to_rgb24_scaled(VidFrame *src,VidFrame *dest);
+int yuyv_to_bgr24_scaled(VidFrame *src,VidFrame *dest);
+
+/// Select the conversion back-end. Returns the one actually in use.
+int yuv2rgb_set_accel(int level);
+
+/// Return the conversion back-end in use
+int yuv2rgb_get_accel();
+
 #endif
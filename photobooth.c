@@ -10,6 +10,8 @@
 #include <string.h>
 #include "camera/frame.h"
 #include "camera/cam.h"
+#include "camera/glib-source.h"
+#include "camera/trace.h"
 #include "usb-drive.h"
 #include "ImageManipulations.h"
 #include "FileHandler.h"
@@ -22,8 +24,10 @@
  *  Inputs:         argc - the number of arguments received
  *                  argv - the arguments received
  *  Outputs:        0 on exit success, Not 0 if an error occurs.
- *  Routines Called: g_slice_new, gtk_init, init_app, gtk_widget_show,
- *                  gtk_main, g_slice_free
+ *  Routines Called: g_slice_new, traceInit, gtk_init, init_app,
+ *                  gtk_widget_show, gtk_main, encode_queue_free,
+ *                  image_job_shutdown, texture_cache_free,
+ *                  image_cache_clear, g_slice_free
  *
  *****************************************************************************/
 int main (int argc, char *argv[])
@@ -34,6 +38,13 @@ int main (int argc, char *argv[])
     /* allocate the memory needed by our DigitalPhotoBooth struct */
     booth = g_slice_new (DigitalPhotoBooth);
 
+    /* photos are encoded by other threads, which talk to the main loop */
+    if (!g_thread_supported ()) g_thread_init (NULL);
+
+    /* trace the stages of the sessions if PHOTOBOOTH_TRACE is set, before
+     * any thread is started */
+    traceInit ();
+
     /* initialize GTK+ libraries */
     gtk_init (&argc, &argv);
     
@@ -49,6 +60,16 @@ int main (int argc, char *argv[])
     /* enter GTK+ main loop */
     gtk_main ();
     
+    /* let the photos still being encoded finish */
+    encode_queue_free (booth->encode_queue);
+    
+    /* stop the effects still running, they use the texture */
+    image_job_shutdown ();
+    
+    /* release the texture and the decoded images */
+    texture_cache_free ();
+    image_cache_clear (booth);
+    
     /* free memory we allocated for DigitalPhotoBooth struct */
     g_slice_free (DigitalPhotoBooth, booth);
 
@@ -92,13 +113,18 @@ void error_message (const gchar *message)
  *  Routines Called: gtk_builder_new, gtk_builder_add_from_file, error_message
  *                  g_error_free, gtk_builder_get_object, money_update, memset
  *                  gtk_builder_connect_signals, g_object_unref,
- *                  delivery_update
+ *                  delivery_update, encode_queue_new, g_getenv,
+ *                  jpeg_profile_lookup, g_warning, g_ascii_strcasecmp,
+ *                  effects_reset, texture_cache_init
  *
  *****************************************************************************/
 gboolean init_app (DigitalPhotoBooth *booth)
 {
     GtkBuilder *builder;
     GError *err = NULL;
+    const gchar *profile;
+    const gchar *format;
+    const gchar *memory;
     
     /* use GtkBuilder to build our interface from the XML file */
     builder = gtk_builder_new ();
@@ -185,6 +211,79 @@ gboolean init_app (DigitalPhotoBooth *booth)
     booth->take_photo_video_source = 0;
 	booth->take_photo_timer_source = 0;
 	
+	/* start the threads which encode the photos */
+	booth->encode_queue = encode_queue_new (2);
+	booth->take_photo_encodes_pending = 0;
+	booth->take_photo_finishing = FALSE;
+	booth->take_photo_trace_start = 0;
+	
+	/* each deployment trades encoding time against print quality */
+	profile = g_getenv (JPEG_PROFILE_ENV);
+	if (profile == NULL ||
+	    jpeg_profile_lookup (profile, &booth->jpeg_profile) != 0)
+	{
+	    if (profile != NULL)
+	    {
+	        g_warning ("Unknown JPEG profile %s", profile);
+	    }
+	    jpeg_profile_lookup ("default", &booth->jpeg_profile);
+	}
+	
+	/* MJPEG carries larger frames over the same USB bandwidth */
+	format = g_getenv (CAMERA_FORMAT_ENV);
+	booth->camera_format = YUYV;
+	if (format != NULL && g_ascii_strcasecmp (format, "mjpeg") == 0)
+	{
+	    booth->camera_format = MJPEG;
+	}
+	else if (format != NULL && g_ascii_strcasecmp (format, "yuyv") != 0)
+	{
+	    g_warning ("Unknown camera format %s", format);
+	}
+	
+	/* with buffers of our own the driver writes where the encoder reads */
+	memory = g_getenv (CAMERA_MEMORY_ENV);
+	booth->camera_memory = V4L2_MEMORY_MMAP;
+	if (memory != NULL && g_ascii_strcasecmp (memory, "userptr") == 0)
+	{
+	    booth->camera_memory = V4L2_MEMORY_USERPTR;
+	}
+	else if (memory != NULL && g_ascii_strcasecmp (memory, "dmabuf") == 0)
+	{
+	    booth->camera_memory = V4L2_MEMORY_DMABUF;
+	}
+	else if (memory != NULL && g_ascii_strcasecmp (memory, "mmap") != 0)
+	{
+	    g_warning ("Unknown camera memory %s", memory);
+	}
+	
+	/* a recorded session replays without camera, e.g. for benchmarks */
+	booth->camera_location = g_getenv (CAMERA_ENV);
+	if (booth->camera_location == NULL)
+	{
+	    booth->camera_location = CAMERA_LOCATION;
+	}
+	booth->camera_record = g_getenv (CAMERA_RECORD_ENV);
+	
+	/* to tell a slow camera from a slow bus or a slow booth */
+	booth->camera_stats = g_getenv (CAMERA_STATS_ENV) != NULL;
+	
+	/* no effects are computed yet */
+	booth->effects_generation = 0;
+	memset (booth->effects_jobs, 0, sizeof (booth->effects_jobs));
+	effects_reset (booth);
+	
+	/* decode the texture once, tiled at the size of the photos of the
+	 * camera format, the texture effect is unavailable without it */
+	if (texture_cache_init (TEXTURE_FILE,
+	    booth->camera_format == MJPEG ? MJPEG_WIDTH : HR_WIDTH,
+	    booth->camera_format == MJPEG ? MJPEG_HEIGHT : HR_HEIGHT,
+	    &err) == FALSE)
+	{
+	    g_warning ("%s", err->message);
+	    g_clear_error (&err);
+	}
+	
 	/* initialize the user image options */
 	booth->selected_image_index = 0;
 	booth->selected_effect_enum = NONE;
@@ -192,6 +291,11 @@ gboolean init_app (DigitalPhotoBooth *booth)
 	/* clear the image filename storage area */
 	memset (booth->photos_filenames, 0,
 	    NUM_PHOTOS * NUM_PHOTO_STYLES * NUM_PHOTO_SIZES * MAX_STRING_LENGTH);
+	
+	/* nothing is decoded yet */
+	memset (booth->image_cache, 0, sizeof (booth->image_cache));
+	booth->image_cache_bytes = 0;
+	booth->image_cache_clock = 0;
 	    
     /* get the location of the system temp directory */
     booth->tempdir = g_get_tmp_dir ();
@@ -331,7 +435,8 @@ void app_timeout_cleanup (DigitalPhotoBooth *booth)
  *  Description:    Process the application timeout
  *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
  *  Outputs:        TRUE to schedule the task again, FALSE otherwise
- *  Routines Called: take_photo_cleanup, gtk_notebook_set_current_page
+ *  Routines Called: take_photo_cleanup, effects_reset,
+ *                  gtk_notebook_set_current_page
  *
  *****************************************************************************/
 gboolean app_timeout_idle (DigitalPhotoBooth *booth)
@@ -346,6 +451,10 @@ gboolean app_timeout_idle (DigitalPhotoBooth *booth)
         
         take_photo_cleanup (booth);
         
+        /* the customer left: drop every effect, and make the photos
+         * still being encoded start none */
+        effects_reset (booth);
+        
         gtk_notebook_set_current_page ((GtkNotebook*)booth->wizard_panel, 0);
         
         return FALSE;
@@ -389,6 +498,214 @@ gchar* get_image_filename_pointer (guint index, enum PHOTO_STYLE pstyle,
 
 /* Functions for the first screen */
 
+/******************************************************************************
+ *
+ *  Function:       image_cache_lookup
+ *  Description:    This function returns a decoded image for display. The
+ *                  images made by the pipeline are in the cache already,
+ *                  others are read from their file once.
+ *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
+ *                  index - the index of the image
+ *                  pstyle - the effect of the image
+ *                  psize - the size of the image
+ *  Outputs:        the image, owned by the cache, or NULL on failure
+ *  Routines Called: get_image_filename_pointer, traceBegin,
+ *                  gdk_pixbuf_new_from_file, traceEnd, image_cache_insert
+ *
+ *****************************************************************************/
+GdkPixbuf* image_cache_lookup (DigitalPhotoBooth *booth, guint index,
+    enum PHOTO_STYLE pstyle, enum PHOTO_SIZE psize)
+{
+    guint slot = index * NUM_PHOTO_STYLES * NUM_PHOTO_SIZES
+        + pstyle * NUM_PHOTO_SIZES + psize;
+    gchar *filename;
+    GdkPixbuf *pixbuf;
+    gint64 start;
+    
+    /* make sure the parameters are valid */
+    if (index >= NUM_PHOTOS || pstyle >= NUM_PHOTO_STYLES
+        || psize >= NUM_PHOTO_SIZES)
+    {
+        return NULL;
+    }
+    
+    /* mark the image as the most recently used one */
+    if (booth->image_cache[slot] != NULL)
+    {
+        booth->image_cache_used[slot] = ++booth->image_cache_clock;
+        return booth->image_cache[slot];
+    }
+    
+    /* the image was evicted, or never made by this program */
+    filename = get_image_filename_pointer (index, pstyle, psize, booth);
+    if (filename[0] == '\0')
+    {
+        return NULL;
+    }
+    start = traceBegin ();
+    pixbuf = gdk_pixbuf_new_from_file (filename, NULL);
+    traceEnd ("gdk_pixbuf_new_from_file", start);
+    if (pixbuf == NULL)
+    {
+        return NULL;
+    }
+    
+    image_cache_insert (booth, slot, pixbuf);
+    
+    return pixbuf;
+}
+
+/******************************************************************************
+ *
+ *  Function:       image_cache_store
+ *  Description:    This function keeps an image made by the pipeline, so
+ *                  that the screens never decode its file.
+ *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
+ *                  index - the index of the image
+ *                  pstyle - the effect of the image
+ *                  psize - the size of the image
+ *                  frame - the RGB24 image, the cache takes it over
+ *  Outputs:        
+ *  Routines Called: vidFrameRelease, gdk_pixbuf_new_from_data,
+ *                  image_cache_insert
+ *
+ *****************************************************************************/
+void image_cache_store (DigitalPhotoBooth *booth, guint index,
+    enum PHOTO_STYLE pstyle, enum PHOTO_SIZE psize, VidFrame *frame)
+{
+    GdkPixbuf *pixbuf;
+    
+    /* make sure the parameters are valid */
+    if (index >= NUM_PHOTOS || pstyle >= NUM_PHOTO_STYLES
+        || psize >= NUM_PHOTO_SIZES || frame->format != V4L2_PIX_FMT_RGB24)
+    {
+        vidFrameRelease (&frame);
+        return;
+    }
+    
+    /* share the pixels of the frame, they are freed with the pixbuf */
+    pixbuf = gdk_pixbuf_new_from_data (vidFrameGetImageData (frame),
+        GDK_COLORSPACE_RGB, FALSE, 8, frame->size.width, frame->size.height,
+        frame->bytesperline, (GdkPixbufDestroyNotify)image_cache_frame_free,
+        frame);
+    
+    image_cache_insert (booth, index * NUM_PHOTO_STYLES * NUM_PHOTO_SIZES
+        + pstyle * NUM_PHOTO_SIZES + psize, pixbuf);
+}
+
+/******************************************************************************
+ *
+ *  Function:       image_cache_insert
+ *  Description:    This function puts an image in a slot of the cache, and
+ *                  evicts the least recently used images until the cache
+ *                  fits in IMAGE_CACHE_BUDGET again.
+ *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
+ *                  slot - the slot of the image, indexed like
+ *                  photos_filenames
+ *                  pixbuf - the image, the cache takes it over
+ *  Outputs:        
+ *  Routines Called: image_cache_drop, gdk_pixbuf_get_rowstride,
+ *                  gdk_pixbuf_get_height
+ *
+ *****************************************************************************/
+void image_cache_insert (DigitalPhotoBooth *booth, guint slot,
+    GdkPixbuf *pixbuf)
+{
+    guint i, oldest;
+    
+    image_cache_drop (booth, slot);
+    
+    booth->image_cache[slot] = pixbuf;
+    booth->image_cache_used[slot] = ++booth->image_cache_clock;
+    booth->image_cache_bytes += gdk_pixbuf_get_rowstride (pixbuf) *
+        gdk_pixbuf_get_height (pixbuf);
+    
+    while (booth->image_cache_bytes > IMAGE_CACHE_BUDGET)
+    {
+        /* find the least recently used image, other than the new one */
+        oldest = slot;
+        for (i = 0; i < NUM_PHOTOS * NUM_PHOTO_STYLES * NUM_PHOTO_SIZES; i++)
+        {
+            if (i != slot && booth->image_cache[i] != NULL &&
+                (oldest == slot ||
+                booth->image_cache_used[i] < booth->image_cache_used[oldest]))
+            {
+                oldest = i;
+            }
+        }
+        
+        /* the new image is kept even if it is alone over the budget */
+        if (oldest == slot)
+        {
+            break;
+        }
+        
+        image_cache_drop (booth, oldest);
+    }
+}
+
+/******************************************************************************
+ *
+ *  Function:       image_cache_drop
+ *  Description:    This function removes an image from the cache. Widgets
+ *                  showing it keep their own reference.
+ *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
+ *                  slot - the slot of the image
+ *  Outputs:        
+ *  Routines Called: gdk_pixbuf_get_rowstride, gdk_pixbuf_get_height,
+ *                  g_object_unref
+ *
+ *****************************************************************************/
+void image_cache_drop (DigitalPhotoBooth *booth, guint slot)
+{
+    GdkPixbuf *pixbuf = booth->image_cache[slot];
+    
+    if (pixbuf != NULL)
+    {
+        booth->image_cache_bytes -= gdk_pixbuf_get_rowstride (pixbuf) *
+            gdk_pixbuf_get_height (pixbuf);
+        g_object_unref (pixbuf);
+        booth->image_cache[slot] = NULL;
+    }
+}
+
+/******************************************************************************
+ *
+ *  Function:       image_cache_clear
+ *  Description:    This function empties the cache, when the photos are
+ *                  taken again.
+ *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
+ *  Outputs:        
+ *  Routines Called: image_cache_drop
+ *
+ *****************************************************************************/
+void image_cache_clear (DigitalPhotoBooth *booth)
+{
+    guint slot;
+    
+    for (slot = 0; slot < NUM_PHOTOS * NUM_PHOTO_STYLES * NUM_PHOTO_SIZES;
+        slot++)
+    {
+        image_cache_drop (booth, slot);
+    }
+}
+
+/******************************************************************************
+ *
+ *  Function:       image_cache_frame_free
+ *  Description:    Callback function which releases the frame holding the
+ *                  pixels of a cached image.
+ *  Inputs:         pixels - the pixels of the image
+ *                  frame - the frame holding them
+ *  Outputs:        
+ *  Routines Called: vidFrameRelease
+ *
+ *****************************************************************************/
+void image_cache_frame_free (guchar *pixels, VidFrame *frame)
+{
+    vidFrameRelease (&frame);
+}
+
 /******************************************************************************
  *
  *  Function:       money_insert
@@ -546,7 +863,11 @@ void on_money_forward_button_clicked (GtkWidget *button,
  *  Description:    Initialize the second screen to take the photos
  *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
  *  Outputs:        
- *  Routines Called: open_camera, g_idle_add, v42lCaptureStartStreaming
+ *  Routines Called: open_camera_at, v4l2CaptureStartStreamingMemory,
+ *                  v42lCaptureStartStreaming, v4l2CaptureStartRecording,
+ *                  v4l2CaptureSetHistory, v4l2CaptureStartThread,
+ *                  effects_reset, image_cache_clear,
+ *                  take_photo_live_feed_start
  *
  *****************************************************************************/
 void take_photo_init (DigitalPhotoBooth *booth)
@@ -554,21 +875,49 @@ void take_photo_init (DigitalPhotoBooth *booth)
     /* make sure camera is not already open and open if necessary */
     if (booth->capture == NULL)
     {
-        booth->capture = open_camera();
+        booth->capture = open_camera_at (booth->camera_location,
+            booth->camera_format);
     }
     
-    /* start the video stream */
+    /* start the video stream with all buffers queued, enough for the
+     * frames kept for the photo, and the thread which reads it, so that
+     * the GUI never waits for the camera */
     if (booth->capture != NULL)
     {
-        v4l2CaptureStartStreaming (booth->capture, 0, 4);
+        if (v4l2CaptureStartStreamingMemory (booth->capture, 1,
+                ZSL_FRAMES + V4L2_THREAD_BUFFERS,
+                booth->camera_memory) != 0 &&
+            booth->camera_memory != V4L2_MEMORY_MMAP)
+        {
+            /* not every driver takes our buffers */
+            g_warning ("The camera can't use the requested memory, "
+                       "falling back to mmap");
+            v4l2CaptureStartStreaming (booth->capture, 1,
+                ZSL_FRAMES + V4L2_THREAD_BUFFERS);
+        }
+        
+        if (booth->camera_record != NULL &&
+            v4l2CaptureStartRecording (booth->capture,
+                booth->camera_record) != 0)
+        {
+            g_warning ("Can't record the camera to %s", booth->camera_record);
+        }
+        
+        /* keep the last frames so the photo can be taken from the moment
+         * the countdown ended */
+        v4l2CaptureSetHistory (booth->capture, ZSL_FRAMES);
+        v4l2CaptureStartThread (booth->capture);
     }
     
     /* reset the number of photos taken this session to 0 */
     booth->num_photos_taken = 0;
+    
+    /* the effects of the previous photos are not needed anymore */
+    effects_reset (booth);
+    image_cache_clear (booth);
 	
-	/* start a idle source which updates the drawing area */
-    booth->take_photo_video_source = g_idle_add
-        ((GSourceFunc)take_photo_live_feed_idle, booth);
+	/* start updating the drawing area */
+    take_photo_live_feed_start (booth);
 }
 
 /******************************************************************************
@@ -596,6 +945,12 @@ void take_photo_cleanup (DigitalPhotoBooth *booth)
         booth->take_photo_timer_source = 0;
     }
     
+    /* don't leave the screen when the pending photos are written */
+    booth->take_photo_finishing = FALSE;
+    
+    /* the session was abandoned, it doesn't end with the thumbnails */
+    booth->take_photo_trace_start = 0;
+    
     /* make sure the camera was open and stop streaming */
     if (booth->capture != NULL)
     {
@@ -616,49 +971,132 @@ void take_photo_cleanup (DigitalPhotoBooth *booth)
  *****************************************************************************/
 void take_photo_free_frame (guchar *pixels, VidFrame *frame)
 {
-    /* release the received video frame */
+    /* release the received video frame, its buffer goes back to the
+     * frame pool for the next one */
     vidFrameRelease (&frame);
 }
 
+/******************************************************************************
+ *
+ *  Function:       take_photo_live_feed_start
+ *  Description:    Start updating the drawing area with the video stream.
+ *                  The update runs whenever the camera has a new frame.
+ *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
+ *  Outputs:        
+ *  Routines Called: v4l2CaptureCreateSource, g_source_set_callback,
+ *                  g_source_attach, g_source_unref
+ *
+ *****************************************************************************/
+void take_photo_live_feed_start (DigitalPhotoBooth *booth)
+{
+    GSource *source;
+
+    /* nothing to show without a camera */
+    if (booth->capture == NULL)
+    {
+        return;
+    }
+
+    /* create a source which is ready when the camera has a new frame */
+    source = v4l2CaptureCreateSource (booth->capture);
+    g_source_set_callback (source, (GSourceFunc)take_photo_live_feed_idle,
+        booth, NULL);
+
+    /* attach it to the main loop and keep the id to remove it later */
+    booth->take_photo_video_source = g_source_attach (source, NULL);
+    g_source_unref (source);
+}
+
 /******************************************************************************
  *
  *  Function:       take_photo_live_feed_idle
- *  Description:    Callback function which gets a video frame, resizes it,
- *                  and displays it.
+ *  Description:    Callback function which gets a video frame scaled to the
+ *                  display size and displays it. Called when the camera
+ *                  source reports a new frame.
  *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
  *  Outputs:        TRUE to schedule the task again, FALSE otherwise
- *  Routines Called: getFrame, gdk_pixbuf_new_from_data, vidFrameGetImageData,
- *                  gdk_pixbuf_scale_simple, gdk_draw_pixbuf, g_object_unref
+ *  Routines Called: getPreviewFrame, gdk_pixbuf_new_from_data,
+ *                  vidFrameGetImageData, gdk_draw_pixbuf, g_object_unref,
+ *                  take_photo_draw_stats
  *
  *****************************************************************************/
 gboolean take_photo_live_feed_idle (DigitalPhotoBooth *booth)
 {
-    /* get the current RGB frame */
-	VidFrame *frame = getFrame (booth->capture);
+    /* the size of the video display */
+    VidSize size;
+    size.width = LR_WIDTH;
+    size.height = LR_HEIGHT;
+
+    /* get the newest RGB frame, already scaled to the display size */
+	VidFrame *frame = getPreviewFrame (booth->capture, size);
+
+    /* nothing to do until the camera delivers a new frame */
+    if (frame == NULL)
+    {
+        return TRUE;
+    }
 	
 	/* put the frame in a pixel buffer */
 	GdkPixbuf *buf = gdk_pixbuf_new_from_data (vidFrameGetImageData(frame),
-        GDK_COLORSPACE_RGB, FALSE, 8, HR_WIDTH, HR_HEIGHT, HR_WIDTH * 3,
+        GDK_COLORSPACE_RGB, FALSE, 8, LR_WIDTH, LR_HEIGHT, LR_WIDTH * 3,
         (GdkPixbufDestroyNotify)take_photo_free_frame, frame);
 	
-	/* resize the original image using a very cheap algorithm */
-	GdkPixbuf *resized = gdk_pixbuf_scale_simple (buf, LR_WIDTH, LR_HEIGHT,
-        GDK_INTERP_NEAREST);
-	
-	/* draw the resized image on the screen */
+	/* draw the image on the screen */
 	gdk_draw_pixbuf (booth->videobox->window, booth->videobox->style->white_gc,
-        resized, 0, 0, 0, 0, LR_WIDTH, LR_HEIGHT, GDK_RGB_DITHER_NONE, 0, 0);
+        buf, 0, 0, 0, 0, LR_WIDTH, LR_HEIGHT, GDK_RGB_DITHER_NONE, 0, 0);
 	
-	/* remove a reference from the original buffer (should destroy it) */
+	/* remove a reference from the buffer (should destroy it) */
 	g_object_unref(buf);
-
-	/* remove a reference from the resized buffer (should destroy it) */
-	g_object_unref(resized);
+    
+    /* show how the camera keeps up, if asked to */
+    if (booth->camera_stats)
+    {
+        take_photo_draw_stats (booth);
+    }
 
     /* return true to cause the task to be constantly scheduled */
     return TRUE;
 }
 
+/******************************************************************************
+ *
+ *  Function:       take_photo_draw_stats
+ *  Description:    Draws the statistics of the camera over the video: the
+ *                  delivered frame rate, the frames dropped before they
+ *                  reached us and those we skipped, the time waiting for
+ *                  the camera and the time converting a frame.
+ *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
+ *  Outputs:        
+ *  Routines Called: v4l2CaptureGetStats, g_snprintf,
+ *                  gtk_widget_create_pango_layout,
+ *                  pango_layout_get_pixel_size, gdk_draw_rectangle,
+ *                  gdk_draw_layout, g_object_unref
+ *
+ *****************************************************************************/
+void take_photo_draw_stats (DigitalPhotoBooth *booth)
+{
+    V4L2CaptureStats stats;
+    PangoLayout *layout;
+    gchar text[160];
+    gint width, height;
+    
+    v4l2CaptureGetStats (booth->capture, &stats);
+    g_snprintf (text, sizeof (text),
+        "%.1f fps, %lu dropped, %lu skipped\n"
+        "wait %.1f ms (max %.1f), convert %.1f ms (max %.1f)",
+        stats.fps, stats.dropped, stats.skipped, stats.wait_ms,
+        stats.wait_max_ms, stats.convert_ms, stats.convert_max_ms);
+    
+    /* white text on a black box, in the top left corner */
+    layout = gtk_widget_create_pango_layout (booth->videobox, text);
+    pango_layout_get_pixel_size (layout, &width, &height);
+    gdk_draw_rectangle (booth->videobox->window,
+        booth->videobox->style->black_gc, TRUE, 0, 0, width + 8, height + 4);
+    gdk_draw_layout (booth->videobox->window,
+        booth->videobox->style->white_gc, 4, 2, layout);
+    g_object_unref (layout);
+}
+
 /******************************************************************************
  *
  *  Function:       take_photo_process
@@ -666,9 +1104,10 @@ gboolean take_photo_live_feed_idle (DigitalPhotoBooth *booth)
  *                  the video stream.
  *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
  *  Outputs:        TRUE to schedule the task again, FALSE otherwise
- *  Routines Called: get_image_filename_pointer, g_sprintf, capture_hr_jpg,
- *                  image_resize, g_idle_add, take_photo_timer_start,
- *                  gtk_widget_hide, gtk_widget_show
+ *  Routines Called: get_image_filename_pointer, g_sprintf, g_slice_new0,
+ *                  capture_hr_frame, encode_queue_push,
+ *                  take_photo_live_feed_start, take_photo_timer_start,
+ *                  v4l2CaptureStopStreaming, gtk_progress_bar_set_text
  *
  *****************************************************************************/
 gboolean take_photo_process (DigitalPhotoBooth *booth)
@@ -698,19 +1137,72 @@ gboolean take_photo_process (DigitalPhotoBooth *booth)
         g_sprintf (filename_lg, "%s/img%04d_lg.jpg", booth->tempdir,
             booth->num_photos_taken);
         
-        /* capture a frame and convert it to jpg */
-        capture_hr_jpg (booth->capture, filename, 85);
+        /* remember which photo is being encoded */
+        PhotoEncode *encode = g_slice_new0 (PhotoEncode);
+        encode->booth = booth;
+        encode->index = booth->num_photos_taken;
+        encode->generation = booth->effects_generation;
+        encode->result = 0;
+        
+        /* get the frame taken when the countdown ended */
+        VidFrame *frame = capture_hr_frame (booth->capture,
+            &booth->take_photo_deadline);
         
-        /* spawn a process to resize the output images for display */
-        image_resize (filename, filename_sm, "160x120", NULL);
-        image_resize (filename, filename_lg, "640x480", NULL);
+        /* the photo keeps the size of the frame, which depends on the
+         * camera format */
+        VidSize full = { HR_WIDTH, HR_HEIGHT };
+        if (frame != NULL)
+        {
+            full = frame->size;
+        }
+        
+        /* the photo and the sizes used for display, which are kept for
+         * the image cache */
+        EncodeOutput outputs[3] = {
+            { filename, full, NULL },
+            { filename_sm, { 160, 120 }, &encode->images[SMALL] },
+            { filename_lg, { LR_WIDTH, LR_HEIGHT }, &encode->images[LARGE] } };
+        
+        /* the driver may pick another aspect ratio than asked, fit the
+         * sizes used for display in their box without stretching the
+         * photo, like write_resized_jpg does */
+        guint i;
+        for (i = 1; i < 3; i++)
+        {
+            VidSize box = outputs[i].size;
+            outputs[i].size.height = (full.height * box.width + full.width / 2)
+                / full.width;
+            if (outputs[i].size.height > box.height)
+            {
+                outputs[i].size.height = box.height;
+                outputs[i].size.width = (full.width * box.height
+                    + full.height / 2) / full.height;
+            }
+            if (outputs[i].size.width < 1) outputs[i].size.width = 1;
+            if (outputs[i].size.height < 1) outputs[i].size.height = 1;
+        }
+        
+        /* convert it to jpg in the background, the queue owns the frame */
+        if (encode_queue_push (booth->encode_queue, frame,
+            &booth->jpeg_profile, outputs, 3,
+            (EncodeDoneFunc)take_photo_encode_done, encode) == 0)
+        {
+            booth->take_photo_encodes_pending++;
+        }
+        else
+        {
+            g_slice_free (PhotoEncode, encode);
+            if (frame != NULL)
+            {
+                vidFrameRelease (&frame);
+            }
+        }
         
         /* pre-increment num_photos_taken */
         if (++booth->num_photos_taken < NUM_PHOTOS)
         {
-            /* create an idle source which updates the drawing area */
-            booth->take_photo_video_source = g_idle_add
-                ((GSourceFunc)take_photo_live_feed_idle, booth);
+            /* restart the updates of the drawing area */
+            take_photo_live_feed_start (booth);
             
             /* start another countdown timer */
             take_photo_timer_start(booth);
@@ -723,15 +1215,17 @@ gboolean take_photo_process (DigitalPhotoBooth *booth)
                 v4l2CaptureStopStreaming (booth->capture);
             }
             
-            /* hide the progress bar, show the take photo button */
-            gtk_widget_hide (booth->take_photo_progress);
-            gtk_widget_show (booth->take_photo_button);
+            /* tell the user what's happening */
+            gtk_progress_bar_set_text (
+                (GtkProgressBar*)booth->take_photo_progress,
+                "Please wait, the photos are being processed");
             
-            /* initialize the next screen */
-            preview_init (booth);
-
-            /* switch to the next panel */
-            gtk_notebook_next_page ((GtkNotebook*)booth->wizard_panel);
+            /* leave the screen once the last photo is written */
+            booth->take_photo_finishing = TRUE;
+            if (booth->take_photo_encodes_pending == 0)
+            {
+                take_photo_finish (booth);
+            }
         }
     }
 
@@ -739,6 +1233,116 @@ gboolean take_photo_process (DigitalPhotoBooth *booth)
     return FALSE;
 }
 
+/******************************************************************************
+ *
+ *  Function:       take_photo_encode_done
+ *  Description:    Called by an encoding thread when a photo and its resized
+ *                  copies are written. Passes the event to the main loop.
+ *  Inputs:         result - 0 on success, nonzero if a file wasn't written
+ *                  encode - the PhotoEncode of the photo
+ *  Outputs:        
+ *  Routines Called: g_warning, g_idle_add
+ *
+ *****************************************************************************/
+void take_photo_encode_done (int result, PhotoEncode *encode)
+{
+    /* report failures, the preview will show what was written */
+    if (result != 0)
+    {
+        g_warning ("A photo could not be written");
+    }
+    
+    /* widgets may only be touched from the main loop */
+    encode->result = result;
+    g_idle_add ((GSourceFunc)take_photo_encode_complete_idle, encode);
+}
+
+/******************************************************************************
+ *
+ *  Function:       take_photo_encode_complete_idle
+ *  Description:    Callback function which counts the finished photos and
+ *                  moves to the next screen once the last one is written.
+ *                  The effects of each photo start as soon as it is written.
+ *  Inputs:         encode - the PhotoEncode of the photo
+ *  Outputs:        TRUE to schedule the task again, FALSE otherwise
+ *  Routines Called: effects_photo_ready, image_cache_store,
+ *                  vidFrameRelease, g_slice_free, take_photo_finish
+ *
+ *****************************************************************************/
+gboolean take_photo_encode_complete_idle (PhotoEncode *encode)
+{
+    DigitalPhotoBooth *booth = encode->booth;
+    guint size;
+    
+    /* one photo less to wait for */
+    booth->take_photo_encodes_pending--;
+    
+    /* compute the effects ahead, unless the photo was taken again since */
+    if (encode->result == 0 && encode->generation == booth->effects_generation)
+    {
+        effects_photo_ready (booth, encode->index);
+    }
+    
+    /* keep the copies shown by the screens */
+    for (size = 0; size < NUM_PHOTO_SIZES; size++)
+    {
+        if (encode->images[size] == NULL)
+        {
+            continue;
+        }
+        if (encode->result == 0 &&
+            encode->generation == booth->effects_generation)
+        {
+            image_cache_store (booth, encode->index, NONE, size,
+                encode->images[size]);
+        }
+        else
+        {
+            vidFrameRelease (&encode->images[size]);
+        }
+    }
+    g_slice_free (PhotoEncode, encode);
+    
+    /* all photos were taken and are now written */
+    if (booth->take_photo_finishing && booth->take_photo_encodes_pending == 0)
+    {
+        take_photo_finish (booth);
+    }
+    
+    /* return false to cause no further scheduling to occur */
+    return FALSE;
+}
+
+/******************************************************************************
+ *
+ *  Function:       take_photo_finish
+ *  Description:    Leave the take photo screen once all photos are written
+ *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
+ *  Outputs:        
+ *  Routines Called: gtk_widget_hide, gtk_widget_show, preview_init,
+ *                  traceEnd, gtk_notebook_next_page
+ *
+ *****************************************************************************/
+void take_photo_finish (DigitalPhotoBooth *booth)
+{
+    booth->take_photo_finishing = FALSE;
+    
+    /* hide the progress bar, show the take photo button */
+    gtk_widget_hide (booth->take_photo_progress);
+    gtk_widget_show (booth->take_photo_button);
+    
+    /* initialize the next screen */
+    preview_init (booth);
+    
+    /* the thumbnails are shown, the session span started with the first
+     * press of the take photo button */
+    traceEnd ("take_photo_session", booth->take_photo_trace_start);
+    booth->take_photo_trace_start = 0;
+
+    /* switch to the next panel */
+    gtk_notebook_next_page ((GtkNotebook*)booth->wizard_panel);
+}
+
 /******************************************************************************
  *
  *  Function:       take_photo_timer_start
@@ -781,7 +1385,7 @@ void take_photo_timer_start (DigitalPhotoBooth *booth)
  *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
  *  Outputs:        TRUE to schedule the task again, FALSE otherwise
  *  Routines Called: gtk_progress_bar_set_fraction, g_sprintf, g_source_remove
- *                  gtk_progress_bar_set_text, g_idle_add
+ *                  gtk_progress_bar_set_text, g_idle_add, v4l2CaptureGetTime
  *
  *****************************************************************************/
 gboolean take_photo_timer_process (DigitalPhotoBooth *booth)
@@ -812,6 +1416,13 @@ gboolean take_photo_timer_process (DigitalPhotoBooth *booth)
     }
     else
     {
+        /* remember the moment the countdown ended, the photo is the frame
+         * the camera took at that time */
+        if (booth->capture != NULL)
+        {
+            v4l2CaptureGetTime (booth->capture, &booth->take_photo_deadline);
+        }
+        
         /* create the progress bar text */
         g_sprintf (label, "Please don't move, the photo is being captured");
             
@@ -841,7 +1452,8 @@ gboolean take_photo_timer_process (DigitalPhotoBooth *booth)
  *  Inputs:         button - a pointer to the button object
  *                  booth - a pointer to the DigitalPhotoBooth struct
  *  Outputs:        
- *  Routines Called: gtk_widget_hide, gtk_widget_show, timer_start
+ *  Routines Called: traceInstant, traceBegin, gtk_widget_hide,
+ *                  gtk_widget_show, timer_start
  *
  *****************************************************************************/
 void on_take_photo_button_clicked (GtkWidget *button, DigitalPhotoBooth *booth)
@@ -849,6 +1461,13 @@ void on_take_photo_button_clicked (GtkWidget *button, DigitalPhotoBooth *booth)
     /* reset the application timeout */
     app_timeout_reset (booth);
     
+    /* mark every press, time the session from the first one */
+    traceInstant ("take_photo_button");
+    if (booth->take_photo_trace_start == 0)
+    {
+        booth->take_photo_trace_start = traceBegin ();
+    }
+    
     /* hide the take photo button and show the progress bar */
     gtk_widget_hide (booth->take_photo_button);
     gtk_widget_show (booth->take_photo_progress);
@@ -866,8 +1485,9 @@ void on_take_photo_button_clicked (GtkWidget *button, DigitalPhotoBooth *booth)
  *  Description:    Initialize the third screen to preview the photos
  *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
  *  Outputs:        
- *  Routines Called: get_image_filename_pointer, gdk_pixbuf_new_from_file,
- *                  gtk_image_set_from_pixbuf, preview_update_image
+ *  Routines Called: image_cache_lookup, gtk_image_set_from_pixbuf,
+ *                  effects_queue,
+ *                  preview_update_image
  *
  *****************************************************************************/
 void preview_init (DigitalPhotoBooth *booth)
@@ -876,29 +1496,28 @@ void preview_init (DigitalPhotoBooth *booth)
     booth->selected_image_index = 0;
 
     /* populate the first thumbnail with an image */
-    gchar *thumb1_filename =
-        get_image_filename_pointer (0, NONE, SMALL, booth);
     GdkPixbuf *thumb1_pixbuf =
-        gdk_pixbuf_new_from_file (thumb1_filename, NULL);
+        image_cache_lookup (booth, 0, NONE, SMALL);
     gtk_image_set_from_pixbuf ((GtkImage*)booth->preview_thumb1_image,
         thumb1_pixbuf);
 
     /* populate the second thumbnail with an image */
-    gchar *thumb2_filename =
-        get_image_filename_pointer (1, NONE, SMALL, booth);
     GdkPixbuf *thumb2_pixbuf =
-        gdk_pixbuf_new_from_file (thumb2_filename, NULL);
+        image_cache_lookup (booth, 1, NONE, SMALL);
     gtk_image_set_from_pixbuf ((GtkImage*)booth->preview_thumb2_image,
         thumb2_pixbuf);
 
     /* populate the third thumbnail with an image */
-    gchar *thumb3_filename =
-        get_image_filename_pointer (2, NONE, SMALL, booth);
     GdkPixbuf *thumb3_pixbuf =
-        gdk_pixbuf_new_from_file (thumb3_filename, NULL);
+        image_cache_lookup (booth, 2, NONE, SMALL);
     gtk_image_set_from_pixbuf ((GtkImage*)booth->preview_thumb3_image,
         thumb3_pixbuf);
 
+    /* compute the effects dropped when the customer moved on before */
+    effects_queue (booth, 0);
+    effects_queue (booth, 1);
+    effects_queue (booth, 2);
+
     /* populate the default preview image */
     preview_update_image (booth);
 }
@@ -906,27 +1525,26 @@ void preview_init (DigitalPhotoBooth *booth)
 /******************************************************************************
  *
  *  Function:       preview_update_image
- *  Description:    This function updates the larger preview image
+ *  Description:    This function updates the larger preview image, and
+ *                  computes the effects of the selected photo first
  *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
  *  Outputs:        
- *  Routines Called: get_image_filename_pointer, gdk_pixbuf_new_from_file,
- *                  gtk_image_set_from_pixbuf
+ *  Routines Called: image_cache_lookup, gtk_image_set_from_pixbuf,
+ *                  effects_prioritize
  *
  *****************************************************************************/
 void preview_update_image (DigitalPhotoBooth *booth)
 {
-    /* get a pointer to the currently selected images filename */
-    gchar *preview_filename =
-        get_image_filename_pointer (booth->selected_image_index, NONE, LARGE,
-        booth);
-    
-    /* load the image into a pixel buffer */
+    /* get the currently selected image */
     GdkPixbuf *preview_pixbuf =
-        gdk_pixbuf_new_from_file (preview_filename, NULL);
+        image_cache_lookup (booth, booth->selected_image_index, NONE, LARGE);
     
     /* set the image to the pixbuf content */
     gtk_image_set_from_pixbuf ((GtkImage*)booth->preview_large_image,
         preview_pixbuf);
+    
+    /* compute the effects of the selected photo first */
+    effects_prioritize (booth);
 }
 
 /******************************************************************************
@@ -1053,8 +1671,8 @@ void on_preview_thumb3_button_clicked (GtkWidget *button,
  *  Description:    Initialize the fourth screen to preview the effects
  *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
  *  Outputs:        
- *  Routines Called: gtk_image_set_from_stock, gtk_widget_set_sensitive,
- *                  effects_update_image
+ *  Routines Called: effects_queue, effects_thumb_update,
+ *                  effects_prioritize, effects_update_image
  *
  *****************************************************************************/
 void effects_init (DigitalPhotoBooth *booth)
@@ -1062,21 +1680,17 @@ void effects_init (DigitalPhotoBooth *booth)
     /* set the selected effect to NONE */
     booth->selected_effect_enum = NONE;
     
-    /* reset the thumbnails to stock imagery */
-    gtk_image_set_from_stock ((GtkImage*)booth->effects_thumb1_image,
-        "gtk-refresh", GTK_ICON_SIZE_BUTTON);
-    gtk_image_set_from_stock ((GtkImage*)booth->effects_thumb2_image,
-        "gtk-refresh", GTK_ICON_SIZE_BUTTON);
-    gtk_image_set_from_stock ((GtkImage*)booth->effects_thumb3_image,
-        "gtk-refresh", GTK_ICON_SIZE_BUTTON);
+    /* retry the effects of the selected photo which failed */
+    effects_queue (booth, booth->selected_image_index);
     
-    /* make the thumbnail buttons unavailable */
-    gtk_widget_set_sensitive (booth->effects_thumb1_button, FALSE);
-    gtk_widget_set_sensitive (booth->effects_thumb2_button, FALSE);
-    gtk_widget_set_sensitive (booth->effects_thumb3_button, FALSE);
-
-    /* add an idle function to spawn the child processes */
-    g_idle_add ((GSourceFunc)effects_init_idle, booth);
+    /* show the effects computed while the customer was choosing, the
+     * others appear as they complete */
+    effects_thumb_update (booth, OILBLOB);
+    effects_thumb_update (booth, CHARCOAL);
+    effects_thumb_update (booth, TEXTURE);
+    
+    /* compute the effects of the selected photo first */
+    effects_prioritize (booth);
 
     /* update the effects preview image */
     effects_update_image (booth);
@@ -1084,215 +1698,353 @@ void effects_init (DigitalPhotoBooth *booth)
 
 /******************************************************************************
  *
- *  Function:       effects_init_idle
- *  Description:    Callback function which processes creates the effects
- *                  images
+ *  Function:       effects_reset
+ *  Description:    This function forgets the effects of the previous
+ *                  photos, and cancels those still being computed.
  *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
- *  Outputs:        TRUE to schedule the task again, FALSE otherwise
- *  Routines Called: get_image_filename_pointer, g_sprintf,
- *                  create_oil_blob_image, g_child_watch_add,
- *                  create_charcoal_image, create_textured_image
+ *  Outputs:        
+ *  Routines Called: image_job_cancel
  *
  *****************************************************************************/
-gboolean effects_init_idle (DigitalPhotoBooth *booth)
+void effects_reset (DigitalPhotoBooth *booth)
 {
-    /* hold the pid value for the async calls */
-    GPid pid;
+    guint index, style;
     
-    /* get a pointer to the original filename */
-    gchar *filename = get_image_filename_pointer
-        (booth->selected_image_index, NONE, FULL, booth);
-    
-    /* get a pointer to each of the OILBLOB image filenames */
-    gchar *filename_ob = get_image_filename_pointer
-        (booth->selected_image_index, OILBLOB, FULL, booth);
-    gchar *filename_ob_sm = get_image_filename_pointer
-        (booth->selected_image_index, OILBLOB, SMALL, booth);
-    gchar *filename_ob_lg = get_image_filename_pointer
-        (booth->selected_image_index, OILBLOB, LARGE, booth);
-    
-    /* create the OILBLOB image filenames */
-    g_sprintf (filename_ob, "%s/img%04d_ob.jpg", booth->tempdir, 
-        booth->selected_image_index);
-    g_sprintf (filename_ob_sm, "%s/img%04d_ob_sm.jpg", booth->tempdir, 
-        booth->selected_image_index);
-    g_sprintf (filename_ob_lg, "%s/img%04d_ob_lg.jpg", booth->tempdir,
-        booth->selected_image_index);
-
-    /* spawn an async process and add a watch callback to it */
-    create_oil_blob_image (filename, filename_ob, &pid, NULL);
-    g_child_watch_add (pid, (GChildWatchFunc)effects_oilblob_complete, booth);
-    
-    /* get a pointer to each of the CHARCOAL image filenames */
-    gchar *filename_ch = get_image_filename_pointer
-        (booth->selected_image_index, CHARCOAL, FULL, booth);
-    gchar *filename_ch_sm = get_image_filename_pointer
-        (booth->selected_image_index, CHARCOAL, SMALL, booth);
-    gchar *filename_ch_lg = get_image_filename_pointer
-        (booth->selected_image_index, CHARCOAL, LARGE, booth);
-    
-    /* create the CHARCOAL image filenames */
-    g_sprintf (filename_ch, "%s/img%04d_ch.jpg", booth->tempdir,
-        booth->selected_image_index);
-    g_sprintf (filename_ch_sm, "%s/img%04d_ch_sm.jpg", booth->tempdir,
-        booth->selected_image_index);
-    g_sprintf (filename_ch_lg, "%s/img%04d_ch_lg.jpg", booth->tempdir,
-        booth->selected_image_index);
-    
-    /* spawn an async process and add a watch callback to it */
-    create_charcoal_image (filename, filename_ch, &pid, NULL);
-    g_child_watch_add (pid, (GChildWatchFunc)effects_charcoal_complete, booth);
-    
-    /* get a pointer to each of the TEXTURE image filenames */
-    gchar *filename_tx = get_image_filename_pointer
-        (booth->selected_image_index, TEXTURE, FULL, booth);
-    gchar *filename_tx_sm = get_image_filename_pointer
-        (booth->selected_image_index, TEXTURE, SMALL, booth);
-    gchar *filename_tx_lg = get_image_filename_pointer
-        (booth->selected_image_index, TEXTURE, LARGE, booth);
-    
-    /* create the TEXTURE image filenames */
-    g_sprintf (filename_tx, "%s/img%04d_tx.jpg", booth->tempdir,
-        booth->selected_image_index);
-    g_sprintf (filename_tx_sm, "%s/img%04d_tx_sm.jpg", booth->tempdir,
-        booth->selected_image_index);
-    g_sprintf (filename_tx_lg, "%s/img%04d_tx_lg.jpg", booth->tempdir,
-        booth->selected_image_index);
-    
-    /* spawn an async process and add a watch callback to it */
-    create_textured_image (filename, TEXTURE_FILE, filename_tx, &pid, NULL);
-    g_child_watch_add (pid, (GChildWatchFunc)effects_texture_complete, booth);
+    /* results of the previous generation are stale */
+    booth->effects_generation++;
     
-    return FALSE;
+    for (index = 0; index < NUM_PHOTOS; index++)
+    {
+        for (style = 0; style < NUM_PHOTO_STYLES; style++)
+        {
+            if (booth->effects_jobs[index][style] != 0)
+            {
+                image_job_cancel (booth->effects_jobs[index][style]);
+                booth->effects_jobs[index][style] = 0;
+            }
+            booth->effects_state[index][style] = EFFECT_UNAVAILABLE;
+        }
+    }
 }
 
 /******************************************************************************
  *
- *  Function:       effects_oilblob_complete
- *  Description:    Callback function for the oilblob process completion
- *  Inputs:         pid - the pid of the exiting process
- *                  status - the exit status of the process
- *                  booth - a pointer to the DigitalPhotoBooth struct
+ *  Function:       effects_photo_ready
+ *  Description:    This function starts computing the effects of a photo
+ *                  once it is written.
+ *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
+ *                  index - the index of the photo
  *  Outputs:        
- *  Routines Called: get_image_filename_pointer, image_resize,
- *                  gdk_pixbuf_new_from_file, gtk_image_set_from_pixbuf,
- *                  gtk_image_set_sensitive
+ *  Routines Called: effects_start
  *
  *****************************************************************************/
-void effects_oilblob_complete (GPid pid, gint status, DigitalPhotoBooth *booth)
+void effects_photo_ready (DigitalPhotoBooth *booth, guint index)
 {
-    /* reset the application timeout */
-    app_timeout_reset (booth);
-
-    if (gtk_notebook_get_current_page ((GtkNotebook*)booth->wizard_panel) >= 3)
+    guint style;
+    
+    for (style = OILBLOB; style < NUM_PHOTO_STYLES; style++)
     {
-        /* get a pointer to each of the image filenames */
-        gchar *in = get_image_filename_pointer(booth->selected_image_index,
-            OILBLOB, FULL, booth);
-        gchar *small = get_image_filename_pointer(booth->selected_image_index,
-            OILBLOB, SMALL, booth);
-        gchar *large = get_image_filename_pointer(booth->selected_image_index,
-            OILBLOB, LARGE, booth);
-        
-        /* resize the image */
-        image_resize (in, small, "160x120", NULL);
-        image_resize (in, large, "640x480", NULL);
-
-        /* assign the image to a thumbnail */    
-        GdkPixbuf *thumb1_pixbuf =
-            gdk_pixbuf_new_from_file (small, NULL);
-        gtk_image_set_from_pixbuf ((GtkImage*)booth->effects_thumb1_image,
-            thumb1_pixbuf);
+        effects_start (booth, index, style);
+    }
+}
 
-        /* make the image button available */
-        gtk_widget_set_sensitive (booth->effects_thumb1_button, TRUE);
+/******************************************************************************
+ *
+ *  Function:       effects_queue
+ *  Description:    This function starts again the effects of a written
+ *                  photo which were cancelled or failed.
+ *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
+ *                  index - the index of the photo
+ *  Outputs:        
+ *  Routines Called: effects_start
+ *
+ *****************************************************************************/
+void effects_queue (DigitalPhotoBooth *booth, guint index)
+{
+    guint style;
+    
+    for (style = OILBLOB; style < NUM_PHOTO_STYLES; style++)
+    {
+        if (booth->effects_state[index][style] == EFFECT_IDLE ||
+            booth->effects_state[index][style] == EFFECT_FAILED)
+        {
+            effects_start (booth, index, style);
+        }
     }
 }
 
 /******************************************************************************
  *
- *  Function:       effects_charcoal_complete
- *  Description:    Callback function for the charcoal process completion
- *  Inputs:         pid - the pid of the exiting process
- *                  status - the exit status of the process
- *                  booth - a pointer to the DigitalPhotoBooth struct
+ *  Function:       effects_cancel
+ *  Description:    This function cancels the effects which are not
+ *                  needed anymore, whether they are waiting or running.
+ *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
+ *                  keep - the index of the photo whose effects are still
+ *                  needed, NUM_PHOTOS to cancel them all
  *  Outputs:        
- *  Routines Called: get_image_filename_pointer, image_resize,
- *                  gdk_pixbuf_new_from_file, gtk_image_set_from_pixbuf,
- *                  gtk_image_set_sensitive
+ *  Routines Called: image_job_cancel
  *
  *****************************************************************************/
-void effects_charcoal_complete (GPid pid, gint status, 
-    DigitalPhotoBooth *booth)
+void effects_cancel (DigitalPhotoBooth *booth, guint keep)
 {
-    /* reset the application timeout */
-    app_timeout_reset (booth);
+    guint index, style;
+    
+    for (index = 0; index < NUM_PHOTOS; index++)
+    {
+        for (style = OILBLOB; style < NUM_PHOTO_STYLES; style++)
+        {
+            if (index != keep &&
+                booth->effects_state[index][style] == EFFECT_QUEUED)
+            {
+                image_job_cancel (booth->effects_jobs[index][style]);
+                booth->effects_jobs[index][style] = 0;
+                booth->effects_state[index][style] = EFFECT_IDLE;
+            }
+        }
+    }
+}
 
-    if (gtk_notebook_get_current_page ((GtkNotebook*)booth->wizard_panel) >= 3)
+/******************************************************************************
+ *
+ *  Function:       effects_prioritize
+ *  Description:    This function moves the waiting effects of the selected
+ *                  photo ahead of the others.
+ *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
+ *  Outputs:        
+ *  Routines Called: image_job_set_priority
+ *
+ *****************************************************************************/
+void effects_prioritize (DigitalPhotoBooth *booth)
+{
+    guint index, style;
+    
+    for (index = 0; index < NUM_PHOTOS; index++)
     {
-        /* get a pointer to each of the image filenames */
-        gchar *in = get_image_filename_pointer(booth->selected_image_index,
-            CHARCOAL, FULL, booth);
-        gchar *small = get_image_filename_pointer(booth->selected_image_index,
-            CHARCOAL, SMALL, booth);
-        gchar *large = get_image_filename_pointer(booth->selected_image_index,
-            CHARCOAL, LARGE, booth);
-        
-        /* resize the image */
-        image_resize (in, small, "160x120", NULL);
-        image_resize (in, large, "640x480", NULL);
-        
-        /* assign the image to a thumbnail */
-        GdkPixbuf *thumb2_pixbuf =
-            gdk_pixbuf_new_from_file (small, NULL);
-        gtk_image_set_from_pixbuf ((GtkImage*)booth->effects_thumb2_image,
-            thumb2_pixbuf);
+        for (style = OILBLOB; style < NUM_PHOTO_STYLES; style++)
+        {
+            if (booth->effects_state[index][style] == EFFECT_QUEUED)
+            {
+                image_job_set_priority (booth->effects_jobs[index][style],
+                    effects_priority (booth, index));
+            }
+        }
+    }
+}
 
-        /* make the image button available */
-        gtk_widget_set_sensitive (booth->effects_thumb2_button, TRUE);
+/******************************************************************************
+ *
+ *  Function:       effects_priority
+ *  Description:    This function gives the image job priority of the
+ *                  effects of a photo.
+ *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
+ *                  index - the index of the photo
+ *  Outputs:        the priority
+ *  Routines Called: 
+ *
+ *****************************************************************************/
+gint effects_priority (DigitalPhotoBooth *booth, guint index)
+{
+    return (index == booth->selected_image_index) ?
+        EFFECTS_PRIORITY_SELECTED : EFFECTS_PRIORITY_OTHER;
+}
+
+/******************************************************************************
+ *
+ *  Function:       effects_start
+ *  Description:    This function submits the image job computing an
+ *                  effect of a photo in the background.
+ *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
+ *                  index - the index of the photo
+ *                  style - the effect
+ *  Outputs:        
+ *  Routines Called: get_image_filename_pointer, g_sprintf,
+ *                  effects_priority, create_oil_blob_image,
+ *                  create_charcoal_image, create_textured_image
+ *
+ *****************************************************************************/
+void effects_start (DigitalPhotoBooth *booth, guint index,
+    enum PHOTO_STYLE style)
+{
+    /* the file name suffix of each effect */
+    static const gchar *suffixes[NUM_PHOTO_STYLES] = { "", "_ob", "_ch", "_tx" };
+    gint priority = effects_priority (booth, index);
+    guint id;
+    
+    /* get a pointer to the original filename */
+    gchar *filename = get_image_filename_pointer (index, NONE, FULL, booth);
+    
+    /* get a pointer to each of the effect image filenames */
+    gchar *filename_fx = get_image_filename_pointer (index, style, FULL,
+        booth);
+    gchar *filename_fx_sm = get_image_filename_pointer (index, style, SMALL,
+        booth);
+    gchar *filename_fx_lg = get_image_filename_pointer (index, style, LARGE,
+        booth);
+    
+    /* create the effect image filenames */
+    g_sprintf (filename_fx, "%s/img%04d%s.jpg", booth->tempdir, index,
+        suffixes[style]);
+    g_sprintf (filename_fx_sm, "%s/img%04d%s_sm.jpg", booth->tempdir, index,
+        suffixes[style]);
+    g_sprintf (filename_fx_lg, "%s/img%04d%s_lg.jpg", booth->tempdir, index,
+        suffixes[style]);
+    
+    /* compute the image and its copies in the background */
+    switch (style)
+    {
+        case OILBLOB:
+            id = create_oil_blob_image (filename, filename_fx,
+                filename_fx_sm, filename_fx_lg, priority,
+                (ImageJobDoneFunc)effects_job_complete, booth);
+            break;
+        case CHARCOAL:
+            id = create_charcoal_image (filename, filename_fx,
+                filename_fx_sm, filename_fx_lg, priority,
+                (ImageJobDoneFunc)effects_job_complete, booth);
+            break;
+        case TEXTURE:
+            id = create_textured_image (filename, filename_fx,
+                filename_fx_sm, filename_fx_lg, priority,
+                (ImageJobDoneFunc)effects_job_complete, booth);
+            break;
+        default:
+            id = 0;
+            break;
     }
+    
+    booth->effects_jobs[index][style] = id;
+    booth->effects_state[index][style] = (id != 0) ? EFFECT_QUEUED :
+        EFFECT_FAILED;
 }
 
 /******************************************************************************
  *
- *  Function:       effects_texture_complete
- *  Description:    Callback function for the texture process completion
- *  Inputs:         pid - the pid of the exiting process
- *                  status - the exit status of the process
+ *  Function:       effects_job_complete
+ *  Description:    Callback function for the end of an effect image job.
+ *                  Keeps the copies of the effect for display, and shows
+ *                  it if the customer is waiting for it.
+ *  Inputs:         id - the id of the image job
+ *                  status - how the image job ended
+ *                  small - the small copy of the effect, or NULL
+ *                  large - the large copy of the effect, or NULL
  *                  booth - a pointer to the DigitalPhotoBooth struct
  *  Outputs:        
- *  Routines Called: get_image_filename_pointer, image_resize,
- *                  gdk_pixbuf_new_from_file, gtk_image_set_from_pixbuf,
- *                  gtk_image_set_sensitive
+ *  Routines Called: vidFrameRelease, image_cache_store, app_timeout_reset,
+ *                  effects_thumb_update
  *
  *****************************************************************************/
-void effects_texture_complete (GPid pid, gint status, DigitalPhotoBooth *booth)
+void effects_job_complete (guint id, ImageJobStatus status,
+    VidFrame *small, VidFrame *large, DigitalPhotoBooth *booth)
 {
-    /* reset the application timeout */
-    app_timeout_reset (booth);
-
-    if (gtk_notebook_get_current_page ((GtkNotebook*)booth->wizard_panel) >= 3)
+    guint index, style;
+    gboolean found = FALSE;
+    
+    /* find the effect, cancelled jobs were forgotten already */
+    for (index = 0; index < NUM_PHOTOS && !found; index++)
     {
-        /* get a pointer to each of the image filenames */
-        gchar *in = get_image_filename_pointer(booth->selected_image_index,
-            TEXTURE, FULL, booth);
-        gchar *small = get_image_filename_pointer(booth->selected_image_index,
-            TEXTURE, SMALL, booth);
-        gchar *large = get_image_filename_pointer(booth->selected_image_index,
-            TEXTURE, LARGE, booth);
-        
-        /* resize the image */
-        image_resize (in, small, "160x120", NULL);
-        image_resize (in, large, "640x480", NULL);
+        for (style = OILBLOB; style < NUM_PHOTO_STYLES && !found; style++)
+        {
+            found = (booth->effects_jobs[index][style] == id);
+        }
+    }
+    if (!found)
+    {
+        if (small != NULL)
+        {
+            vidFrameRelease (&small);
+        }
+        if (large != NULL)
+        {
+            vidFrameRelease (&large);
+        }
+        return;
+    }
+    
+    /* the loops went one past the effect */
+    index--;
+    style--;
+    booth->effects_jobs[index][style] = 0;
+    booth->effects_state[index][style] =
+        (status == IMAGE_JOB_DONE) ? EFFECT_DONE : EFFECT_FAILED;
+    
+    /* the screens show these copies without reading the files */
+    if (small != NULL)
+    {
+        image_cache_store (booth, index, style, SMALL, small);
+    }
+    if (large != NULL)
+    {
+        image_cache_store (booth, index, style, LARGE, large);
+    }
+    
+    /* show it if the effects screen is up for this photo */
+    if (index == booth->selected_image_index &&
+        gtk_notebook_get_current_page (
+        (GtkNotebook*)booth->wizard_panel) == 3)
+    {
+        /* reset the application timeout */
+        app_timeout_reset (booth);
         
-        /* assign the image to a thumbnail */
-        GdkPixbuf *thumb3_pixbuf =
-            gdk_pixbuf_new_from_file (small, NULL);
-        gtk_image_set_from_pixbuf ((GtkImage*)booth->effects_thumb3_image,
-            thumb3_pixbuf);
+        effects_thumb_update (booth, style);
+    }
+}
+
+/******************************************************************************
+ *
+ *  Function:       effects_thumb_update
+ *  Description:    This function shows the thumbnail of an effect of the
+ *                  selected photo once it is computed, and makes its button
+ *                  available. Until then the button shows a stock image.
+ *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
+ *                  style - the effect
+ *  Outputs:        
+ *  Routines Called: image_cache_lookup, gtk_image_set_from_pixbuf,
+ *                  gtk_image_set_from_stock,
+ *                  gtk_widget_set_sensitive
+ *
+ *****************************************************************************/
+void effects_thumb_update (DigitalPhotoBooth *booth, enum PHOTO_STYLE style)
+{
+    GtkWidget *image;
+    GtkWidget *button;
+    
+    /* find the thumbnail of the effect */
+    switch (style)
+    {
+        case OILBLOB:
+            image = booth->effects_thumb1_image;
+            button = booth->effects_thumb1_button;
+            break;
+        case CHARCOAL:
+            image = booth->effects_thumb2_image;
+            button = booth->effects_thumb2_button;
+            break;
+        case TEXTURE:
+            image = booth->effects_thumb3_image;
+            button = booth->effects_thumb3_button;
+            break;
+        default:
+            return;
+    }
+    
+    if (booth->effects_state[booth->selected_image_index][style] == EFFECT_DONE)
+    {
+        /* assign the small image to a thumbnail */
+        GdkPixbuf *thumb_pixbuf = image_cache_lookup (booth,
+            booth->selected_image_index, style, SMALL);
+        gtk_image_set_from_pixbuf ((GtkImage*)image, thumb_pixbuf);
         
         /* make the image button available */
-        gtk_widget_set_sensitive (booth->effects_thumb3_button, TRUE);
+        gtk_widget_set_sensitive (button, TRUE);
+    }
+    else
+    {
+        /* reset the thumbnail to stock imagery */
+        gtk_image_set_from_stock ((GtkImage*)image, "gtk-refresh",
+            GTK_ICON_SIZE_BUTTON);
+        
+        /* make the thumbnail button unavailable */
+        gtk_widget_set_sensitive (button, FALSE);
     }
 }
 
@@ -1302,20 +2054,15 @@ void effects_texture_complete (GPid pid, gint status, DigitalPhotoBooth *booth)
  *  Description:    This function updates the larger effects image
  *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
  *  Outputs:        
- *  Routines Called: get_image_filename_pointer, gdk_pixbuf_new_from_file,
- *                  gtk_image_set_from_pixbuf
+ *  Routines Called: image_cache_lookup, gtk_image_set_from_pixbuf
  *
  *****************************************************************************/
 void effects_update_image (DigitalPhotoBooth *booth)
 {
-    /* get a pointer to the desired image filename */
-    gchar *effects_filename =
-        get_image_filename_pointer (booth->selected_image_index,
-        booth->selected_effect_enum, LARGE, booth);
-    
-    /* load the image into a pixel buffer */
+    /* get the desired image */
     GdkPixbuf *effects_pixbuf =
-        gdk_pixbuf_new_from_file (effects_filename, NULL);
+        image_cache_lookup (booth, booth->selected_image_index,
+        booth->selected_effect_enum, LARGE);
         
     /* set the image to the pixbuf content */
     gtk_image_set_from_pixbuf ((GtkImage*)booth->effects_large_image,
@@ -1329,7 +2076,7 @@ void effects_update_image (DigitalPhotoBooth *booth)
  *  Inputs:         button - a pointer to the button object
  *                  booth - a pointer to the DigitalPhotoBooth struct
  *  Outputs:        
- *  Routines Called: delivery_init, gtk_notebook_next_page
+ *  Routines Called: effects_cancel, delivery_init, gtk_notebook_next_page
  *
  *****************************************************************************/
 void on_effects_forward_button_clicked (GtkWidget *button,
@@ -1338,6 +2085,9 @@ void on_effects_forward_button_clicked (GtkWidget *button,
     /* reset the application timeout */
     app_timeout_reset (booth);
 
+    /* the photo is chosen, the effects of the others are not needed */
+    effects_cancel (booth, booth->selected_image_index);
+
     /* initialize the delivery screen */
     delivery_init (booth);
     
@@ -1470,8 +2220,7 @@ void on_effects_none_button_clicked (GtkWidget *button,
  *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
  *  Outputs:        
  *  Routines Called: gtk_toggle_button_set_active, delivery_update,
- *                  get_image_filename_pointer, gdk_pixbuf_new_from_file,
- *                  gtk_image_set_from_pixbuf
+ *                  image_cache_lookup, gtk_image_set_from_pixbuf
  *
  *****************************************************************************/
 void delivery_init (DigitalPhotoBooth *booth)
@@ -1496,14 +2245,10 @@ void delivery_init (DigitalPhotoBooth *booth)
     /* make sure the delivery screen is updated */
     delivery_update (booth);
 
-    /* get a pointer to the filename of the delivery photo */
-    gchar *delivery_filename =
-        get_image_filename_pointer (booth->selected_image_index,
-        booth->selected_effect_enum, LARGE, booth);
-    
-    /* load the photo into a pixel buffer */
+    /* get the delivery photo */
     GdkPixbuf *delivery_pixbuf =
-        gdk_pixbuf_new_from_file (delivery_filename, NULL);
+        image_cache_lookup (booth, booth->selected_image_index,
+        booth->selected_effect_enum, LARGE);
     
     /* set the image to the pixbuf content */
     gtk_image_set_from_pixbuf ((GtkImage*)booth->delivery_large_image,
@@ -1783,8 +2528,7 @@ void on_delivery_print_toggle_toggled (GtkWidget *button,
  *  Description:    Initialize the finish screen
  *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
  *  Outputs:        
- *  Routines Called: get_image_filename_pointer, gdk_pixbuf_new_from_file,
- *                  gtk_image_set_from_pixbuf
+ *  Routines Called: image_cache_lookup, gtk_image_set_from_pixbuf
  *
  *****************************************************************************/
 void finish_init (DigitalPhotoBooth *booth)
@@ -1808,13 +2552,9 @@ void finish_init (DigitalPhotoBooth *booth)
         gtk_widget_hide (booth->finish_print_frame);
     }
 
-    /* get a pointer to the filename of the delivery photo */
-    gchar *filename =
-        get_image_filename_pointer (booth->selected_image_index,
-        booth->selected_effect_enum, LARGE, booth);
-    
-    /* load the photo into a pixel buffer */
-    GdkPixbuf *pixbuf = gdk_pixbuf_new_from_file (filename, NULL);
+    /* get the delivery photo */
+    GdkPixbuf *pixbuf = image_cache_lookup (booth,
+        booth->selected_image_index, booth->selected_effect_enum, LARGE);
     
     /* set the image to the pixbuf content */
     gtk_image_set_from_pixbuf ((GtkImage*)booth->finish_large_image, pixbuf);
@@ -1902,7 +2642,7 @@ gboolean finish_timer_process (DigitalPhotoBooth *booth)
  *  Inputs:         button - a pointer to the button object
  *                  booth - a pointer to the DigitalPhotoBooth struct
  *  Outputs:        
- *  Routines Called: gtk_notebook_set_current_page
+ *  Routines Called: effects_cancel, gtk_notebook_set_current_page
  *
  *****************************************************************************/
 void on_finish_home_button_clicked (GtkWidget *button,
@@ -1911,6 +2651,9 @@ void on_finish_home_button_clicked (GtkWidget *button,
     /* reset the application timeout */
     app_timeout_cleanup (booth);
 
+    /* the session is over, drop the effects not started yet */
+    effects_cancel (booth, NUM_PHOTOS);
+
     gtk_notebook_set_current_page ((GtkNotebook*)booth->wizard_panel, 0);
 }
 
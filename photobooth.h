@@ -10,6 +10,7 @@
 #include <gtk/gtk.h>
 #include "camera/frame.h"
 #include "camera/drv-v4l2.h"
+#include "camera/cam.h"
 #include "ImageManipulations.h"
 
 #ifndef PREFIX
@@ -23,15 +24,46 @@
 /* location of UI XML file relative to path in which program is running */
 #define BUILDER_XML_FILE DATA_DIR "photobooth.xml"
 
-/* location of the texture file */
+/* location of the texture file */
 #define TEXTURE_FILE DATA_DIR "texture_fabric.gif"
 
+/* environment variable naming the JPEG profile of the photos, see
+ * jpeg_profile_lookup */
+#define JPEG_PROFILE_ENV "PHOTOBOOTH_JPEG_PROFILE"
+
+/* environment variable naming the format the camera sends, "yuyv" (the
+ * default) or "mjpeg" for larger photos at a higher frame rate */
+#define CAMERA_FORMAT_ENV "PHOTOBOOTH_CAMERA_FORMAT"
+
+/* environment variable naming the memory the camera writes the frames to,
+ * "mmap" (the default, the driver's), "userptr" or "dmabuf" (ours) */
+#define CAMERA_MEMORY_ENV "PHOTOBOOTH_CAMERA_MEMORY"
+
+/* environment variable naming the camera, CAMERA_LOCATION by default, or
+ * "replay:file[@fps]" to replay a recording on a machine without camera */
+#define CAMERA_ENV "PHOTOBOOTH_CAMERA"
+
+/* environment variable naming a file to record the frames of the camera
+ * to, the last session is kept */
+#define CAMERA_RECORD_ENV "PHOTOBOOTH_CAMERA_RECORD"
+
+/* environment variable which, when set, shows the frame rate, the dropped
+ * frames and the capture and conversion times over the video */
+#define CAMERA_STATS_ENV "PHOTOBOOTH_CAMERA_STATS"
+
 #define TAKE_PHOTO_TIMER_SECONDS 3
 #define FINISH_USB_TIMER_SECONDS 5
 #define APP_TIMEOUT_SECONDS 120
 #define NUM_PHOTOS 3
 #define MAX_STRING_LENGTH 256
 
+/* image job priorities, the effects of the selected photo are computed first */
+#define EFFECTS_PRIORITY_SELECTED 1
+#define EFFECTS_PRIORITY_OTHER 0
+
+/* memory kept for the decoded images shown by the screens */
+#define IMAGE_CACHE_BUDGET (16 * 1024 * 1024)
+
 enum PHOTO_STYLE
 {
     NONE,
@@ -49,6 +81,16 @@ enum PHOTO_SIZE
     NUM_PHOTO_SIZES
 };
 
+/* progress of the effect of a photo */
+enum EFFECT_STATE
+{
+    EFFECT_UNAVAILABLE,     /* the photo isn't written yet */
+    EFFECT_IDLE,            /* not needed */
+    EFFECT_QUEUED,          /* submitted as an image job */
+    EFFECT_DONE,
+    EFFECT_FAILED
+};
+
 typedef struct
 {
     /* main window */
@@ -78,6 +120,17 @@ typedef struct
     guint num_photos_taken;
     gint take_photo_timer_left;
     guint take_photo_timer_source;
+    struct timeval take_photo_deadline;
+    EncodeQueue *encode_queue;
+    JpegProfile jpeg_profile;
+    fourcc_t camera_format;
+    int camera_memory;
+    const gchar *camera_location;
+    const gchar *camera_record;
+    gboolean camera_stats;
+    guint take_photo_encodes_pending;
+    gboolean take_photo_finishing;
+    gint64 take_photo_trace_start;
     
     /* third panel - photo selection */
     GtkWidget *preview_thumb1_image;
@@ -95,6 +148,9 @@ typedef struct
     GtkWidget *effects_thumb2_button;
     GtkWidget *effects_thumb3_button;
     enum PHOTO_STYLE selected_effect_enum;
+    enum EFFECT_STATE effects_state[NUM_PHOTOS][NUM_PHOTO_STYLES];
+    guint effects_jobs[NUM_PHOTOS][NUM_PHOTO_STYLES];
+    guint effects_generation;
     
     /* fifth panel - delivery selection */
     GtkWidget *delivery_usb_toggle;
@@ -117,8 +173,24 @@ typedef struct
     /* filename variables */
     const gchar *tempdir;
     gchar photos_filenames[NUM_PHOTOS * NUM_PHOTO_STYLES * NUM_PHOTO_SIZES][MAX_STRING_LENGTH];
+    
+    /* decoded images, indexed like photos_filenames */
+    GdkPixbuf *image_cache[NUM_PHOTOS * NUM_PHOTO_STYLES * NUM_PHOTO_SIZES];
+    guint image_cache_used[NUM_PHOTOS * NUM_PHOTO_STYLES * NUM_PHOTO_SIZES];
+    gsize image_cache_bytes;
+    guint image_cache_clock;
 } DigitalPhotoBooth;
 
+/* a photo being encoded */
+typedef struct
+{
+    DigitalPhotoBooth *booth;
+    guint index;
+    guint generation;
+    gint result;
+    VidFrame *images[NUM_PHOTO_SIZES];
+} PhotoEncode;
+
 
 /******************************************************************************
  *
@@ -214,7 +286,8 @@ void app_timeout_cleanup (DigitalPhotoBooth *booth);
  *  Description:    Process the application timeout
  *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
  *  Outputs:        TRUE to schedule the task again, FALSE otherwise
- *  Routines Called: take_photo_cleanup, gtk_notebook_set_current_page
+ *  Routines Called: take_photo_cleanup, effects_reset,
+ *                  gtk_notebook_set_current_page
  *
  *****************************************************************************/
 gboolean app_timeout_idle (DigitalPhotoBooth *booth);
@@ -237,6 +310,99 @@ gboolean app_timeout_idle (DigitalPhotoBooth *booth);
 gchar* get_image_filename_pointer (guint index, enum PHOTO_STYLE pstyle,
     enum PHOTO_SIZE psize, DigitalPhotoBooth *booth);
 
+/******************************************************************************
+ *
+ *  Function:       image_cache_lookup
+ *  Description:    This function returns a decoded image for display. The
+ *                  images made by the pipeline are in the cache already,
+ *                  others are read from their file once.
+ *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
+ *                  index - the index of the image
+ *                  pstyle - the effect of the image
+ *                  psize - the size of the image
+ *  Outputs:        the image, owned by the cache, or NULL on failure
+ *  Routines Called: get_image_filename_pointer, gdk_pixbuf_new_from_file,
+ *                  image_cache_insert
+ *
+ *****************************************************************************/
+GdkPixbuf* image_cache_lookup (DigitalPhotoBooth *booth, guint index,
+    enum PHOTO_STYLE pstyle, enum PHOTO_SIZE psize);
+
+/******************************************************************************
+ *
+ *  Function:       image_cache_store
+ *  Description:    This function keeps an image made by the pipeline, so
+ *                  that the screens never decode its file.
+ *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
+ *                  index - the index of the image
+ *                  pstyle - the effect of the image
+ *                  psize - the size of the image
+ *                  frame - the RGB24 image, the cache takes it over
+ *  Outputs:        
+ *  Routines Called: vidFrameRelease, gdk_pixbuf_new_from_data,
+ *                  image_cache_insert
+ *
+ *****************************************************************************/
+void image_cache_store (DigitalPhotoBooth *booth, guint index,
+    enum PHOTO_STYLE pstyle, enum PHOTO_SIZE psize, VidFrame *frame);
+
+/******************************************************************************
+ *
+ *  Function:       image_cache_insert
+ *  Description:    This function puts an image in a slot of the cache, and
+ *                  evicts the least recently used images until the cache
+ *                  fits in IMAGE_CACHE_BUDGET again.
+ *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
+ *                  slot - the slot of the image, indexed like
+ *                  photos_filenames
+ *                  pixbuf - the image, the cache takes it over
+ *  Outputs:        
+ *  Routines Called: image_cache_drop, gdk_pixbuf_get_rowstride,
+ *                  gdk_pixbuf_get_height
+ *
+ *****************************************************************************/
+void image_cache_insert (DigitalPhotoBooth *booth, guint slot,
+    GdkPixbuf *pixbuf);
+
+/******************************************************************************
+ *
+ *  Function:       image_cache_drop
+ *  Description:    This function removes an image from the cache. Widgets
+ *                  showing it keep their own reference.
+ *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
+ *                  slot - the slot of the image
+ *  Outputs:        
+ *  Routines Called: gdk_pixbuf_get_rowstride, gdk_pixbuf_get_height,
+ *                  g_object_unref
+ *
+ *****************************************************************************/
+void image_cache_drop (DigitalPhotoBooth *booth, guint slot);
+
+/******************************************************************************
+ *
+ *  Function:       image_cache_clear
+ *  Description:    This function empties the cache, when the photos are
+ *                  taken again.
+ *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
+ *  Outputs:        
+ *  Routines Called: image_cache_drop
+ *
+ *****************************************************************************/
+void image_cache_clear (DigitalPhotoBooth *booth);
+
+/******************************************************************************
+ *
+ *  Function:       image_cache_frame_free
+ *  Description:    Callback function which releases the frame holding the
+ *                  pixels of a cached image.
+ *  Inputs:         pixels - the pixels of the image
+ *                  frame - the frame holding them
+ *  Outputs:        
+ *  Routines Called: vidFrameRelease
+ *
+ *****************************************************************************/
+void image_cache_frame_free (guchar *pixels, VidFrame *frame);
+
 
 /* Functions for the first screen */
 
@@ -309,9 +475,13 @@ void on_money_forward_button_clicked (GtkWidget *button,
  *  Description:    Initialize the second screen to take the photos
  *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
  *  Outputs:        
- *  Routines Called: open_camera, g_idle_add, v42lCaptureStartStreaming
- *
- *****************************************************************************/
+ *  Routines Called: open_camera_at, v4l2CaptureStartStreamingMemory,
+ *                  v42lCaptureStartStreaming, v4l2CaptureStartRecording,
+ *                  v4l2CaptureSetHistory, v4l2CaptureStartThread,
+ *                  effects_reset, image_cache_clear,
+ *                  take_photo_live_feed_start
+ *
+ *****************************************************************************/
 void take_photo_init (DigitalPhotoBooth *booth);
 
 /******************************************************************************
@@ -338,19 +508,48 @@ void take_photo_cleanup (DigitalPhotoBooth *booth);
  *****************************************************************************/
 void take_photo_free_frame (guchar *pixels, VidFrame *frame);
 
+/******************************************************************************
+ *
+ *  Function:       take_photo_live_feed_start
+ *  Description:    Start updating the drawing area with the video stream.
+ *                  The update runs whenever the camera has a new frame.
+ *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
+ *  Outputs:        
+ *  Routines Called: v4l2CaptureCreateSource, g_source_set_callback,
+ *                  g_source_attach, g_source_unref
+ *
+ *****************************************************************************/
+void take_photo_live_feed_start (DigitalPhotoBooth *booth);
+
 /******************************************************************************
  *
  *  Function:       take_photo_live_feed_idle
- *  Description:    Callback function which gets a video frame, resizes it,
- *                  and displays it.
+ *  Description:    Callback function which gets a video frame scaled to the
+ *                  display size and displays it. Called when the camera
+ *                  source reports a new frame.
  *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
  *  Outputs:        TRUE to schedule the task again, FALSE otherwise
- *  Routines Called: getFrame, gdk_pixbuf_new_from_data, vidFrameGetImageData,
- *                  gdk_pixbuf_scale_simple, gdk_draw_pixbuf, g_object_unref
+ *  Routines Called: getPreviewFrame, gdk_pixbuf_new_from_data,
+ *                  vidFrameGetImageData, gdk_draw_pixbuf, g_object_unref,
+ *                  take_photo_draw_stats
  *
  *****************************************************************************/
 gboolean take_photo_live_feed_idle (DigitalPhotoBooth *booth);
 
+/******************************************************************************
+ *
+ *  Function:       take_photo_draw_stats
+ *  Description:    Draws the statistics of the camera over the video
+ *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
+ *  Outputs:        
+ *  Routines Called: v4l2CaptureGetStats, g_snprintf,
+ *                  gtk_widget_create_pango_layout,
+ *                  pango_layout_get_pixel_size, gdk_draw_rectangle,
+ *                  gdk_draw_layout, g_object_unref
+ *
+ *****************************************************************************/
+void take_photo_draw_stats (DigitalPhotoBooth *booth);
+
 /******************************************************************************
  *
  *  Function:       take_photo_process
@@ -358,13 +557,53 @@ gboolean take_photo_live_feed_idle (DigitalPhotoBooth *booth);
  *                  the video stream.
  *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
  *  Outputs:        TRUE to schedule the task again, FALSE otherwise
- *  Routines Called: get_image_filename_pointer, sprintf, capture_hr_jpg,
- *                  image_resize, g_idle_add, timer_start, gtk_widget_hide,
- *                  gtk_widget_show
+ *  Routines Called: get_image_filename_pointer, sprintf, g_slice_new0,
+ *                  capture_hr_frame, encode_queue_push,
+ *                  take_photo_live_feed_start, timer_start,
+ *                  v4l2CaptureStopStreaming, gtk_progress_bar_set_text
  *
- *****************************************************************************/
+ *****************************************************************************/
 gboolean take_photo_process (DigitalPhotoBooth *booth);
 
+/******************************************************************************
+ *
+ *  Function:       take_photo_encode_done
+ *  Description:    Called by an encoding thread when a photo and its resized
+ *                  copies are written. Passes the event to the main loop.
+ *  Inputs:         result - 0 on success, nonzero if a file wasn't written
+ *                  encode - the PhotoEncode of the photo
+ *  Outputs:        
+ *  Routines Called: g_warning, g_idle_add
+ *
+ *****************************************************************************/
+void take_photo_encode_done (int result, PhotoEncode *encode);
+
+/******************************************************************************
+ *
+ *  Function:       take_photo_encode_complete_idle
+ *  Description:    Callback function which counts the finished photos and
+ *                  moves to the next screen once the last one is written.
+ *                  The effects of each photo start as soon as it is written.
+ *  Inputs:         encode - the PhotoEncode of the photo
+ *  Outputs:        TRUE to schedule the task again, FALSE otherwise
+ *  Routines Called: effects_photo_ready, image_cache_store,
+ *                  vidFrameRelease, g_slice_free, take_photo_finish
+ *
+ *****************************************************************************/
+gboolean take_photo_encode_complete_idle (PhotoEncode *encode);
+
+/******************************************************************************
+ *
+ *  Function:       take_photo_finish
+ *  Description:    Leave the take photo screen once all photos are written
+ *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
+ *  Outputs:        
+ *  Routines Called: gtk_widget_hide, gtk_widget_show, preview_init,
+ *                  gtk_notebook_next_page
+ *
+ *****************************************************************************/
+void take_photo_finish (DigitalPhotoBooth *booth);
+
 /******************************************************************************
  *
  *  Function:       take_photo_timer_start
@@ -384,7 +623,7 @@ void take_photo_timer_start (DigitalPhotoBooth *booth);
  *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
  *  Outputs:        TRUE to schedule the task again, FALSE otherwise
  *  Routines Called: gtk_progress_bar_set_fraction, sprintf, g_source_remove
- *                  gtk_progress_bar_set_text, g_idle_add
+ *                  gtk_progress_bar_set_text, g_idle_add, v4l2CaptureGetTime
  *
  *****************************************************************************/
 gboolean take_photo_timer_process (DigitalPhotoBooth *booth);
@@ -411,8 +650,8 @@ void on_take_photo_button_clicked (GtkWidget *button,
  *  Description:    Initialize the third screen to preview the photos
  *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
  *  Outputs:        
- *  Routines Called: get_image_filename_pointer, gdk_pixbuf_new_from_file,
- *                  gtk_image_set_from_pixbuf, preview_update_image
+ *  Routines Called: image_cache_lookup, gtk_image_set_from_pixbuf,
+ *                  preview_update_image
  *
  *****************************************************************************/
 void preview_init (DigitalPhotoBooth *booth);
@@ -423,8 +662,7 @@ void preview_init (DigitalPhotoBooth *booth);
  *  Description:    This function updates the larger preview image
  *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
  *  Outputs:        
- *  Routines Called: get_image_filename_pointer, gdk_pixbuf_new_from_file,
- *                  gtk_image_set_from_pixbuf
+ *  Routines Called: image_cache_lookup, gtk_image_set_from_pixbuf
  *
  *****************************************************************************/
 void preview_update_image (DigitalPhotoBooth *booth);
@@ -503,73 +741,140 @@ void on_preview_thumb3_button_clicked (GtkWidget *button,
  *  Description:    Initialize the fourth screen to preview the effects
  *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
  *  Outputs:        
- *  Routines Called: gtk_image_set_from_stock, gtk_widget_set_sensitive,
- *                  get_image_filename_pointer, g_sprintf,
- *                  create_oil_blob_image, g_child_watch_add,
- *                  create_charcoal_image, create_textured_image,
- *                  effects_update_image
+ *  Routines Called: effects_queue, effects_thumb_update,
+ *                  effects_prioritize, effects_update_image
  *
  *****************************************************************************/
 void effects_init (DigitalPhotoBooth *booth);
 
-/******************************************************************************
- *
- *  Function:       effects_init_idle
- *  Description:    Callback function which processes creates the effects
- *                  images
- *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
- *  Outputs:        TRUE to schedule the task again, FALSE otherwise
- *  Routines Called: get_image_filename_pointer, g_sprintf,
- *                  create_oil_blob_image, g_child_watch_add,
- *                  create_charcoal_image, create_textured_image
- *
- *****************************************************************************/
-gboolean effects_init_idle (DigitalPhotoBooth *booth);
+/******************************************************************************
+ *
+ *  Function:       effects_reset
+ *  Description:    This function forgets the effects of the previous
+ *                  photos, and cancels those still being computed.
+ *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
+ *  Outputs:        
+ *  Routines Called: image_job_cancel
+ *
+ *****************************************************************************/
+void effects_reset (DigitalPhotoBooth *booth);
 
 /******************************************************************************
  *
- *  Function:       effects_oilblob_complete
- *  Description:    Callback function for the oilblob process completion
- *  Inputs:         pid - the pid of the exiting process
- *                  status - the exit status of the process *                  booth - a pointer to the DigitalPhotoBooth struct
+ *  Function:       effects_photo_ready
+ *  Description:    This function starts computing the effects of a photo
+ *                  once it is written.
+ *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
+ *                  index - the index of the photo
  *  Outputs:        
- *  Routines Called: get_image_filename_pointer, image_resize,
- *                  gdk_pixbuf_new_from_file, gtk_image_set_from_pixbuf,
- *                  gtk_image_set_sensitive
+ *  Routines Called: effects_start
  *
- *****************************************************************************/
-void effects_oilblob_complete (GPid pid, gint status, 
-    DigitalPhotoBooth *booth);
+ *****************************************************************************/
+void effects_photo_ready (DigitalPhotoBooth *booth, guint index);
 
 /******************************************************************************
  *
- *  Function:       effects_effects_charcoal_complete
- *  Description:    Callback function for the charcoal process completion
- *  Inputs:         pid - the pid of the exiting process
- *                  status - the exit status of the process *                  booth - a pointer to the DigitalPhotoBooth struct
+ *  Function:       effects_queue
+ *  Description:    This function starts again the effects of a written
+ *                  photo which were cancelled or failed.
+ *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
+ *                  index - the index of the photo
  *  Outputs:        
- *  Routines Called: get_image_filename_pointer, image_resize,
- *                  gdk_pixbuf_new_from_file, gtk_image_set_from_pixbuf,
- *                  gtk_image_set_sensitive
+ *  Routines Called: effects_start
  *
- *****************************************************************************/
-void effects_charcoal_complete (GPid pid, gint status, 
-    DigitalPhotoBooth *booth);
+ *****************************************************************************/
+void effects_queue (DigitalPhotoBooth *booth, guint index);
 
 /******************************************************************************
  *
- *  Function:       effects_texture_complete
- *  Description:    Callback function for the texture process completion
- *  Inputs:         pid - the pid of the exiting process
- *                  status - the exit status of the process *                  booth - a pointer to the DigitalPhotoBooth struct
+ *  Function:       effects_cancel
+ *  Description:    This function cancels the effects which are not
+ *                  needed anymore, whether they are waiting or running.
+ *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
+ *                  keep - the index of the photo whose effects are still
+ *                  needed, NUM_PHOTOS to cancel them all
  *  Outputs:        
- *  Routines Called: get_image_filename_pointer, image_resize,
- *                  gdk_pixbuf_new_from_file, gtk_image_set_from_pixbuf,
- *                  gtk_image_set_sensitive
+ *  Routines Called: image_job_cancel
  *
- *****************************************************************************/
-void effects_texture_complete (GPid pid, gint status, 
-    DigitalPhotoBooth *booth);
+ *****************************************************************************/
+void effects_cancel (DigitalPhotoBooth *booth, guint keep);
+
+/******************************************************************************
+ *
+ *  Function:       effects_prioritize
+ *  Description:    This function moves the waiting effects of the selected
+ *                  photo ahead of the others.
+ *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
+ *  Outputs:        
+ *  Routines Called: image_job_set_priority
+ *
+ *****************************************************************************/
+void effects_prioritize (DigitalPhotoBooth *booth);
+
+/******************************************************************************
+ *
+ *  Function:       effects_priority
+ *  Description:    This function gives the image job priority of the
+ *                  effects of a photo.
+ *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
+ *                  index - the index of the photo
+ *  Outputs:        the priority
+ *  Routines Called: 
+ *
+ *****************************************************************************/
+gint effects_priority (DigitalPhotoBooth *booth, guint index);
+
+/******************************************************************************
+ *
+ *  Function:       effects_start
+ *  Description:    This function submits the image job computing an
+ *                  effect of a photo in the background.
+ *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
+ *                  index - the index of the photo
+ *                  style - the effect
+ *  Outputs:        
+ *  Routines Called: get_image_filename_pointer, g_sprintf,
+ *                  effects_priority, create_oil_blob_image,
+ *                  create_charcoal_image, create_textured_image
+ *
+ *****************************************************************************/
+void effects_start (DigitalPhotoBooth *booth, guint index,
+    enum PHOTO_STYLE style);
+
+/******************************************************************************
+ *
+ *  Function:       effects_job_complete
+ *  Description:    Callback function for the end of an effect image job.
+ *                  Keeps the copies of the effect for display, and shows
+ *                  it if the customer is waiting for it.
+ *  Inputs:         id - the id of the image job
+ *                  status - how the image job ended
+ *                  small - the small copy of the effect, or NULL
+ *                  large - the large copy of the effect, or NULL
+ *                  booth - a pointer to the DigitalPhotoBooth struct
+ *  Outputs:        
+ *  Routines Called: vidFrameRelease, image_cache_store, app_timeout_reset,
+ *                  effects_thumb_update
+ *
+ *****************************************************************************/
+void effects_job_complete (guint id, ImageJobStatus status,
+    VidFrame *small, VidFrame *large, DigitalPhotoBooth *booth);
+
+/******************************************************************************
+ *
+ *  Function:       effects_thumb_update
+ *  Description:    This function shows the thumbnail of an effect of the
+ *                  selected photo once it is computed, and makes its button
+ *                  available. Until then the button shows a stock image.
+ *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
+ *                  style - the effect
+ *  Outputs:        
+ *  Routines Called: image_cache_lookup, gtk_image_set_from_pixbuf,
+ *                  gtk_image_set_from_stock,
+ *                  gtk_widget_set_sensitive
+ *
+ *****************************************************************************/
+void effects_thumb_update (DigitalPhotoBooth *booth, enum PHOTO_STYLE style);
 
 /******************************************************************************
  *
@@ -577,8 +882,7 @@ void effects_texture_complete (GPid pid, gint status,
  *  Description:    This function updates the larger effects image
  *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
  *  Outputs:        
- *  Routines Called: get_image_filename_pointer, gdk_pixbuf_new_from_file,
- *                  gtk_image_set_from_pixbuf
+ *  Routines Called: image_cache_lookup, gtk_image_set_from_pixbuf
  *
  *****************************************************************************/
 void effects_update_image (DigitalPhotoBooth *booth);
@@ -772,8 +1076,7 @@ void on_delivery_print_toggle_toggled (GtkWidget *button,
  *  Description:    Initialize the finish screen
  *  Inputs:         booth - a pointer to the DigitalPhotoBooth struct
  *  Outputs:        
- *  Routines Called: get_image_filename_pointer, gdk_pixbuf_new_from_file,
- *                  gtk_image_set_from_pixbuf
+ *  Routines Called: image_cache_lookup, gtk_image_set_from_pixbuf
  *
  *****************************************************************************/
 void finish_init (DigitalPhotoBooth *booth);
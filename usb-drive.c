@@ -6,6 +6,7 @@
  */
 
 #include "usb-drive.h"
+#include "camera/trace.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -201,11 +202,31 @@ int unmountUSBDrive(){
  * Returns 0 if successful, nonzero if an error occurred.
  */
 int writeFileToUSBDrive(char *fileName){
+  int64_t traceStart = traceBegin();
+  int retVal;
+
   /* The USB drive mount point */
   char usbDriveName[ 100 ];
   memset( usbDriveName, 0, 100 );
   getUSBDriveName( usbDriveName );
 
+  retVal = writeFileToDrive( fileName, usbDriveName );
+
+  traceEnd( "writeFileToUSBDrive", traceStart );
+
+  return retVal;
+}
+
+/* writeFileToDrive()
+ * Writes a file to the DigitalPhotoBooth folder of the drive mounted at
+ *  driveName, see writeFileToUSBDrive.
+ */
+int writeFileToDrive(char *fileName, const char *driveName){
+  /* The USB drive mount point, followed by the path of the output file */
+  char usbDriveName[ 100 ];
+  memset( usbDriveName, 0, 100 );
+  strncpy( usbDriveName, driveName, 99 );
+
   /* Stuff having to do with searching through directories */
   DIR *usbDrive;
   struct dirent *ep;
@@ -44,4 +44,16 @@ int unmountUSBDrive();
  */
 int writeFileToUSBDrive(char *fileName);
 
+/* writeFileToDrive()
+ * Same as writeFileToUSBDrive, for the drive mounted at driveName, e.g. a
+ *  scratch directory when benchmarking the copy.
+ *
+ * Parameters:
+ *  fileName: the name of the file (current directory or path) to write
+ *  driveName: the mount point of the drive
+ *
+ * Returns 0 if successful, nonzero if an error occurred.
+ */
+int writeFileToDrive(char *fileName, const char *driveName);
+
 #endif